@@ -0,0 +1,117 @@
+/* Copyright 2013 Martin Hundebøll <martin@hundeboll.net> */
+
+#ifndef FOX_ACK_SCHEDULER_HPP_
+#define FOX_ACK_SCHEDULER_HPP_
+
+#include <mutex>
+#include <map>
+#include <vector>
+#include <algorithm>
+
+#include "fox.hpp"
+#include "key.hpp"
+
+/* number of consecutive blocks covered by one cumulative ack */
+#define ACK_WINDOW_BLOCKS 64
+#define ACK_WINDOW_SIZE (ACK_WINDOW_BLOCKS/8)
+
+/**
+ * struct ack_window - acknowledged blocks of one flow
+ * @flow: source and destination of the flow; block is the first block
+ *        covered by the bitmap
+ * @bitmap: bit i is set if block flow.block + i is acknowledged
+ */
+struct ack_window {
+    key flow;
+    uint8_t bitmap[ACK_WINDOW_SIZE];
+};
+
+/**
+ * class ack_scheduler - collect acknowledgements per flow
+ *
+ * Coders schedule acknowledgements for their block instead of sending them
+ * directly. The scheduler is emptied periodically, and all blocks pending
+ * for a flow are sent as bitmaps in as few frames as possible. A block that
+ * should be acknowledged more than once stays pending for that number of
+ * rounds, so repeated acknowledgements are spread out in time and shared
+ * with other blocks of the same flow.
+ */
+class ack_scheduler
+{
+    typedef std::map<size_t, size_t> block_map;
+    typedef std::map<key, block_map> flow_map;
+
+    std::mutex m_lock;
+    flow_map m_flows;
+
+  public:
+    /**
+     * add() - schedule acknowledgement of a block
+     * @param k Key of the acknowledged block.
+     * @param copies Number of rounds to include the block in.
+     *
+     * Scheduling a block that is already pending does not add more copies
+     * than the largest number requested.
+     */
+    void add(const key &k, size_t copies)
+    {
+        key flow(k.src, k.dst, 0);
+
+        guard g(m_lock);
+
+        size_t &c(m_flows[flow][k.block]);
+        c = std::max(c, copies);
+    }
+
+    /**
+     * pop() - take one round of acknowledgements
+     *
+     * Returns a window for each range of pending blocks in each flow, and
+     * removes blocks that have been included the requested number of times.
+     */
+    std::vector<ack_window> pop()
+    {
+        std::vector<ack_window> windows;
+        flow_map::iterator f;
+        block_map::iterator b;
+        ack_window *w;
+        size_t offset;
+
+        guard g(m_lock);
+
+        for (f = m_flows.begin(); f != m_flows.end();) {
+            block_map &blocks(f->second);
+            w = NULL;
+
+            for (b = blocks.begin(); b != blocks.end();) {
+                offset = w ? b->first - w->flow.block : 0;
+
+                /* start new window if block is outside the current one */
+                if (!w || offset >= ACK_WINDOW_BLOCKS) {
+                    windows.push_back(ack_window());
+                    w = &windows.back();
+                    w->flow = f->first;
+                    w->flow.block = b->first;
+                    memset(w->bitmap, 0, ACK_WINDOW_SIZE);
+                    offset = 0;
+                }
+
+                w->bitmap[offset/8] |= 1 << (offset % 8);
+
+                if (--b->second == 0)
+                    blocks.erase(b++);
+                else
+                    ++b;
+            }
+
+            if (blocks.empty())
+                m_flows.erase(f++);
+            else
+                ++f;
+        }
+
+        return windows;
+    }
+};
+
+#endif
@@ -0,0 +1,571 @@
+/* Copyright 2013 Martin Hundebøll <martin@hundeboll.net> */
+
+#ifndef FOX_ADMISSION_QUEUE_HPP_
+#define FOX_ADMISSION_QUEUE_HPP_
+
+#include <mutex>
+#include <chrono>
+#include <atomic>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+
+#include "fox.hpp"
+#include "key.hpp"
+
+/* seconds to keep statistics of flows without generations to admit */
+#define ADMISSION_STATS_AGE 60
+
+/**
+ * class admission_client - generation that can be admitted later
+ */
+class admission_client
+{
+  public:
+    typedef boost::weak_ptr<admission_client> weak_pointer;
+
+    /**
+     * admission_start() - start generation admitted after waiting
+     * @param ticket Ticket the generation requested admission with.
+     */
+    virtual void admission_start(size_t ticket) = 0;
+
+    virtual ~admission_client()
+    {}
+};
+
+/**
+ * class admission_queue - limit number of generations being encoded
+ *
+ * Full generations request admission with a ticket and are started by their
+ * client when a slot is free, so no thread waits for admission. Waiting
+ * generations are queued per flow, and flows are served in round robin order
+ * when slots are released, so that a flow with many full generations cannot
+ * take all slots from flows with few.
+ *
+ * Waiting generations, flows and slots are kept in tables allocated when
+ * the queue is created, so requesting admission never allocates memory.
+ * Generations are linked to the flow they wait in, and flows with waiting
+ * generations are linked in a ring. If a table is full, the generation is
+ * admitted at once beyond the limit and counted as an overflow.
+ *
+ * The time generations wait for admission is accumulated per flow, and
+ * statistics of flows are dropped when the flows have been idle for
+ * ADMISSION_STATS_AGE seconds.
+ */
+class admission_queue
+{
+  public:
+    typedef std::chrono::steady_clock clock;
+
+    /**
+     * struct flow_stats - admission statistics of one flow
+     * @flow: source and destination of the flow
+     * @queued: number of generations waiting for admission
+     * @admitted: number of generations admitted
+     * @delay_us: total time spent waiting in microseconds
+     * @max_delay_us: longest time spent waiting in microseconds
+     * @used: time a generation of the flow last requested admission
+     */
+    struct flow_stats {
+        key flow;
+        size_t queued;
+        size_t admitted;
+        size_t delay_us;
+        size_t max_delay_us;
+        clock::time_point used;
+    };
+
+  private:
+    static const size_t none = static_cast<size_t>(-1);
+
+    /**
+     * struct entry - generation waiting for admission
+     * @ticket: ticket the generation requested admission with
+     * @client: generation to start when admitted
+     * @queued: time the generation requested admission
+     * @next: next generation of the flow, or next free entry
+     */
+    struct entry {
+        size_t ticket;
+        admission_client::weak_pointer client;
+        clock::time_point queued;
+        size_t next;
+    };
+
+    /**
+     * struct flow - flow with statistics and waiting generations
+     * @stats: admission statistics of the flow
+     * @head: first waiting generation
+     * @tail: last waiting generation
+     * @next: next flow in the ring of flows with waiting generations, or
+     *        none if no generations are waiting
+     * @used: whether the flow is in use
+     */
+    struct flow {
+        flow_stats stats;
+        size_t head, tail, next;
+        bool used;
+    };
+
+    std::mutex m_lock;
+    std::vector<entry> m_entries;
+    std::vector<flow> m_flows;
+    std::vector<uint64_t> m_busy;
+    std::vector<size_t> m_active;
+    size_t m_free, m_ready, m_limit, m_admitted, m_queued, m_overflows;
+    std::atomic<size_t> m_tickets;
+
+    /**
+     * find_flow() - return index of flow or none if not found
+     * @param k Source and destination of the flow.
+     * @param now Time to mark the flow used at.
+     *
+     * Adds the flow if it is not found. If the table is full, the flow
+     * that was used least recently and has no waiting generations is
+     * replaced.
+     */
+    size_t find_flow(const key &k, clock::time_point now)
+    {
+        size_t unused = none, idle = none;
+
+        for (size_t i = 0; i < m_flows.size(); ++i) {
+            flow &f(m_flows[i]);
+
+            if (!f.used) {
+                if (unused == none)
+                    unused = i;
+                continue;
+            }
+
+            if (f.stats.flow == k)
+                return i;
+
+            if (f.stats.queued == 0 &&
+                (idle == none || f.stats.used < m_flows[idle].stats.used))
+                idle = i;
+        }
+
+        if (unused == none)
+            unused = idle;
+
+        if (unused == none)
+            return none;
+
+        flow &f(m_flows[unused]);
+        f.stats.flow = k;
+        f.stats.queued = f.stats.admitted = 0;
+        f.stats.delay_us = f.stats.max_delay_us = 0;
+        f.stats.used = now;
+        f.head = f.tail = f.next = none;
+        f.used = true;
+
+        return unused;
+    }
+
+    void admit(flow_stats &s, clock::time_point queued)
+    {
+        using std::chrono::duration_cast;
+        using std::chrono::microseconds;
+
+        size_t us = duration_cast<microseconds>(clock::now() - queued).count();
+
+        s.admitted++;
+        s.delay_us += us;
+        s.max_delay_us = std::max(s.max_delay_us, us);
+    }
+
+    /**
+     * activate() - take a free slot for a ticket
+     */
+    void activate(size_t ticket)
+    {
+        for (size_t w = 0; w < m_busy.size(); ++w) {
+            if (m_busy[w] == ~0ULL)
+                continue;
+
+            size_t bit = __builtin_ctzll(~m_busy[w]);
+            m_busy[w] |= 1ULL << bit;
+            m_active[w*64 + bit] = ticket;
+            m_admitted++;
+            return;
+        }
+    }
+
+    /**
+     * deactivate() - free slot of a ticket
+     *
+     * Returns false if the ticket has no slot.
+     */
+    bool deactivate(size_t ticket)
+    {
+        for (size_t i = 0; i < m_limit; ++i) {
+            if (m_active[i] != ticket)
+                continue;
+
+            m_active[i] = 0;
+            m_busy[i/64] &= ~(1ULL << (i % 64));
+            m_admitted--;
+            return true;
+        }
+
+        return false;
+    }
+
+    /**
+     * ready_add() - add flow to the back of the ring of waiting flows
+     */
+    void ready_add(size_t i)
+    {
+        if (m_ready == none) {
+            m_flows[i].next = i;
+        } else {
+            m_flows[i].next = m_flows[m_ready].next;
+            m_flows[m_ready].next = i;
+        }
+
+        m_ready = i;
+    }
+
+    /**
+     * ready_remove() - remove flow from the ring of waiting flows
+     */
+    void ready_remove(size_t i)
+    {
+        size_t prev = m_ready;
+
+        while (m_flows[prev].next != i)
+            prev = m_flows[prev].next;
+
+        if (prev == i)
+            m_ready = none;
+        else
+            m_flows[prev].next = m_flows[i].next;
+
+        if (m_ready == i)
+            m_ready = prev;
+
+        m_flows[i].next = none;
+    }
+
+    /**
+     * free_entry() - give entry back to the free list
+     */
+    void free_entry(size_t i)
+    {
+        m_entries[i].client.reset();
+        m_entries[i].next = m_free;
+        m_free = i;
+    }
+
+    /**
+     * admit_next() - admit next waiting generation if a slot is free
+     * @param client Set to the client of the admitted generation.
+     *
+     * Must be called with m_lock held. Returns the ticket of the admitted
+     * generation, or zero if none is admitted. The client must be started
+     * after releasing the lock.
+     */
+    size_t admit_next(admission_client::weak_pointer &client)
+    {
+        if (m_admitted >= m_limit || m_ready == none)
+            return 0;
+
+        size_t i = m_flows[m_ready].next;
+        flow &f(m_flows[i]);
+        size_t n = f.head;
+        entry &e(m_entries[n]);
+        size_t ticket = e.ticket;
+
+        /* move flow behind other waiting flows */
+        f.head = e.next;
+        if (f.head == none) {
+            f.tail = none;
+            ready_remove(i);
+        } else {
+            m_ready = i;
+        }
+
+        m_queued--;
+        f.stats.queued--;
+        admit(f.stats, e.queued);
+        activate(ticket);
+        client.swap(e.client);
+        free_entry(n);
+
+        return ticket;
+    }
+
+    /**
+     * cancel() - remove waiting generation from its flow
+     */
+    void cancel(const key &k, size_t ticket)
+    {
+        size_t i, n, prev = none;
+
+        for (i = 0; i < m_flows.size(); ++i)
+            if (m_flows[i].used && m_flows[i].stats.flow == k)
+                break;
+
+        if (i == m_flows.size())
+            return;
+
+        flow &f(m_flows[i]);
+
+        for (n = f.head; n != none; prev = n, n = m_entries[n].next) {
+            if (m_entries[n].ticket != ticket)
+                continue;
+
+            if (prev == none)
+                f.head = m_entries[n].next;
+            else
+                m_entries[prev].next = m_entries[n].next;
+
+            if (f.tail == n)
+                f.tail = prev;
+
+            m_queued--;
+            f.stats.queued--;
+            free_entry(n);
+            break;
+        }
+
+        if (f.head == none && f.next != none)
+            ready_remove(i);
+    }
+
+  public:
+    /**
+     * admission_queue() - create queue
+     * @param limit Number of generations that can be admitted at a time.
+     * @param capacity Number of generations that can wait for admission,
+     *        and number of flows to keep statistics of.
+     */
+    admission_queue(size_t limit, size_t capacity)
+        : m_entries(capacity), m_flows(capacity), m_busy((limit + 63)/64),
+          m_active(limit, 0), m_free(none), m_ready(none), m_limit(limit),
+          m_admitted(0), m_queued(0), m_overflows(0), m_tickets(0)
+    {
+        for (size_t i = capacity; i > 0; --i)
+            free_entry(i - 1);
+
+        for (auto &f : m_flows)
+            f.used = false;
+
+        /* mark bits beyond the limit as busy */
+        if (limit % 64)
+            m_busy.back() = ~0ULL << (limit % 64);
+    }
+
+    /**
+     * ticket() - return new ticket to request admission with
+     *
+     * Tickets are never zero.
+     */
+    size_t ticket()
+    {
+        return ++m_tickets;
+    }
+
+    /**
+     * request() - request admission of a generation
+     * @param k Key of the generation.
+     * @param ticket Ticket from ticket().
+     * @param client Generation to start with the ticket when it is
+     *        admitted later.
+     *
+     * Returns true if the generation is admitted at once, in which case
+     * the client is not started.
+     */
+    bool request(const key &k, size_t ticket,
+                 const admission_client::weak_pointer &client)
+    {
+        key flow_key(k.src, k.dst, 0);
+        clock::time_point now = clock::now();
+
+        guard g(m_lock);
+
+        size_t i = find_flow(flow_key, now);
+
+        if (i != none)
+            m_flows[i].stats.used = now;
+
+        if (m_admitted < m_limit && m_ready == none) {
+            if (i != none)
+                admit(m_flows[i].stats, now);
+            activate(ticket);
+            return true;
+        }
+
+        if (i == none || m_free == none) {
+            m_overflows++;
+            return true;
+        }
+
+        flow &f(m_flows[i]);
+        size_t n = m_free;
+        entry &e(m_entries[n]);
+
+        m_free = e.next;
+        e.ticket = ticket;
+        e.client = client;
+        e.queued = now;
+        e.next = none;
+
+        if (f.head == none) {
+            f.head = n;
+            ready_add(i);
+        } else {
+            m_entries[f.tail].next = n;
+        }
+
+        f.tail = n;
+        m_queued++;
+        f.stats.queued++;
+
+        return false;
+    }
+
+    /**
+     * release() - release slot or cancel request of a generation
+     * @param k Key of the generation.
+     * @param ticket Ticket the generation requested admission with.
+     *
+     * Admits a waiting generation if a slot is released. Releasing a ticket
+     * that is neither admitted nor waiting does nothing.
+     */
+    void release(const key &k, size_t ticket)
+    {
+        admission_client::weak_pointer client;
+        size_t start = 0;
+
+        {
+            guard g(m_lock);
+
+            if (deactivate(ticket))
+                start = admit_next(client);
+            else
+                cancel(key(k.src, k.dst, 0), ticket);
+        }
+
+        if (!start)
+            return;
+
+        boost::shared_ptr<admission_client> c(client.lock());
+
+        if (c)
+            c->admission_start(start);
+    }
+
+    /**
+     * available() - return number of free slots
+     *
+     * Negative if generations are waiting for admission.
+     */
+    ssize_t available()
+    {
+        guard g(m_lock);
+
+        return static_cast<ssize_t>(m_limit) -
+               static_cast<ssize_t>(m_admitted + m_queued);
+    }
+
+    /**
+     * overflows() - return number of generations admitted beyond the limit
+     */
+    size_t overflows()
+    {
+        guard g(m_lock);
+
+        return m_overflows;
+    }
+
+    /**
+     * get_stats() - return statistics of flows
+     *
+     * Also drops statistics of idle flows.
+     */
+    std::vector<flow_stats> get_stats()
+    {
+        std::chrono::seconds age(ADMISSION_STATS_AGE);
+        clock::time_point now = clock::now();
+        std::vector<flow_stats> v;
+
+        guard g(m_lock);
+
+        for (auto &f : m_flows) {
+            if (!f.used)
+                continue;
+
+            if (f.stats.queued == 0 && now - f.stats.used > age) {
+                f.used = false;
+                continue;
+            }
+
+            v.push_back(f.stats);
+        }
+
+        return v;
+    }
+};
+
+/**
+ * class admission_api - give coders access to an admission queue
+ */
+class admission_api
+{
+    admission_queue *m_admission;
+
+  protected:
+    /**
+     * admission_ticket() - return new admission ticket
+     */
+    size_t admission_ticket()
+    {
+        return m_admission ? m_admission->ticket() : 1;
+    }
+
+    /**
+     * admission_request() - request admission of a generation
+     *
+     * Generations are admitted at once if no admission queue is set.
+     */
+    bool admission_request(const key &k, size_t ticket,
+                           const admission_client::weak_pointer &client)
+    {
+        return m_admission ? m_admission->request(k, ticket, client) : true;
+    }
+
+    void admission_release(const key &k, size_t ticket)
+    {
+        if (m_admission)
+            m_admission->release(k, ticket);
+    }
+
+    ssize_t admission_available()
+    {
+        return m_admission ? m_admission->available() : 1;
+    }
+
+    bool has_admission()
+    {
+        return (m_admission != NULL);
+    }
+
+    admission_queue *get_admission()
+    {
+        return m_admission;
+    }
+
+  public:
+    void set_admission(admission_queue *admission)
+    {
+        m_admission = admission;
+    }
+
+    admission_api() : m_admission(NULL)
+    {}
+};
+
+#endif
@@ -0,0 +1,76 @@
+/* Copyright 2013 Martin Hundebøll <martin@hundeboll.net> */
+
+#ifndef FOX_ALIGNED_ALLOC_HPP_
+#define FOX_ALIGNED_ALLOC_HPP_
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <memory>
+#include <new>
+
+#ifndef FOX_NO_ARENA
+#include "arena.hpp"
+#endif
+
+/* cache line size, which is also enough for the widest vector loads */
+#define FOX_ALIGNMENT 64
+
+/**
+ * align_up() - round size up to a multiple of the alignment
+ */
+inline size_t align_up(size_t size, size_t alignment = FOX_ALIGNMENT)
+{
+    return (size + alignment - 1) / alignment * alignment;
+}
+
+/**
+ * aligned_allocate() - allocate memory starting on an alignment boundary
+ * @param size Number of bytes to allocate.
+ *
+ * Memory is taken from the process arena if enabled, and from the heap
+ * otherwise. It must be released with aligned_release(). Tests built with
+ * FOX_NO_ARENA always use the heap, so they don't link with the arena.
+ */
+inline uint8_t *aligned_allocate(size_t size)
+{
+    void *mem;
+
+#ifndef FOX_NO_ARENA
+    arena *a = arena::instance();
+    uint8_t *ptr;
+
+    if (a && (ptr = a->allocate(size)))
+        return ptr;
+#endif
+
+    if (posix_memalign(&mem, FOX_ALIGNMENT, size))
+        throw std::bad_alloc();
+
+    return static_cast<uint8_t *>(mem);
+}
+
+inline void aligned_release(uint8_t *ptr)
+{
+#ifndef FOX_NO_ARENA
+    arena *a = arena::instance();
+
+    if (a && a->owns(ptr)) {
+        a->release(ptr);
+        return;
+    }
+#endif
+
+    free(ptr);
+}
+
+struct aligned_deleter
+{
+    void operator()(uint8_t *ptr) const
+    {
+        aligned_release(ptr);
+    }
+};
+
+typedef std::unique_ptr<uint8_t, aligned_deleter> aligned_ptr;
+
+#endif
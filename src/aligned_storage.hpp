@@ -0,0 +1,162 @@
+/* Copyright 2013 Martin Hundebøll <martin@hundeboll.net> */
+
+#ifndef FOX_ALIGNED_STORAGE_HPP_
+#define FOX_ALIGNED_STORAGE_HPP_
+
+#include <string.h>
+
+#include <kodo/shallow_symbol_storage.hpp>
+
+#include "aligned_alloc.hpp"
+
+namespace kodo
+{
+    /**
+     * class aligned_symbol_storage - deep symbol storage with aligned symbols
+     *
+     * Allocates storage for all symbols, with each symbol starting on an
+     * alignment boundary, and points the underlying shallow storage at it.
+     * Symbols are padded to a multiple of the alignment, so the padding
+     * never goes on the wire.
+     */
+    template<class SuperCoder>
+    class aligned_symbol_storage : public SuperCoder
+    {
+      public:
+        typedef typename SuperCoder::factory factory;
+
+        void initialize(const factory &the_factory)
+        {
+            SuperCoder::initialize(the_factory);
+
+            uint32_t symbols = SuperCoder::symbols();
+            uint32_t size = SuperCoder::symbol_size();
+
+            m_stride = align_up(size);
+
+            if (m_allocated < symbols * m_stride) {
+                m_allocated = symbols * m_stride;
+                m_data.reset(aligned_allocate(m_allocated));
+            }
+
+            memset(m_data.get(), 0, symbols * m_stride);
+
+            for (uint32_t i = 0; i < symbols; i++) {
+                sak::mutable_storage s(m_data.get() + i * m_stride, size);
+                SuperCoder::set_symbol(i, s);
+            }
+        }
+
+        /**
+         * set_symbol() - copy symbol into storage
+         */
+        void set_symbol(uint32_t index, const sak::const_storage &symbol)
+        {
+            memcpy(SuperCoder::symbol(index), symbol.m_data, symbol.m_size);
+        }
+
+        /**
+         * set_symbols() - copy consecutive symbols into storage
+         */
+        void set_symbols(const sak::const_storage &symbols)
+        {
+            uint32_t size = SuperCoder::symbol_size();
+
+            for (uint32_t i = 0; i * size < symbols.m_size; i++)
+                memcpy(SuperCoder::symbol(i), symbols.m_data + i * size,
+                       size);
+        }
+
+        size_t symbol_stride() const
+        {
+            return m_stride;
+        }
+
+        /**
+         * release_symbols() - free symbol storage until next initialize()
+         */
+        void release_symbols()
+        {
+            m_data.reset();
+            m_allocated = 0;
+        }
+
+      protected:
+        aligned_ptr m_data;
+        size_t m_allocated = {0};
+        size_t m_stride = {0};
+    };
+
+    /**
+     * class aligned_coefficient_storage - coefficient vectors on alignment
+     * boundaries
+     *
+     * Replaces coefficient_storage and keeps each coefficient vector on its
+     * own aligned stride.
+     */
+    template<class SuperCoder>
+    class aligned_coefficient_storage : public SuperCoder
+    {
+      public:
+        typedef typename SuperCoder::factory factory;
+        typedef typename SuperCoder::value_type value_type;
+
+        void initialize(const factory &the_factory)
+        {
+            SuperCoder::initialize(the_factory);
+
+            uint32_t symbols = SuperCoder::symbols();
+
+            m_stride = align_up(SuperCoder::coefficients_size());
+
+            if (m_allocated < symbols * m_stride) {
+                m_allocated = symbols * m_stride;
+                m_data.reset(aligned_allocate(m_allocated));
+            }
+
+            memset(m_data.get(), 0, symbols * m_stride);
+        }
+
+        uint8_t *coefficients(uint32_t index)
+        {
+            return m_data.get() + index * m_stride;
+        }
+
+        const uint8_t *coefficients(uint32_t index) const
+        {
+            return m_data.get() + index * m_stride;
+        }
+
+        value_type *coefficients_value(uint32_t index)
+        {
+            return reinterpret_cast<value_type *>(coefficients(index));
+        }
+
+        const value_type *coefficients_value(uint32_t index) const
+        {
+            return reinterpret_cast<const value_type *>(coefficients(index));
+        }
+
+        void set_coefficients(uint32_t index, const sak::const_storage &storage)
+        {
+            memcpy(coefficients(index), storage.m_data, storage.m_size);
+        }
+
+        /**
+         * release_coefficients() - free coefficient storage until next
+         * initialize()
+         */
+        void release_coefficients()
+        {
+            m_data.reset();
+            m_allocated = 0;
+        }
+
+      protected:
+        aligned_ptr m_data;
+        size_t m_allocated = {0};
+        size_t m_stride = {0};
+    };
+};  // namespace kodo
+
+#endif
@@ -0,0 +1,136 @@
+/* Copyright 2013 Martin Hundebøll <martin@hundeboll.net> */
+
+#include <sys/mman.h>
+
+#include "fox.hpp"
+#include "arena.hpp"
+#include "aligned_alloc.hpp"
+
+std::atomic<arena *> arena::s_arena(NULL);
+
+/* header in front of each buffer; keeps buffers aligned */
+#define ARENA_HEADER FOX_ALIGNMENT
+
+arena::~arena()
+{
+    for (auto &c : m_chunks)
+        munmap(c.base, c.size);
+}
+
+uint8_t *arena::map_chunk(size_t size)
+{
+    void *ptr;
+    chunk c;
+
+    ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    c.huge = true;
+
+    if (ptr == MAP_FAILED) {
+        VLOG(LOG_OBJ) << "Arena: No huge pages available, using regular pages";
+        ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        c.huge = false;
+    }
+
+    if (ptr == MAP_FAILED) {
+        LOG(ERROR) << "Arena: Failed to map " << size << " bytes";
+        return NULL;
+    }
+
+#ifdef MADV_HUGEPAGE
+    /* let transparent huge pages back the chunk if possible */
+    if (!c.huge)
+        madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+
+    c.base = static_cast<uint8_t *>(ptr);
+    c.size = size;
+    m_chunks.push_back(c);
+
+    VLOG(LOG_OBJ) << "Arena: Mapped " << (c.huge ? "huge " : "")
+                  << "chunk of " << size << " bytes";
+
+    return c.base;
+}
+
+uint8_t *arena::allocate(size_t size)
+{
+    size_t block = align_up(size) + ARENA_HEADER;
+    uint8_t *ptr;
+
+    guard g(m_lock);
+
+    std::vector<uint8_t *> &free_list(m_free[block]);
+
+    if (!free_list.empty()) {
+        ptr = free_list.back();
+        free_list.pop_back();
+        m_cached -= block;
+    } else if (block > ARENA_CHUNK_SIZE) {
+        /* too large for shared chunks; give it chunks of its own */
+        ptr = map_chunk(align_up(block, ARENA_CHUNK_SIZE));
+        if (!ptr)
+            return NULL;
+    } else {
+        if (m_left < block) {
+            m_next = map_chunk(ARENA_CHUNK_SIZE);
+            m_left = m_next ? ARENA_CHUNK_SIZE : 0;
+        }
+
+        if (m_left < block)
+            return NULL;
+
+        ptr = m_next;
+        m_next += block;
+        m_left -= block;
+    }
+
+    *reinterpret_cast<size_t *>(ptr) = block;
+    m_in_use += block;
+
+    return ptr + ARENA_HEADER;
+}
+
+void arena::release(uint8_t *ptr)
+{
+    size_t block;
+
+    ptr -= ARENA_HEADER;
+    block = *reinterpret_cast<size_t *>(ptr);
+
+    guard g(m_lock);
+
+    m_free[block].push_back(ptr);
+    m_in_use -= block;
+    m_cached += block;
+}
+
+bool arena::owns(const uint8_t *ptr)
+{
+    guard g(m_lock);
+
+    for (auto &c : m_chunks)
+        if (ptr >= c.base && ptr < c.base + c.size)
+            return true;
+
+    return false;
+}
+
+arena::stats arena::get_stats()
+{
+    stats s = {0, 0, 0, 0, 0};
+
+    guard g(m_lock);
+
+    for (auto &c : m_chunks) {
+        s.chunks++;
+        s.huge_chunks += c.huge;
+        s.mapped += c.size;
+    }
+
+    s.in_use = m_in_use;
+    s.cached = m_cached;
+
+    return s;
+}
@@ -0,0 +1,107 @@
+/* Copyright 2013 Martin Hundebøll <martin@hundeboll.net> */
+
+#ifndef FOX_ARENA_HPP_
+#define FOX_ARENA_HPP_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <map>
+
+#define ARENA_CHUNK_SIZE (2 << 20)
+
+/**
+ * class arena - huge page backed allocator for generation buffers
+ *
+ * Memory is mapped in chunks of 2 MB huge pages, falling back to regular
+ * pages if no huge pages are available. Buffers are carved out of the
+ * chunks and kept in per-size free lists when released, so that coders
+ * with equal generation sizes reuse each others memory instead of going
+ * through the heap.
+ *
+ * Each buffer is preceded by a small header with its size, and buffers
+ * start on FOX_ALIGNMENT boundaries.
+ */
+class arena
+{
+    struct chunk {
+        uint8_t *base;
+        size_t size;
+        bool huge;
+    };
+
+    static std::atomic<arena *> s_arena;
+
+    std::mutex m_lock;
+    std::vector<chunk> m_chunks;
+    std::map<size_t, std::vector<uint8_t *>> m_free;
+    uint8_t *m_next;
+    size_t m_left, m_in_use, m_cached;
+
+    /**
+     * map_chunk() - map new chunk of memory
+     * @param size Size of chunk; multiple of ARENA_CHUNK_SIZE.
+     *
+     * Returns start of chunk or NULL if mapping failed.
+     */
+    uint8_t *map_chunk(size_t size);
+
+  public:
+    struct stats {
+        size_t chunks;
+        size_t huge_chunks;
+        size_t mapped;
+        size_t in_use;
+        size_t cached;
+    };
+
+    arena() : m_next(NULL), m_left(0), m_in_use(0), m_cached(0)
+    {}
+
+    ~arena();
+
+    /**
+     * allocate() - take buffer from arena
+     * @param size Number of bytes needed.
+     *
+     * Returns aligned buffer or NULL if no memory could be mapped.
+     */
+    uint8_t *allocate(size_t size);
+
+    /**
+     * release() - return buffer to arena for reuse
+     * @param ptr Buffer returned by allocate().
+     */
+    void release(uint8_t *ptr);
+
+    /**
+     * owns() - check if buffer was allocated from this arena
+     */
+    bool owns(const uint8_t *ptr);
+
+    stats get_stats();
+
+    /**
+     * instance() - return process arena or NULL if not enabled
+     */
+    static arena *instance()
+    {
+        return s_arena.load(std::memory_order_acquire);
+    }
+
+    /**
+     * enable() - create process arena
+     *
+     * The arena is never freed, as buffers may be released by objects
+     * destructed after main() returns.
+     */
+    static void enable()
+    {
+        if (!s_arena.load())
+            s_arena = new arena();
+    }
+};
+
+#endif
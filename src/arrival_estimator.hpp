@@ -0,0 +1,237 @@
+/* Copyright 2013 Martin Hundebøll <martin@hundeboll.net> */
+
+#ifndef FOX_ARRIVAL_ESTIMATOR_HPP_
+#define FOX_ARRIVAL_ESTIMATOR_HPP_
+
+#include <mutex>
+#include <map>
+
+#include "fox.hpp"
+#include "key.hpp"
+#include "coarse_clock.hpp"
+
+/* weight of the newest generation in the average of a flow */
+#define ARRIVAL_WEIGHT .25
+
+/* number of inter-arrival times to measure before trusting a generation */
+#define ARRIVAL_SPAN 4
+
+/* seconds to keep the average of flows without generations */
+#define ARRIVAL_FLOW_AGE 60
+
+/**
+ * class arrival_meter - measure packet inter-arrival time in a generation
+ *
+ * Since ticks are coarse, the time from the first to the latest packet is
+ * measured rather than the time between two packets.
+ */
+class arrival_meter
+{
+    coarse_clock::tick_type m_first, m_last;
+    size_t m_count;
+
+  public:
+    arrival_meter() : m_first(0), m_last(0), m_count(0)
+    {}
+
+    void reset()
+    {
+        m_count = 0;
+    }
+
+    /**
+     * add() - account arrival of a packet
+     */
+    void add(coarse_clock::tick_type now)
+    {
+        if (m_count++ == 0)
+            m_first = now;
+
+        m_last = now;
+    }
+
+    size_t count() const
+    {
+        return m_count;
+    }
+
+    /**
+     * measured() - return true once ARRIVAL_SPAN times have been measured
+     */
+    bool measured() const
+    {
+        return m_count > ARRIVAL_SPAN;
+    }
+
+    /**
+     * average() - return average inter-arrival time in ticks
+     */
+    double average() const
+    {
+        return m_count < 2 ? 0 : static_cast<double>(m_last - m_first)/
+                                 (m_count - 1);
+    }
+
+    /**
+     * idle() - return ticks since the latest packet
+     */
+    coarse_clock::tick_type idle() const
+    {
+        return coarse_clock::since(m_last);
+    }
+};
+
+/**
+ * class arrival_estimator - average packet inter-arrival time per flow
+ *
+ * Decoders measure the inter-arrival time of packets in a generation and
+ * add it to the average of the flow when the generation ends. New decoders
+ * use the average of their flow until they have measured enough packets of
+ * their own.
+ *
+ * Times are in coarse_clock ticks. Only the source and destination of keys
+ * are used, so all generations of a flow share the average. Averages of
+ * flows without generations for ARRIVAL_FLOW_AGE seconds are dropped.
+ */
+class arrival_estimator
+{
+    /**
+     * struct flow - average of one flow
+     * @ticks: average inter-arrival time
+     * @used: time the average was last updated
+     */
+    struct flow {
+        double ticks;
+        coarse_clock::tick_type used;
+    };
+
+    typedef std::map<key, flow> flow_map;
+
+    std::mutex m_lock;
+    flow_map m_flows;
+    double m_weight;
+    coarse_clock::tick_type m_age, m_pruned;
+
+    /**
+     * prune() - drop averages of idle flows
+     *
+     * Must be called with m_lock held. Runs at most once per age, so that
+     * updates don't scan all flows.
+     */
+    void prune()
+    {
+        flow_map::iterator it;
+
+        if (coarse_clock::since(m_pruned) < m_age)
+            return;
+
+        m_pruned = coarse_clock::now();
+
+        for (it = m_flows.begin(); it != m_flows.end();) {
+            if (coarse_clock::since(it->second.used) > m_age)
+                m_flows.erase(it++);
+            else
+                ++it;
+        }
+    }
+
+  public:
+    explicit arrival_estimator(double weight = ARRIVAL_WEIGHT)
+        : m_weight(weight),
+          m_age(coarse_clock::ticks(ARRIVAL_FLOW_AGE)),
+          m_pruned(coarse_clock::now())
+    {}
+
+    /**
+     * get() - return average inter-arrival time of a flow
+     * @param k Key of a generation in the flow.
+     *
+     * Returns a negative value if nothing is known about the flow.
+     */
+    double get(const key &k)
+    {
+        key fk(k.src, k.dst, 0);
+        flow_map::iterator it;
+
+        guard g(m_lock);
+
+        it = m_flows.find(fk);
+
+        return it == m_flows.end() ? -1 : it->second.ticks;
+    }
+
+    /**
+     * update() - add inter-arrival time of a generation to its flow
+     * @param k Key of the generation.
+     * @param ticks Average inter-arrival time in the generation.
+     */
+    void update(const key &k, double ticks)
+    {
+        key fk(k.src, k.dst, 0);
+        flow_map::iterator it;
+
+        guard g(m_lock);
+
+        it = m_flows.find(fk);
+
+        if (it == m_flows.end()) {
+            flow &f(m_flows[fk]);
+            f.ticks = ticks;
+            f.used = coarse_clock::now();
+        } else {
+            it->second.ticks += m_weight*(ticks - it->second.ticks);
+            it->second.used = coarse_clock::now();
+        }
+
+        prune();
+    }
+};
+
+/**
+ * class arrival_api - give coders access to an arrival estimator
+ */
+class arrival_api
+{
+    arrival_estimator *m_arrival;
+
+  protected:
+    double arrival_estimate(const key &k)
+    {
+        return m_arrival ? m_arrival->get(k) : -1;
+    }
+
+    /**
+     * arrival_update() - add measured inter-arrival time to flow
+     *
+     * Does nothing if the meter has measured too few packets. The meter is
+     * reset, so that a generation is only added once.
+     */
+    void arrival_update(const key &k, arrival_meter &meter)
+    {
+        if (m_arrival && meter.measured())
+            m_arrival->update(k, meter.average());
+
+        meter.reset();
+    }
+
+    bool has_arrival()
+    {
+        return (m_arrival != NULL);
+    }
+
+    arrival_estimator *get_arrival()
+    {
+        return m_arrival;
+    }
+
+  public:
+    void set_arrival(arrival_estimator *arrival)
+    {
+        m_arrival = arrival;
+    }
+
+    arrival_api() : m_arrival(NULL)
+    {}
+};
+
+#endif
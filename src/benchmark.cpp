@@ -0,0 +1,446 @@
+/* Copyright 2013 Martin Hundebøll <martin@hundeboll.net> */
+
+#include <algorithm>
+#include <sstream>
+#include <cstdlib>
+
+#include "benchmark.hpp"
+
+DECLARE_int32(e1);
+DECLARE_int32(e2);
+DECLARE_int32(e3);
+DECLARE_int32(packet_size);
+DECLARE_int32(encoders);
+DECLARE_double(decoder_timeout);
+DECLARE_int32(bench_rate);
+DECLARE_int32(bench_flows);
+DECLARE_double(bench_time);
+DECLARE_string(bench_sizes);
+
+static const uint8_t bench_src[ETH_ALEN] = {0x02, 0, 0, 0, 0, 0x01};
+
+static double percentile(const std::vector<double> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+
+    return sorted[std::min(sorted.size() - 1,
+                           static_cast<size_t>(p*sorted.size()))];
+}
+
+static double cpu_seconds(const struct rusage &r)
+{
+    return r.ru_utime.tv_sec + r.ru_utime.tv_usec/1e6 +
+           r.ru_stime.tv_sec + r.ru_stime.tv_usec/1e6;
+}
+
+benchmark::benchmark(const std::string &mode)
+    : m_running(false), m_blocks(0), m_percent(0, 99), m_delivered(0),
+      m_bytes(0), m_duplicates(0), m_generated(0)
+{
+    set_group("benchmark");
+
+    if (mode == "source")
+        m_mode = MODE_SOURCE;
+    else if (mode == "relay")
+        m_mode = MODE_RELAY;
+    else if (mode == "helper")
+        m_mode = MODE_HELPER;
+    else
+        LOG(FATAL) << "Unknown benchmark mode: " << mode;
+
+    parse_sizes(FLAGS_bench_sizes);
+
+    m_running = true;
+    m_thread = std::thread(channel_thread, this);
+}
+
+void benchmark::parse_sizes(const std::string &sizes)
+{
+    std::vector<double> weights;
+    std::stringstream ss(sizes);
+    std::string item;
+    size_t pos, size;
+    double weight;
+
+    /* comma separated list of size[:weight] */
+    while (std::getline(ss, item, ',')) {
+        pos = item.find(':');
+        size = strtoul(item.substr(0, pos).c_str(), NULL, 10);
+        weight = pos == std::string::npos ? 1 :
+                 strtod(item.substr(pos + 1).c_str(), NULL);
+
+        LOG_IF(FATAL, size < sizeof(bench_stamp) || size > max_size())
+            << "Benchmark packet size must be between " << sizeof(bench_stamp)
+            << " and " << max_size() << ": " << item;
+
+        m_sizes.push_back(size);
+        weights.push_back(weight);
+    }
+
+    LOG_IF(FATAL, m_sizes.empty()) << "No benchmark packet sizes given";
+
+    m_size_dist = std::discrete_distribution<size_t>(weights.begin(),
+                                                     weights.end());
+}
+
+size_t benchmark::max_size() const
+{
+    return FLAGS_packet_size - LEN_SIZE;
+}
+
+void benchmark::air_send(struct nl_msg *msg)
+{
+    guard g(m_lock);
+
+    if (!m_running)
+        return;
+
+    if (m_air.size() >= BENCH_AIR_FRAMES) {
+        inc("air overflows");
+        return;
+    }
+
+    nlmsg_get(msg);
+    m_air.push_back(msg);
+    m_cond.notify_one();
+}
+
+void benchmark::channel_thread(benchmark *b)
+{
+    std::unique_lock<std::mutex> l(b->m_lock);
+    struct nl_msg *msg;
+
+    while (b->m_running) {
+        if (b->m_air.empty()) {
+            b->m_cond.wait(l);
+            continue;
+        }
+
+        msg = b->m_air.front();
+        b->m_air.pop_front();
+
+        l.unlock();
+        b->deliver(msg);
+        nlmsg_free(msg);
+        l.lock();
+    }
+
+    for (auto msg : b->m_air)
+        nlmsg_free(msg);
+
+    b->m_air.clear();
+}
+
+void benchmark::stop()
+{
+    if (!m_thread.joinable())
+        return;
+
+    {
+        guard g(m_lock);
+        m_running = false;
+        m_cond.notify_one();
+    }
+
+    m_thread.join();
+    m_io.reset();
+}
+
+int benchmark::reverse_loss() const
+{
+    return m_mode == MODE_SOURCE ? FLAGS_e3 : FLAGS_e2;
+}
+
+void benchmark::deliver(struct nl_msg *msg)
+{
+    struct nlattr *attrs[BATADV_HLP_A_NUM];
+    struct nlmsghdr *nlh = nlmsg_hdr(msg);
+    struct genlmsghdr *gnlh = (struct genlmsghdr *)nlmsg_data(nlh);
+    uint8_t type;
+
+    genlmsg_parse(nlh, 0, attrs, BATADV_HLP_A_MAX, NULL);
+
+    switch (gnlh->cmd) {
+        case BATADV_HLP_C_BLOCK:
+            m_blocks++;
+            return;
+
+        case BATADV_HLP_C_UNBLOCK:
+            m_blocks--;
+            return;
+
+        case BATADV_HLP_C_GET_LINK:
+            reply_link(attrs);
+            return;
+
+        case BATADV_HLP_C_FRAME:
+            break;
+
+        default:
+            /* no helpers or relays are announced by the emulated network */
+            return;
+    }
+
+    if (!attrs[BATADV_HLP_A_TYPE] || !attrs[BATADV_HLP_A_FRAME])
+        return;
+
+    type = nla_get_u8(attrs[BATADV_HLP_A_TYPE]);
+
+    switch (type) {
+        case ENC_PACKET:
+        case RED_PACKET:
+            if (m_mode == MODE_RELAY) {
+                forward(attrs, REC_PACKET, FLAGS_e1);
+                break;
+            }
+
+            forward(attrs, ENC_PACKET, FLAGS_e3);
+
+            if (m_mode == MODE_HELPER)
+                forward(attrs, HLP_PACKET, FLAGS_e1);
+            break;
+
+        case REC_PACKET:
+        case HLP_PACKET:
+            forward(attrs, ENC_PACKET, FLAGS_e2);
+            break;
+
+        case DEC_PACKET:
+            sink(attrs);
+            break;
+
+        case PLAIN_PACKET:
+            /* flows bypassing the coders go over the direct link */
+            if (m_percent(m_channel_rand) < FLAGS_e3) {
+                inc("frames lost");
+                break;
+            }
+
+            sink(attrs);
+            break;
+
+        case ACK_PACKET:
+        case ACKS_PACKET:
+        case REQ_PACKET:
+        case REQS_PACKET:
+            forward(attrs, type, reverse_loss());
+            break;
+
+        default:
+            break;
+    }
+}
+
+void benchmark::forward(struct nlattr **attrs, uint8_t type, int loss)
+{
+    struct nl_msg *msg;
+
+    if (!attrs[BATADV_HLP_A_SRC] || !attrs[BATADV_HLP_A_DST] ||
+        !attrs[BATADV_HLP_A_BLOCK])
+        return;
+
+    if (m_percent(m_channel_rand) < loss) {
+        inc("frames lost");
+        return;
+    }
+
+    msg = CHECK_NOTNULL(nlmsg_alloc());
+    genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, m_io->genl_family(),
+                0, 0, BATADV_HLP_C_FRAME, 1);
+
+    nla_put(msg, BATADV_HLP_A_SRC, ETH_ALEN, nla_data(attrs[BATADV_HLP_A_SRC]));
+    nla_put(msg, BATADV_HLP_A_DST, ETH_ALEN, nla_data(attrs[BATADV_HLP_A_DST]));
+    nla_put_u16(msg, BATADV_HLP_A_BLOCK,
+                nla_get_u16(attrs[BATADV_HLP_A_BLOCK]));
+    nla_put_u8(msg, BATADV_HLP_A_TYPE, type);
+    nla_put(msg, BATADV_HLP_A_FRAME, nla_len(attrs[BATADV_HLP_A_FRAME]),
+            nla_data(attrs[BATADV_HLP_A_FRAME]));
+
+    if (attrs[BATADV_HLP_A_RANK])
+        nla_put_u16(msg, BATADV_HLP_A_RANK,
+                    nla_get_u16(attrs[BATADV_HLP_A_RANK]));
+
+    if (attrs[BATADV_HLP_A_SEQ])
+        nla_put_u16(msg, BATADV_HLP_A_SEQ,
+                    nla_get_u16(attrs[BATADV_HLP_A_SEQ]));
+
+    m_io->inject(msg);
+    nlmsg_free(msg);
+    inc("frames delivered");
+}
+
+void benchmark::reply_link(struct nlattr **attrs)
+{
+    struct nl_msg *msg;
+    uint8_t tq = 255*(100 - reverse_loss())/100;
+
+    if (!attrs[BATADV_HLP_A_ADDR])
+        return;
+
+    msg = CHECK_NOTNULL(nlmsg_alloc());
+    genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, m_io->genl_family(),
+                0, 0, BATADV_HLP_C_GET_LINK, 1);
+
+    nla_put(msg, BATADV_HLP_A_ADDR, ETH_ALEN,
+            nla_data(attrs[BATADV_HLP_A_ADDR]));
+    nla_put_u8(msg, BATADV_HLP_A_TQ, tq ? : 1);
+
+    m_io->inject(msg);
+    nlmsg_free(msg);
+}
+
+void benchmark::sink(struct nlattr **attrs)
+{
+    struct bench_stamp stamp;
+    clock::time_point now = clock::now();
+    size_t len = nla_len(attrs[BATADV_HLP_A_FRAME]);
+
+    if (len < sizeof(stamp)) {
+        inc("invalid packets");
+        return;
+    }
+
+    memcpy(&stamp, nla_data(attrs[BATADV_HLP_A_FRAME]), sizeof(stamp));
+
+    if (stamp.seq >= m_generated) {
+        inc("invalid packets");
+        return;
+    }
+
+    guard g(m_lock);
+
+    if (stamp.seq >= m_seen.size())
+        m_seen.resize(stamp.seq + 1);
+
+    if (m_seen[stamp.seq]) {
+        m_duplicates++;
+        return;
+    }
+
+    m_seen[stamp.seq] = true;
+    m_latencies.push_back((nanoseconds(now) - stamp.sent)/1e3);
+    m_delivered++;
+    m_bytes += len;
+    m_last = now;
+}
+
+void benchmark::generate(size_t flow, uint64_t seq)
+{
+    uint8_t dst[ETH_ALEN] = {0x02, 0, 0, 0, 0x01, 0};
+    size_t len = m_sizes[m_size_dist(m_gen_rand)];
+    struct bench_stamp stamp = {seq, nanoseconds(clock::now())};
+    struct nl_msg *msg;
+    struct nlattr *attr;
+    uint8_t *data;
+
+    dst[ETH_ALEN - 1] = flow;
+
+    msg = CHECK_NOTNULL(nlmsg_alloc());
+    genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, m_io->genl_family(),
+                0, 0, BATADV_HLP_C_FRAME, 1);
+
+    nla_put(msg, BATADV_HLP_A_SRC, ETH_ALEN, bench_src);
+    nla_put(msg, BATADV_HLP_A_DST, ETH_ALEN, dst);
+    nla_put_u16(msg, BATADV_HLP_A_BLOCK, 0);
+    nla_put_u8(msg, BATADV_HLP_A_TYPE, PLAIN_PACKET);
+    attr = nla_reserve(msg, BATADV_HLP_A_FRAME, len);
+    data = reinterpret_cast<uint8_t *>(nla_data(attr));
+
+    memcpy(data, &stamp, sizeof(stamp));
+    memset(data + sizeof(stamp), seq, len - sizeof(stamp));
+
+    m_io->inject(msg);
+    nlmsg_free(msg);
+}
+
+void benchmark::run(const std::atomic<bool> &running)
+{
+    std::chrono::duration<double> period(FLAGS_bench_rate > 0 ?
+                                         1.0/FLAGS_bench_rate : 0);
+    std::chrono::duration<double> length(FLAGS_bench_time);
+    std::chrono::milliseconds idle(1), settle(500);
+    std::chrono::duration<double> drain(FLAGS_decoder_timeout);
+    clock::time_point next, end;
+    struct rusage start, stop;
+    size_t flows = std::max(FLAGS_bench_flows, 1);
+
+    LOG(INFO) << "Benchmark: generating packets for " << FLAGS_bench_time
+              << " seconds at " << FLAGS_bench_rate << " packets/s";
+
+    getrusage(RUSAGE_SELF, &start);
+    m_start = next = clock::now();
+    end = m_start + std::chrono::duration_cast<clock::duration>(length);
+
+    while (running && clock::now() < end) {
+        /* like batman-adv, hold back plain packets while as many full
+         * generations are waiting or being encoded as there are encoders */
+        if (m_blocks >= FLAGS_encoders) {
+            std::this_thread::sleep_for(idle);
+            continue;
+        }
+
+        generate(m_generated % flows, m_generated++);
+
+        next += std::chrono::duration_cast<clock::duration>(period);
+        std::this_thread::sleep_until(next);
+    }
+
+    /* wait for the last generations to be decoded or time out */
+    end = clock::now() + std::chrono::duration_cast<clock::duration>(drain);
+
+    while (running && clock::now() < end) {
+        std::this_thread::sleep_for(settle);
+
+        guard g(m_lock);
+        if (m_delivered == m_generated || clock::now() - m_last > settle)
+            break;
+    }
+
+    getrusage(RUSAGE_SELF, &stop);
+    report(start, stop);
+}
+
+void benchmark::report(const struct rusage &start, const struct rusage &stop)
+{
+    std::vector<double> latencies;
+    std::chrono::duration<double> elapsed;
+    size_t delivered, bytes, duplicates;
+    double pps, mbps, cpu;
+
+    {
+        guard g(m_lock);
+        latencies = m_latencies;
+        delivered = m_delivered;
+        bytes = m_bytes;
+        duplicates = m_duplicates;
+        elapsed = (delivered ? m_last : clock::now()) - m_start;
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+
+    pps = delivered/elapsed.count();
+    mbps = bytes/elapsed.count()/1e6;
+    cpu = delivered ? (cpu_seconds(stop) - cpu_seconds(start))*1e6/delivered
+                    : 0;
+
+    gauge("packets generated", m_generated);
+    gauge("packets delivered", delivered);
+    gauge("packets duplicated", duplicates);
+    gauge("packets/s", pps);
+    gauge("kB/s", bytes/elapsed.count()/1e3);
+    gauge("cpu ns/packet", cpu*1e3);
+    gauge("latency p50 us", percentile(latencies, .5));
+    gauge("latency p90 us", percentile(latencies, .9));
+    gauge("latency p99 us", percentile(latencies, .99));
+    gauge("latency max us", percentile(latencies, 1));
+
+    LOG(INFO) << "Benchmark: delivered " << delivered << "/" << m_generated
+              << " packets (" << duplicates << " duplicates) in "
+              << elapsed.count() << " s: " << pps << " packets/s, " << mbps
+              << " MB/s, " << cpu << " us CPU/packet";
+    LOG(INFO) << "Benchmark: latency p50 " << percentile(latencies, .5)
+              << " us, p90 " << percentile(latencies, .9) << " us, p99 "
+              << percentile(latencies, .99) << " us, max "
+              << percentile(latencies, 1) << " us";
+}
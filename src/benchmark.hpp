@@ -0,0 +1,186 @@
+/* Copyright 2013 Martin Hundebøll <martin@hundeboll.net> */
+
+#ifndef FOX_BENCHMARK_HPP_
+#define FOX_BENCHMARK_HPP_
+
+#include <netlink/msg.h>
+#include <sys/resource.h>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+#include <atomic>
+#include <random>
+#include <deque>
+#include <vector>
+#include <string>
+#include <memory>
+
+#include "fox.hpp"
+#include "io.hpp"
+#include "counters.hpp"
+
+/* maximum number of frames waiting on the emulated air */
+#define BENCH_AIR_FRAMES 4096
+
+/**
+ * struct bench_stamp - header written in front of each generated packet
+ * @seq: sequence number of the packet
+ * @sent: time the packet was generated in nanoseconds
+ */
+struct bench_stamp {
+    uint64_t seq;
+    int64_t sent;
+};
+
+/**
+ * class benchmark - run the coding pipeline on synthetic traffic
+ *
+ * Replaces batman-adv with an emulated network inside the process: io is put
+ * in loopback mode, and every message written by the coders is passed to a
+ * channel thread instead of the kernel. The channel drops coded frames with
+ * the loss probabilities given by --e1, --e2 and --e3, and hands the rest
+ * back to io as if they were received from the next hop:
+ *
+ *  - source: encoder -> decoder (e3)
+ *  - relay:  encoder -> recoder (e1) -> decoder (e2)
+ *  - helper: encoder -> decoder (e3), encoder -> helper (e1) -> decoder (e2)
+ *
+ * Plain packets of flows that bypass the coders go over the direct link (e3).
+ *
+ * Acknowledgements and requests travel back over the shortest reverse link,
+ * and link queries are answered with the quality of the emulated links.
+ *
+ * Plain packets are generated at --bench_rate with sizes drawn from
+ * --bench_sizes, and decoded packets are timestamped when they leave the
+ * pipeline to measure throughput, CPU time per packet, and latency.
+ */
+class benchmark : public counter_api, public io_api
+{
+    typedef std::chrono::steady_clock clock;
+
+    enum mode {
+        MODE_SOURCE,
+        MODE_RELAY,
+        MODE_HELPER,
+    };
+
+    enum mode m_mode;
+    std::thread m_thread;
+    std::mutex m_lock;
+    std::condition_variable m_cond;
+    std::atomic<bool> m_running;
+    std::atomic<int> m_blocks;
+    std::deque<struct nl_msg *> m_air;
+    clock::time_point m_start;
+
+    /* random numbers for the channel and the generator */
+    std::minstd_rand m_channel_rand, m_gen_rand;
+    std::uniform_int_distribution<int> m_percent;
+    std::vector<size_t> m_sizes;
+    std::discrete_distribution<size_t> m_size_dist;
+
+    /* results collected by the channel thread; protected by m_lock */
+    std::vector<double> m_latencies;
+    std::vector<bool> m_seen;
+    size_t m_delivered, m_bytes, m_duplicates;
+    clock::time_point m_last;
+
+    std::atomic<size_t> m_generated;
+
+    void parse_sizes(const std::string &sizes);
+    size_t max_size() const;
+
+    static void channel_thread(benchmark *b);
+
+    /**
+     * deliver() - pass message written by io to its next hop
+     */
+    void deliver(struct nl_msg *msg);
+
+    /**
+     * forward() - hand frame back to io as a frame of the given type
+     * @param attrs Attributes of the sent frame.
+     * @param type Packet type of the received frame.
+     * @param loss Loss probability of the link in percent.
+     */
+    void forward(struct nlattr **attrs, uint8_t type, int loss);
+
+    /**
+     * reply_link() - answer link query with the quality of the reverse link
+     */
+    void reply_link(struct nlattr **attrs);
+
+    /**
+     * sink() - account decoded packet leaving the pipeline
+     */
+    void sink(struct nlattr **attrs);
+
+    /**
+     * generate() - inject one plain packet for a flow
+     * @param flow Index of the flow.
+     * @param seq Sequence number of the packet.
+     */
+    void generate(size_t flow, uint64_t seq);
+
+    void report(const struct rusage &start, const struct rusage &stop);
+
+    int reverse_loss() const;
+
+    static int64_t nanoseconds(clock::time_point t)
+    {
+        using std::chrono::duration_cast;
+        using std::chrono::nanoseconds;
+
+        return duration_cast<nanoseconds>(t.time_since_epoch()).count();
+    }
+
+  public:
+    typedef std::shared_ptr<benchmark> pointer;
+
+    /**
+     * benchmark() - create benchmark
+     * @param mode Topology to emulate: "source", "relay", or "helper".
+     */
+    explicit benchmark(const std::string &mode);
+
+    ~benchmark()
+    {
+        stop();
+    }
+
+    /**
+     * enabled() - return true if mode is a benchmark that needs loopback
+     * @param mode Value of --benchmark.
+     *
+     * The "reflect" mode is handled by io alone with batman-adv in place.
+     */
+    static bool enabled(const std::string &mode)
+    {
+        return !mode.empty() && mode != "reflect";
+    }
+
+    /**
+     * air_send() - put message written by io on the emulated air
+     * @param msg Message; the caller keeps its own reference.
+     *
+     * Called by io in loopback mode from any thread.
+     */
+    void air_send(struct nl_msg *msg);
+
+    /**
+     * run() - generate traffic and report results
+     * @param running Flag to stop the benchmark early.
+     *
+     * Generates packets for --bench_time seconds, waits for the pipeline to
+     * drain, and reports the results to counters and the log.
+     */
+    void run(const std::atomic<bool> &running);
+
+    /**
+     * stop() - stop channel thread and release io
+     */
+    void stop();
+};
+
+#endif
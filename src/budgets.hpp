@@ -0,0 +1,233 @@
+/* Copyright 2013 Martin Hundebøll <martin@hundeboll.net> */
+
+#ifndef FOX_BUDGETS_HPP_
+#define FOX_BUDGETS_HPP_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <math.h>
+#include <algorithm>
+
+/*
+ * Budget formulas shared by fox and tools/budgets.
+ *
+ * Loss probabilities e1, e2, and e3 are given in units of BUDGET_ONE:
+ *  - e1: source to helper (or relay)
+ *  - e2: helper to destination
+ *  - e3: source to destination
+ *
+ * This header must not depend on other fox headers, so that tools can be
+ * built without the libraries fox links with.
+ */
+
+#define BUDGET_ONE 255
+
+/* largest relative deviation of scaled source budgets from the real valued
+ * formulas, as checked by tools/budgets --check */
+#define BUDGET_TOLERANCE 0.02
+
+/* denominator of budgets computed from the real valued formulas */
+#define BUDGET_SCALE 256
+
+/**
+ * struct budget_terms - budget values of a generation
+ * @r: number of packets the helper should receive before it starts
+ * @source_nom: numerator of the source and recoder budgets
+ * @helper_nom: numerator of the helper budget
+ * @denom: denominator shared by the budgets
+ * @threshold: rank at which the helper starts sending
+ *
+ * Budgets are kept as fractions, so that the overshoot can be applied
+ * before rounding like the formulas do.
+ */
+struct budget_terms {
+    size_t r;
+    size_t source_nom;
+    size_t helper_nom;
+    size_t denom;
+    size_t threshold;
+
+    /**
+     * source() - return number of packets the source should send
+     * @param overshoot Factor to increase the budget by.
+     */
+    double source(double overshoot) const
+    {
+        return overshoot*source_nom/denom;
+    }
+
+    /**
+     * recoder() - return number of packets a relay should send
+     */
+    size_t recoder() const
+    {
+        return source_nom/denom + (source_nom % denom != 0);
+    }
+
+    /**
+     * helper() - return number of packets a helper should send
+     * @param overshoot Factor to increase the budget by.
+     */
+    size_t helper(double overshoot) const
+    {
+        return overshoot*helper_nom/denom + (helper_nom % denom != 0);
+    }
+};
+
+/**
+ * budget_r_test() - return true if the helper only needs a few packets
+ */
+static inline bool budget_r_test(size_t e1, size_t e2, size_t e3)
+{
+    return (BUDGET_ONE - e2) < (e3 - e1*e3/BUDGET_ONE);
+}
+
+/**
+ * budget_r() - return number of packets a helper should receive
+ */
+static inline size_t budget_r(size_t g, size_t e1, size_t e2, size_t e3)
+{
+    const size_t one = BUDGET_ONE;
+    size_t nom, denom;
+
+    if (budget_r_test(e1, e2, e3)) {
+        denom = e3 - e1*e3/one ? : one;
+        return one/denom + (one % denom != 0);
+    }
+
+    nom = one*g - g*e2 - g*e3 + g*e1*e3/one;
+    denom = one + e1*e3*e2/one/one - e2 - e1*e3/one ? : one;
+
+    return nom/denom + (nom % denom != 0);
+}
+
+/**
+ * budget_formulas() - compute budget values analytically
+ * @param g Number of symbols in the generation.
+ */
+static inline budget_terms budget_formulas(size_t g, size_t e1, size_t e2,
+                                           size_t e3)
+{
+    const size_t one = BUDGET_ONE;
+    budget_terms t;
+    size_t lost;
+
+    t.r = budget_r(g, e1, e2, e3);
+    t.source_nom = g*one + t.r*one - t.r*e2;
+    t.denom = 2*one - e3 - e2 ? : one;
+    t.threshold = t.r - t.r*e1/one;
+
+    /* packets from the helper replace those the destination got directly */
+    lost = t.r*(one - e3);
+    t.helper_nom = g*one > lost ? g*one - lost : 0;
+
+    return t;
+}
+
+/**
+ * budget_credit() - return packets to send per received packet
+ *
+ * Used by sources and relays sending before the generation is complete.
+ */
+static inline double budget_credit(size_t e1, size_t e3)
+{
+    return static_cast<double>(BUDGET_ONE)/
+           (BUDGET_ONE - e3*e1/BUDGET_ONE);
+}
+
+/**
+ * budget_r_few() - return true if the helper only needs a few packets
+ *
+ * Real valued version of budget_r_test().
+ */
+static inline bool budget_r_few(double e1, double e2, double e3)
+{
+    return (1 - e2) < (1 - e1)*e3;
+}
+
+/**
+ * budget_r_real() - return real valued number of packets a helper should
+ *                   receive
+ * @param few Result of budget_r_few().
+ *
+ * The two ways of computing r don't meet where budget_r_few() changes, so
+ * the budgets jump by about one packet there.
+ */
+static inline double budget_r_real(double g, double e1, double e2, double e3,
+                                   bool few)
+{
+    if (few)
+        return 1/((1 - e1)*e3);
+
+    return -g*(-1 + e2 + e3 - e1*e3)/
+           ((2 - e3 - e2)*(1 - e1)*e3 - (1 - e3)*(-1 + e2 + e3 - e1*e3));
+}
+
+/**
+ * budget_source_real() - return real valued source budget
+ */
+static inline double budget_source_real(double g, double r, double e2,
+                                        double e3)
+{
+    return r + (g - r*(1 - e3))/(2 - e2 - e3);
+}
+
+/**
+ * struct budget_reference - budget values with real valued probabilities
+ *
+ * Computed without rounding, to compare the scaled integer formulas and
+ * budget_real() with.
+ */
+struct budget_reference {
+    double r;
+    double source;
+    double helper;
+    double threshold;
+
+    budget_reference(double g, double e1, double e2, double e3)
+    {
+        r = budget_r_real(g, e1, e2, e3, budget_r_few(e1, e2, e3));
+        source = budget_source_real(g, r, e2, e3);
+        helper = (g - r*(1 - e3))/(2 - e2 - e3);
+        threshold = r*(1 - e1);
+    }
+};
+
+/**
+ * budget_real() - return budget values from the real valued formulas
+ * @param g Number of symbols in the generation.
+ *
+ * Used by coders when generations start and when repairs are requested.
+ * The formulas are cheap enough to evaluate on every call, so nothing is
+ * precomputed. r is rounded up, and the budgets are scaled by BUDGET_SCALE.
+ *
+ * Probabilities are clamped to BUDGET_ONE - 1, where the formulas are
+ * still finite.
+ */
+static inline budget_terms budget_real(size_t g, size_t e1, size_t e2,
+                                       size_t e3)
+{
+    const double one = BUDGET_ONE;
+    double p1, p2, p3, r, source, helper;
+    budget_terms t;
+
+    e1 = std::min<size_t>(e1, BUDGET_ONE - 1);
+    e2 = std::min<size_t>(e2, BUDGET_ONE - 1);
+    e3 = std::min<size_t>(e3, BUDGET_ONE - 1);
+    p1 = e1/one;
+    p2 = e2/one;
+    p3 = e3/one;
+    r = budget_r_real(g, p1, p2, p3, budget_r_few(p1, p2, p3));
+    source = budget_source_real(g, r, p2, p3);
+    helper = source > r ? source - r : 0;
+
+    t.r = r > 0 ? ceil(r) : 0;
+    t.source_nom = source*BUDGET_SCALE + 0.5;
+    t.helper_nom = helper*BUDGET_SCALE + 0.5;
+    t.denom = BUDGET_SCALE;
+    t.threshold = t.r - t.r*e1/BUDGET_ONE;
+
+    return t;
+}
+
+#endif
@@ -0,0 +1,237 @@
+/* Copyright 2013 Martin Hundebøll <martin@hundeboll.net> */
+
+#ifndef FOX_BUFFER_POOL_HPP_
+#define FOX_BUFFER_POOL_HPP_
+
+#include <mutex>
+#include <vector>
+#include <memory>
+
+#include "fox.hpp"
+#include "aligned_alloc.hpp"
+
+class buffer_pool;
+
+/**
+ * class packet_buffer - handle to a buffer borrowed from a buffer_pool
+ *
+ * The handle owns the buffer until it is destructed or released, after which
+ * the buffer is returned to the pool it was taken from. Handles can be moved
+ * but not copied, so a buffer has exactly one owner at any time.
+ *
+ * The packet data starts at an offset into the buffer, leaving headroom in
+ * front of the data for headers to be prepended without moving the data.
+ */
+class packet_buffer
+{
+    buffer_pool *m_pool;
+    uint8_t *m_head;
+    size_t m_size, m_offset, m_len;
+
+  public:
+    packet_buffer() : m_pool(NULL), m_head(NULL), m_size(0), m_offset(0),
+                      m_len(0)
+    {}
+
+    packet_buffer(buffer_pool *pool, uint8_t *head, size_t size, size_t offset)
+        : m_pool(pool), m_head(head), m_size(size), m_offset(offset), m_len(0)
+    {}
+
+    packet_buffer(packet_buffer &&oth)
+        : m_pool(oth.m_pool), m_head(oth.m_head), m_size(oth.m_size),
+          m_offset(oth.m_offset), m_len(oth.m_len)
+    {
+        oth.m_pool = NULL;
+        oth.m_head = NULL;
+    }
+
+    packet_buffer(const packet_buffer &) = delete;
+    packet_buffer &operator=(const packet_buffer &) = delete;
+
+    packet_buffer &operator=(packet_buffer &&oth)
+    {
+        if (this == &oth)
+            return *this;
+
+        release();
+        m_pool = oth.m_pool;
+        m_head = oth.m_head;
+        m_size = oth.m_size;
+        m_offset = oth.m_offset;
+        m_len = oth.m_len;
+        oth.m_pool = NULL;
+        oth.m_head = NULL;
+
+        return *this;
+    }
+
+    ~packet_buffer()
+    {
+        release();
+    }
+
+    /**
+     * release() - return buffer to its pool
+     */
+    inline void release();
+
+    explicit operator bool() const
+    {
+        return m_head != NULL;
+    }
+
+    /**
+     * head() - return start of buffer, including headroom
+     */
+    uint8_t *head() const
+    {
+        return m_head;
+    }
+
+    /**
+     * data() - return start of packet data
+     */
+    uint8_t *data() const
+    {
+        return m_head + m_offset;
+    }
+
+    /**
+     * size() - return size of buffer including headroom
+     */
+    size_t size() const
+    {
+        return m_size;
+    }
+
+    /**
+     * headroom() - return number of bytes available in front of data
+     */
+    size_t headroom() const
+    {
+        return m_offset;
+    }
+
+    /**
+     * tailroom() - return number of bytes available from start of data
+     */
+    size_t tailroom() const
+    {
+        return m_size - m_offset;
+    }
+
+    void set_offset(size_t offset)
+    {
+        m_offset = offset;
+    }
+
+    size_t len() const
+    {
+        return m_len;
+    }
+
+    void set_len(size_t len)
+    {
+        m_len = len;
+    }
+};
+
+/**
+ * class buffer_pool - preallocated fixed size packet buffers
+ *
+ * All buffers are carved out of a single allocation when the pool is
+ * initialized, and each of them starts on a FOX_ALIGNMENT boundary. Buffers
+ * are handed out as packet_buffer handles, which put the buffer back in the
+ * pool when destructed. An empty handle is returned if the pool is
+ * exhausted, so users must be able to fall back to their own storage.
+ */
+class buffer_pool
+{
+    std::mutex m_lock;
+    aligned_ptr m_memory;
+    std::vector<uint8_t *> m_free;
+    size_t m_size, m_headroom, m_count;
+
+  public:
+    buffer_pool() : m_size(0), m_headroom(0), m_count(0)
+    {}
+
+    /**
+     * init() - allocate buffers in pool
+     * @param count Number of buffers to allocate.
+     * @param size Size of each buffer including headroom; rounded up to a
+     *        multiple of FOX_ALIGNMENT.
+     * @param headroom Default number of bytes reserved in front of data.
+     */
+    void init(size_t count, size_t size, size_t headroom)
+    {
+        guard g(m_lock);
+
+        m_count = count;
+        m_size = align_up(size);
+        m_headroom = headroom;
+        m_memory.reset(count ? aligned_allocate(count * m_size) : NULL);
+        m_free.clear();
+        m_free.reserve(count);
+
+        for (size_t i = 0; i < count; i++)
+            m_free.push_back(m_memory.get() + i * m_size);
+    }
+
+    /**
+     * get() - take a buffer from the pool
+     *
+     * Returns handle to buffer, or an empty handle if the pool is exhausted.
+     */
+    packet_buffer get()
+    {
+        uint8_t *head;
+
+        guard g(m_lock);
+
+        if (m_free.empty())
+            return packet_buffer();
+
+        head = m_free.back();
+        m_free.pop_back();
+
+        return packet_buffer(this, head, m_size, m_headroom);
+    }
+
+    /**
+     * put() - return buffer to the pool
+     * @param head Start of buffer as returned by packet_buffer::head().
+     */
+    void put(uint8_t *head)
+    {
+        guard g(m_lock);
+        m_free.push_back(head);
+    }
+
+    size_t available()
+    {
+        guard g(m_lock);
+        return m_free.size();
+    }
+
+    size_t count() const
+    {
+        return m_count;
+    }
+
+    size_t size() const
+    {
+        return m_size;
+    }
+};
+
+void packet_buffer::release()
+{
+    if (m_pool)
+        m_pool->put(m_head);
+
+    m_pool = NULL;
+    m_head = NULL;
+}
+
+#endif
@@ -0,0 +1,168 @@
+/* Copyright 2013 Martin Hundebøll <martin@hundeboll.net> */
+
+#ifndef FOX_BYPASS_HPP_
+#define FOX_BYPASS_HPP_
+
+#include <mutex>
+#include <map>
+#include <vector>
+
+#include "fox.hpp"
+#include "key.hpp"
+#include "coarse_clock.hpp"
+
+/* seconds to keep the state of flows without packets */
+#define BYPASS_FLOW_AGE 60
+
+/**
+ * class bypass_policy - decide which flows to forward without coding
+ *
+ * Coding gains nothing on a nearly lossless direct link, but still costs
+ * generation fill latency, coefficient overhead, and coding time. Flows are
+ * forwarded uncoded while the estimated loss of the link to the destination
+ * is below the enter threshold, and coded again when it rises above the
+ * leave threshold. The gap between the thresholds keeps flows with a
+ * fluctuating estimate from switching on every update.
+ *
+ * Flows start out coded, so flows without a link estimate are never
+ * bypassed. The state of flows is dropped when the flows have been idle for
+ * BYPASS_FLOW_AGE seconds.
+ */
+class bypass_policy
+{
+  public:
+    /**
+     * struct flow_stats - bypass state of one flow
+     * @flow: source and destination of the flow
+     * @bypass: true if the flow is forwarded uncoded
+     * @bypassed: number of packets forwarded uncoded
+     * @switches: number of times the flow changed between coded and uncoded
+     * @refreshed: time the link estimate was last requested
+     * @used: time the last packet of the flow was seen
+     */
+    struct flow_stats {
+        key flow;
+        bool bypass;
+        size_t bypassed;
+        size_t switches;
+        coarse_clock::tick_type refreshed;
+        coarse_clock::tick_type used;
+    };
+
+  private:
+    typedef std::map<key, flow_stats> flow_map;
+
+    std::mutex m_lock;
+    flow_map m_flows;
+    size_t m_enter, m_leave;
+    coarse_clock::tick_type m_refresh, m_age;
+
+    flow_stats &flow(const key &k)
+    {
+        key fk(k.src, k.dst, 0);
+        flow_map::iterator it = m_flows.find(fk);
+
+        if (it != m_flows.end()) {
+            it->second.used = coarse_clock::now();
+            return it->second;
+        }
+
+        flow_stats &s(m_flows[fk]);
+        s.flow = fk;
+        s.bypass = false;
+        s.bypassed = s.switches = 0;
+        s.refreshed = s.used = coarse_clock::now();
+
+        return s;
+    }
+
+  public:
+    /**
+     * bypass_policy() - create policy
+     * @param enter Loss below which flows are forwarded uncoded.
+     * @param leave Loss above which uncoded flows are coded again.
+     * @param refresh Seconds between link estimate requests of uncoded
+     *        flows.
+     *
+     * Losses are in units of 255.
+     */
+    bypass_policy(size_t enter, size_t leave, double refresh)
+        : m_enter(enter), m_leave(leave < enter ? enter : leave),
+          m_refresh(coarse_clock::ticks(refresh)),
+          m_age(coarse_clock::ticks(BYPASS_FLOW_AGE))
+    {}
+
+    /**
+     * bypass() - return true if a packet of a flow should not be coded
+     * @param k Key of the packet.
+     * @param e Estimated loss of the link to the destination.
+     * @param entered Set to true if the flow switched to uncoded with this
+     *        packet; false otherwise.
+     */
+    bool bypass(const key &k, size_t e, bool &entered)
+    {
+        guard g(m_lock);
+
+        flow_stats &s(flow(k));
+
+        entered = false;
+
+        if (s.bypass != (s.bypass ? e <= m_leave : e < m_enter)) {
+            s.bypass = !s.bypass;
+            s.switches++;
+            entered = s.bypass;
+            VLOG(LOG_GEN) << "Bypass: " << (s.bypass ? "Forward " : "Code ")
+                          << s.flow << " (loss " << e << ")";
+        }
+
+        if (s.bypass)
+            s.bypassed++;
+
+        return s.bypass;
+    }
+
+    /**
+     * refresh() - return true if the link estimate of a flow is due
+     *
+     * Coders request estimates when generations start, so uncoded flows
+     * must request them here to notice when the link degrades.
+     */
+    bool refresh(const key &k)
+    {
+        guard g(m_lock);
+
+        flow_stats &s(flow(k));
+
+        if (coarse_clock::since(s.refreshed) < m_refresh)
+            return false;
+
+        s.refreshed = coarse_clock::now();
+
+        return true;
+    }
+
+    /**
+     * get_stats() - return state of flows and drop idle ones
+     */
+    std::vector<flow_stats> get_stats()
+    {
+        std::vector<flow_stats> v;
+        flow_map::iterator it;
+
+        guard g(m_lock);
+
+        for (it = m_flows.begin(); it != m_flows.end();) {
+            if (coarse_clock::since(it->second.used) > m_age) {
+                m_flows.erase(it++);
+                continue;
+            }
+
+            v.push_back(it->second);
+            ++it;
+        }
+
+        return v;
+    }
+};
+
+#endif
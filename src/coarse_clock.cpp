@@ -0,0 +1,66 @@
+/* Copyright 2013 Martin Hundebøll <martin@hundeboll.net> */
+
+#include <chrono>
+#include <algorithm>
+
+#include "fox.hpp"
+#include "coarse_clock.hpp"
+
+std::atomic<coarse_clock::tick_type> coarse_clock::s_now(0);
+std::atomic<bool> coarse_clock::s_running(false);
+std::atomic<coarse_clock::tick_type> coarse_clock::s_interval(0);
+std::thread coarse_clock::s_thread;
+
+void coarse_clock::run(uint32_t interval)
+{
+    std::chrono::milliseconds sleep(interval);
+
+    while (s_running.load(std::memory_order_relaxed)) {
+        std::this_thread::sleep_for(sleep);
+        s_now.store(read(), std::memory_order_relaxed);
+    }
+}
+
+void coarse_clock::start(uint32_t interval)
+{
+    if (s_thread.joinable())
+        return;
+
+    /* publish a valid time before readers switch to the cached value */
+    s_now = read();
+    s_interval = interval > 0 ? interval : 1;
+    s_running = true;
+    s_thread = std::thread(run, s_interval.load());
+}
+
+void coarse_clock::stop()
+{
+    if (!s_thread.joinable())
+        return;
+
+    s_running = false;
+    s_thread.join();
+    s_interval = 0;
+}
+
+/**
+ * jiffy() - return resolution of the kernel clock in ticks
+ */
+static coarse_clock::tick_type jiffy()
+{
+    struct timespec ts;
+
+    if (clock_getres(CLOCK_MONOTONIC_COARSE, &ts) != 0)
+        return 1;
+
+    return std::max<coarse_clock::tick_type>(
+        ts.tv_sec*1000 + (ts.tv_nsec + 999999)/1000000, 1);
+}
+
+coarse_clock::tick_type coarse_clock::resolution()
+{
+    /* the resolution of the kernel clock doesn't change */
+    static const tick_type res = jiffy();
+
+    return std::max(res, s_interval.load(std::memory_order_relaxed));
+}
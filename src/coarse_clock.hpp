@@ -0,0 +1,103 @@
+/* Copyright 2013 Martin Hundebøll <martin@hundeboll.net> */
+
+#ifndef FOX_COARSE_CLOCK_HPP_
+#define FOX_COARSE_CLOCK_HPP_
+
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include <thread>
+
+/**
+ * class coarse_clock - cheap process wide monotonic clock in milliseconds
+ *
+ * A ticker thread reads CLOCK_MONOTONIC_COARSE periodically and publishes
+ * the time in an atomic, so that reading the clock on the packet path is a
+ * relaxed load. Until the ticker is started, now() reads the coarse clock
+ * directly, which is still cheaper than a precise clock.
+ *
+ * Ticks are 32 bit milliseconds and wrap after 49 days, so differences
+ * between ticks must be computed with unsigned arithmetic.
+ */
+class coarse_clock
+{
+  public:
+    typedef uint32_t tick_type;
+
+  private:
+    static std::atomic<tick_type> s_now;
+    static std::atomic<bool> s_running;
+    static std::atomic<tick_type> s_interval;
+    static std::thread s_thread;
+
+    static void run(uint32_t interval);
+
+  public:
+    /**
+     * read() - read coarse clock from the kernel
+     */
+    static tick_type read()
+    {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+        return ts.tv_sec*1000 + ts.tv_nsec/1000000;
+    }
+
+    /**
+     * now() - return current time in ticks
+     */
+    static tick_type now()
+    {
+        if (s_running.load(std::memory_order_relaxed))
+            return s_now.load(std::memory_order_relaxed);
+
+        return read();
+    }
+
+    /**
+     * ticks() - convert seconds to ticks
+     */
+    static tick_type ticks(double seconds)
+    {
+        return seconds*1000 + .5;
+    }
+
+    /**
+     * seconds() - convert ticks to seconds
+     */
+    static double seconds(tick_type ticks)
+    {
+        return ticks/1000.0;
+    }
+
+    /**
+     * resolution() - return smallest number of ticks the clock advances by
+     *
+     * The coarse clock advances once per jiffy, and the ticker thread only
+     * publishes it once per interval, so shorter durations read as zero.
+     */
+    static tick_type resolution();
+
+    /**
+     * since() - return number of ticks since a timestamp
+     */
+    static tick_type since(tick_type ts)
+    {
+        return now() - ts;
+    }
+
+    /**
+     * start() - start ticker thread
+     * @param interval Milliseconds between updates of the clock.
+     */
+    static void start(uint32_t interval);
+
+    /**
+     * stop() - stop ticker thread; now() reads the clock directly again
+     */
+    static void stop();
+};
+
+#endif
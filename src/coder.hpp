@@ -14,7 +14,11 @@
 #include "io.hpp"
 #include "counters.hpp"
 #include "states.hpp"
-#include "semaphore.hpp"
+#include "admission_queue.hpp"
+#include "arrival_estimator.hpp"
+#include "overshoot.hpp"
+#include "budgets.hpp"
+#include "field_math.hpp"
 
 typedef fifi::binary8 rlnc_field;
 typedef fifi::binary16 rlnc_field2;
@@ -23,10 +27,12 @@ using namespace kodo;
 
 static size_t coder_num = 0;
 
-DECLARE_double(fixed_overshoot);
 DECLARE_int32(e1);
 DECLARE_int32(e2);
 DECLARE_int32(e3);
+DECLARE_bool(link_estimates);
+DECLARE_bool(flush_rank);
+DECLARE_bool(cumulative_acks);
 
 /**
  * class coder - collection of general classes for coder classes
@@ -40,7 +46,9 @@ class coder
       public io_api,
       public counter_api,
       public states,
-      public semaphore_api
+      public admission_api,
+      public arrival_api,
+      public overshoot_api
 {
   protected:
     uint8_t m_e1, m_e2, m_e3;
@@ -64,9 +72,52 @@ class coder
     }
 
     /**
-     * send_ack_packet() - write acknowledgement packet to batman-adv.
+     * flush_rank_size() - Return length of the trailer of sent coded frames
+     *
+     * The trailer is only sent with --flush_rank, as nodes without it
+     * reject coded frames of unexpected length.
+     */
+    static size_t flush_rank_size()
+    {
+        return FLAGS_flush_rank ? FLUSH_RANK_SIZE : 0;
+    }
+
+    /**
+     * coded_length_valid() - Return if a coded frame can be decoded
+     * @param len Length of the frame.
+     * @param size Payload size of the coder.
+     *
+     * Frames with and without the flush rank trailer are accepted, so that
+     * nodes with and without --flush_rank can be mixed. Other frames are
+     * counted and should be dropped.
+     */
+    bool coded_length_valid(size_t len, size_t size)
+    {
+        if (len == size || len == size + FLUSH_RANK_SIZE)
+            return true;
+
+        inc("invalid coded length");
+        VLOG(LOG_PKT) << "Coder " << m_coder << ": Invalid length " << len
+                      << " (payload " << size << ")";
+
+        return false;
+    }
+
+    /**
+     * frame_flush_rank() - Return rank of flushed generation in a frame
+     *
+     * Returns zero for frames without the trailer.
+     */
+    static size_t frame_flush_rank(const uint8_t *data, size_t len,
+                                   size_t size)
+    {
+        return len > size ? get_flush_rank(data + size) : 0;
+    }
+
+    /**
+     * send_ack_frame() - write acknowledgement packet to batman-adv.
      */
-    void send_ack_packet()
+    void send_ack_frame()
     {
         struct nl_msg *msg;
 
@@ -88,55 +139,69 @@ class coder
         VLOG(LOG_CTRL) << "Coder " << m_coder << ": Sent ACK packet";
     }
 
-    bool r_test(uint8_t e1, uint8_t e2, uint8_t e3)
+    /**
+     * send_ack_packet() - acknowledge this generation.
+     * @param copies Number of acks to send.
+     *
+     * With --cumulative_acks, the acknowledgement is scheduled and sent by
+     * io together with acknowledgements of other generations in the same
+     * flow. Otherwise an ACK packet is sent per copy.
+     */
+    void send_ack_packet(size_t copies = 1)
     {
-        return (ONE - e2) < (e3 - e1*e3/ONE);
+        if (!FLAGS_cumulative_acks) {
+            for (; copies > 0; copies--)
+                send_ack_frame();
+            return;
+        }
+
+        m_io->schedule_ack(_key, copies);
+
+        inc("ack scheduled");
+        VLOG(LOG_CTRL) << "Coder " << m_coder << ": Scheduled ACK packet";
     }
 
-    size_t r_val(size_t g, uint8_t e1, uint8_t e2, uint8_t e3)
+    /**
+     * link_error() - Return loss probability of a link in units of ONE.
+     * @param tq Estimated quality of the link; 1 or less if unknown.
+     * @param fallback Loss to use if the quality is unknown or
+     *        --link_estimates is off.
+     */
+    uint8_t link_error(double tq, uint8_t fallback)
     {
-        size_t nom, denom;
-
-        if (r_test(e1, e2, e3)) {
-            denom = e3 - e1*e3/ONE ? : ONE;
-            return ONE/denom + (ONE % denom != 0);
-        } else {
-            nom = ONE*g - g*e2 - g*e3 + g*e1*e3/ONE;
-            denom = ONE + e1*e3*e2/ONE/ONE - e2 - e1*e3/ONE ? : ONE;
-            return nom/denom + (nom % denom != 0);
-        }
+        if (!FLAGS_link_estimates || tq <= 1)
+            return fallback;
+
+        return ONE - std::min<double>(tq, ONE);
     }
 
-    double source_budget(size_t g, uint8_t e1, uint8_t e2, uint8_t e3)
+    /**
+     * budgets() - Return budget values from the real valued formulas.
+     * @param g Number of symbols to send.
+     */
+    budget_terms budgets(size_t g, uint8_t e1, uint8_t e2, uint8_t e3)
     {
-        double nom, denom;
-        size_t r = r_val(g, e1, e2, e3);
+        return budget_real(g, e1, e2, e3);
+    }
 
+    double source_budget(size_t g, uint8_t e1, uint8_t e2, uint8_t e3)
+    {
         if (e3 >= ONE - 1) {
             VLOG(LOG_GEN) << "Encoder " << m_coder << ": Missing link estimate";
-            return FLAGS_fixed_overshoot*g;
+            return overshoot_factor(_key)*g;
         }
 
-        nom = g*ONE + r*ONE - r*e2;
-        denom = 2*ONE - e3 - e2 ? : ONE;
-
-        return FLAGS_fixed_overshoot*nom/denom;
+        return budgets(g, e1, e2, e3).source(overshoot_factor(_key));
     }
 
     size_t recoder_budget(size_t g, uint8_t e1, uint8_t e2, uint8_t e3)
     {
-        size_t nom, denom, r = r_val(g, e1, e2, e3);
-
-        nom = g*ONE + r*ONE - r*e2;
-        denom = 2*ONE - e3 - e2;
-
-        return nom/denom + (nom % denom != 0);
+        return budgets(g, e1, e2, e3).recoder();
     }
 
     double recoder_credit(size_t e1, size_t e2, size_t e3)
     {
-        size_t denom = ONE - e3*e1/ONE;
-        return static_cast<double>(ONE)/denom;
+        return budget_credit(e1, e3);
     }
 
   public:
@@ -149,6 +214,30 @@ class coder
     {
         return true;
     }
+
+    /**
+     * try_lock() - lock coder unless another thread is using it
+     *
+     * Returns a lock that owns the coder if it was free.
+     */
+    std::unique_lock<std::mutex> try_lock()
+    {
+        return std::unique_lock<std::mutex>(m_lock, std::try_to_lock);
+    }
+
+    /**
+     * evict() - Stop coder that is freed to make room for other coders
+     *
+     * Moves the state machine to its final state, so that the coder stops
+     * sending before it is returned to the factory pool, and drops its
+     * queued packets and requests. Must be called with the coder locked.
+     */
+    void evict()
+    {
+        set_state(__STATE_DONE);
+        m_io->cancel_paced(_key);
+        m_io->cancel_request(_key);
+    }
 };
 
 #endif
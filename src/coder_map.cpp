@@ -13,14 +13,21 @@ coder_map<Key, Coder>::create_coder(Key key)
 {
     coder_pointer c;
 
+    if (!reserve_coder())
+        return coder_pointer();
+
     /* Create and return new coder */
     c = m_factory.build();
 
     c->set_key(key);
     c->set_io(m_io);
     c->set_counts(counts());
-    if (has_semaphore())
-        c->set_semaphore(get_semaphore());
+    if (has_admission())
+        c->set_admission(get_admission());
+    if (has_arrival())
+        c->set_arrival(get_arrival());
+    if (has_overshoot())
+        c->set_overshoot(get_overshoot());
     c->init();
 
     m_coders[key] = c;
@@ -29,6 +36,101 @@ coder_map<Key, Coder>::create_coder(Key key)
     return c;
 }
 
+template<typename Key, typename Coder>
+bool coder_map<Key, Coder>::reserve_coder()
+{
+    memory_budget *budget = get_memory_budget();
+
+    if (memory_reserve(m_coder_size))
+        return true;
+
+    /* free coders from this map first, then from the others */
+    while (evict_coder() || (budget && budget->evict(this))) {
+        if (memory_reserve(m_coder_size))
+            return true;
+    }
+
+    VLOG(LOG_GEN) << "Coder map: Memory budget exhausted ("
+                  << memory_used() << " bytes used)";
+    inc("refused");
+    return false;
+}
+
+template<typename Key, typename Coder>
+void coder_map<Key, Coder>::release_coder(map_it it)
+{
+    m_invalid.insert(it->first);
+    m_released.push_back(it->second);
+    m_coders.erase(it);
+    memory_release(m_coder_size);
+}
+
+template<typename Key, typename Coder>
+void coder_map<Key, Coder>::free_released()
+{
+    typename list::iterator it = m_released.begin();
+
+    while (it != m_released.end()) {
+        /* wait for workers to drop the coder and its state thread to
+         * finish the last handler */
+        if (it->use_count() > 1 ||
+            (*it)->curr_state() != states::__STATE_DONE) {
+            ++it;
+            continue;
+        }
+
+        (*it)->release_storage();
+        it = m_released.erase(it);
+    }
+}
+
+template<typename Key, typename Coder>
+bool coder_map<Key, Coder>::evict_coder()
+{
+    std::unique_lock<std::mutex> victim_lock, l;
+    map_it it, victim = m_coders.end();
+    size_t score, lowest = m_symbols;
+
+    for (it = m_coders.begin(); it != m_coders.end(); ++it) {
+        /* skip coders that are in use */
+        l = it->second->try_lock();
+        if (!l.owns_lock())
+            continue;
+
+        score = it->second->eviction_score();
+
+        if (score >= lowest)
+            continue;
+
+        lowest = score;
+        victim = it;
+        victim_lock = std::move(l);
+    }
+
+    if (victim == m_coders.end())
+        return false;
+
+    VLOG(LOG_OBJ) << "Coder map: Evicting coder " << victim->second->num()
+                  << " (score " << lowest << ")";
+    victim->second->evict();
+    victim_lock.unlock();
+    release_coder(victim);
+    inc("evicted");
+
+    return true;
+}
+
+template<typename Key, typename Coder>
+bool coder_map<Key, Coder>::try_evict_coder()
+{
+    std::unique_lock<std::mutex> l(m_lock, std::try_to_lock);
+
+    if (!l.owns_lock())
+        return false;
+
+    return evict_coder();
+}
+
 template<typename Key, typename Coder>
 typename coder_map<Key, Coder>::coder_pointer
 coder_map<Key, Coder>::search_coder(Key key)
@@ -109,13 +211,33 @@ coder_map<Key, Coder>::get_latest_coder(Key key)
     /* Find or create coder */
     c = search_coder(key);
     if (!c || !c->is_valid()) {
-        key = set_block(key, ++key.block);
-        c = create_coder(key);
+        key.block++;
+
+        /* only move to the new block if the coder was not refused */
+        if ((c = create_coder(key)))
+            set_block(key, key.block);
     }
 
     return c;
 }
 
+template<typename Key, typename Coder>
+typename coder_map<Key, Coder>::coder_pointer
+coder_map<Key, Coder>::find_latest_coder(Key key)
+{
+    typename block_map::iterator it;
+
+    guard g(m_lock);
+
+    key.block = 0;
+    if ((it = m_blocks.find(key)) == m_blocks.end())
+        return coder_pointer();
+
+    key.block = it->second;
+
+    return search_coder(key);
+}
+
 template<typename Key, typename Coder>
 void coder_map<Key, Coder>::process_coders()
 {
@@ -127,12 +249,15 @@ void coder_map<Key, Coder>::process_coders()
     while (it != m_coders.end()) {
         if (it->second->process()) {
             VLOG(LOG_OBJ) << "Coder map: Erasing coder " << it->second->num();
-            m_invalid.insert(it->first);
-            m_coders.erase(it++);
+            release_coder(it++);
         } else {
             ++it;
         }
     }
+
+    free_released();
+
+    gauge("bytes used", memory_used());
 }
 
 template class coder_map<key, encoder>;
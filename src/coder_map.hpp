@@ -6,11 +6,15 @@
 #include <mutex>
 #include <set>
 #include <map>
+#include <vector>
 
 #include "fox.hpp"
 #include "io.hpp"
 #include "counters.hpp"
-#include "semaphore.hpp"
+#include "admission_queue.hpp"
+#include "arrival_estimator.hpp"
+#include "overshoot.hpp"
+#include "memory_budget.hpp"
 
 /**
  * class coder_map - Create, track and free coders.
@@ -21,28 +25,80 @@
  * coder is added to a map indexed by type Key. The map is searched for the key
  * when coders are requested. When a coder is freed, its key is moved to a set
  * of freed coders. This set is checked before new coders are created.
+ *
+ * If a memory budget is set, memory for a coder is reserved before it is
+ * created. When the budget is exhausted, the least useful coders in this or
+ * other maps are freed to make room, and new coders are refused if no
+ * coders can be freed.
  */
 template<class Key, class Coder>
 class coder_map
     : public io_api,
       public counter_api,
-      public semaphore_api
+      public admission_api,
+      public arrival_api,
+      public overshoot_api,
+      public memory_budget_api
 {
     typedef typename Coder::pointer coder_pointer;
     typedef std::map<Key, coder_pointer> map;
     typedef std::map<Key, size_t> block_map;
     typedef typename map::iterator map_it;
     typedef std::set<Key> set;
+    typedef std::vector<coder_pointer> list;
 
     typename Coder::factory m_factory;
-    size_t m_symbols, m_symbol_size;
+    size_t m_symbols, m_symbol_size, m_coder_size;
     std::mutex m_lock;
     map m_coders;
     block_map m_blocks;
     set m_invalid;
+    list m_released;
 
     coder_pointer create_coder(Key key);
 
+    /**
+     * release_coder() - Remove coder from m_coders.
+     * @param it Position of coder in m_coders.
+     *
+     * The coder keeps its buffers until no other thread uses it.
+     */
+    void release_coder(map_it it);
+
+    /**
+     * free_released() - Free buffers of released coders no longer in use.
+     */
+    void free_released();
+
+    /**
+     * reserve_coder() - Reserve memory for a new coder.
+     *
+     * Frees stale or finished coders if the memory budget is exhausted.
+     *
+     * Returns true if memory was reserved; false if the coder is refused.
+     */
+    bool reserve_coder();
+
+    /**
+     * evict_coder() - Free the least useful coder in m_coders.
+     *
+     * Only coders scoring lower than a fresh coder are considered, so a new
+     * coder never replaces one that is more likely to complete. Coders in
+     * use by other threads are skipped, and the victim stays locked from
+     * scoring until it is stopped.
+     *
+     * Returns true if a coder was freed; false otherwise.
+     */
+    bool evict_coder();
+
+    /**
+     * try_evict_coder() - Free a coder unless the map is in use.
+     *
+     * Called by other maps through the memory budget, so it must not wait
+     * for m_lock.
+     */
+    bool try_evict_coder();
+
     /**
      * search_coder() - Search m_coders for coder
      * @param key Key of requested coder.
@@ -82,8 +138,24 @@ class coder_map
     coder_map(size_t symbols, size_t symbol_size) :
         m_factory(symbols, symbol_size),
         m_symbols(symbols),
-        m_symbol_size(symbol_size)
-    {}
+        m_symbol_size(symbol_size),
+        m_coder_size(Coder::storage_size(symbols, symbol_size))
+    {
+        set_group("memory budget");
+    }
+
+    /**
+     * set_memory_budget() - Share memory budget with other maps.
+     * @param b Budget to reserve coder memory from.
+     *
+     * Also registers the map with the budget, so that other maps can ask it
+     * to free coders.
+     */
+    void set_memory_budget(memory_budget *b)
+    {
+        memory_budget_api::set_memory_budget(b);
+        b->add_evictor(this, std::bind(&coder_map::try_evict_coder, this));
+    }
 
     /**
      * get_valid_coder() - Find or create a valid coder.
@@ -105,6 +177,14 @@ class coder_map
      */
     coder_pointer get_latest_coder(Key key);
 
+    /**
+     * find_latest_coder() - Find latest coder without creating one.
+     * @param key Key to use when searching coder.
+     *
+     * Returns an empty pointer if the latest block has no coder.
+     */
+    coder_pointer find_latest_coder(Key key);
+
     /**
      * process_coders() - Process all coders and free if coder is done.
      *
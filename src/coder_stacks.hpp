@@ -0,0 +1,96 @@
+/* Copyright 2013 Martin Hundebøll <martin@hundeboll.net> */
+
+#ifndef FOX_CODER_STACKS_HPP_
+#define FOX_CODER_STACKS_HPP_
+
+#include <kodo/rlnc/full_vector_codes.hpp>
+#include <kodo/storage_aware_generator.hpp>
+#include <kodo/shallow_symbol_storage.hpp>
+
+#include "systematic_decoder.hpp"
+#include "deferred_decoder.hpp"
+#include "aligned_storage.hpp"
+
+namespace kodo
+{
+    /*
+     * Codec layers of the encoder and decoder with the field arithmetic as
+     * a parameter, so that the self benchmark measures the stacks that the
+     * coders use.
+     */
+
+    /**
+     * encoder_stack - layers of class encoder
+     * @param Math Finite field arithmetic.
+     * @param Final Final type of the stack.
+     */
+    template<class Math, class Final>
+    using encoder_stack =
+           // Payload Codec API
+           payload_encoder<
+           // Codec Header API
+           systematic_encoder<
+           symbol_id_encoder<
+           // Symbol ID API
+           plain_symbol_id_writer<
+           // Coefficient Generator API
+           storage_aware_generator<
+           uniform_generator<
+           // Codec API
+           encode_symbol_tracker<
+           zero_symbol_encoder<
+           linear_block_encoder<
+           storage_aware_encoder<
+           // Coefficient Storage API
+           coefficient_info<
+           // Symbol Storage API
+           mutable_shallow_symbol_storage<
+           storage_bytes_used<
+           storage_block_info<
+           // Finite Field API
+           finite_field_math<Math,
+           finite_field_info<typename Math::field_type,
+           // Factory API
+           final_coder_factory<
+           // Final type
+           Final
+               > > > > > > > > > > > > > > > > >;
+
+    /**
+     * decoder_stack - layers of class decoder
+     * @param Math Finite field arithmetic.
+     * @param Final Final type of the stack.
+     */
+    template<class Math, class Final>
+    using decoder_stack =
+             // Payload API
+             payload_decoder<
+             // Codec Header API
+             systematic_decoder<
+             systematic_decoder_info<
+             symbol_id_decoder<
+             // Symbol ID API
+             plain_symbol_id_reader<
+             // Codec API
+             deferred_decoder<
+             aligned_coefficients_decoder<
+             linear_block_decoder<
+             // Coefficient Storage API
+             aligned_coefficient_storage<
+             coefficient_info<
+             // Storage API
+             aligned_symbol_storage<
+             mutable_shallow_symbol_storage<
+             storage_bytes_used<
+             storage_block_info<
+             // Finite Field API
+             finite_field_math<Math,
+             finite_field_info<typename Math::field_type,
+             // Factory API
+             final_coder_factory<
+             // Final type
+             Final
+                 > > > > > > > > > > > > > > > > >;
+};  // namespace kodo
+
+#endif
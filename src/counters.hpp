@@ -69,6 +69,19 @@ class counters {
         (*m_counter_map)[shm_string(key.c_str(), m_allocator)]++;
     }
 
+    /**
+     * set() - set a counter to a value
+     * @key: the counter to set
+     * @value: value to assign to counter
+     *
+     * Used for counters that report a current level rather than a count.
+     */
+    void set(const std::string &key, size_t value)
+    {
+        guard l(m_lock);
+        (*m_counter_map)[shm_string(key.c_str(), m_allocator)] = value;
+    }
+
     /**
      * print() - print all created counters by group
      */
@@ -110,6 +123,16 @@ class counter_api
         m_counts->increment(m_group + " " + str);
     }
 
+    /**
+     * gauge() - set a counter to its current level
+     * @str: counter to set
+     * @value: current level
+     */
+    void gauge(std::string str, size_t value)
+    {
+        m_counts->set(m_group + " " + str, value);
+    }
+
   public:
     /**
      * set_counts() - add counter object to class
@@ -1,10 +1,17 @@
 /* Copyright 2013 Martin Hundebøll <martin@hundeboll.net> */
 
+#include <cmath>
+#include <algorithm>
+
 #include "decoder.hpp"
 
 DECLARE_double(decoder_timeout);
 DECLARE_double(packet_timeout);
+DECLARE_double(packet_timeout_min);
+DECLARE_double(packet_timeout_max);
 DECLARE_int32(ack_interval);
+DECLARE_bool(deferred_decoding);
+DECLARE_bool(aggregate_requests);
 
 template<>
 void decoder::send_decoded_packet(size_t i)
@@ -21,6 +28,14 @@ void decoder::send_decoded_packet(size_t i)
     buf = this->symbol(i);
     len = *reinterpret_cast<uint16_t *>(buf);
 
+    /* the mark ends a flushed generation and is not delivered */
+    if (len == FLUSH_MARK) {
+        VLOG(LOG_PKT) << "Decoder " << m_coder << ": Flushed at " << i;
+        m_flush_symbols = i;
+        m_decoded_symbols[i] = true;
+        return;
+    }
+
     /* avoid wrongly decoded packets by checking that the
      * length is within expected range
      */
@@ -59,10 +74,13 @@ void decoder::send_decoded_packets()
     inc("generations decoded");
 
     guard g(m_lock);
-    for (; ack_budget > 0; ack_budget--)
-        send_ack_packet();
+    m_io->cancel_request(_key);
+    send_ack_packet(std::ceil(ack_budget));
 
-    send_partial_decoded_packets(this->symbols());
+    /* flushed generations are decoded with staged symbols left */
+    this->flush();
+    send_partial_decoded_packets(m_flush_symbols ? m_flush_symbols
+                                                 : this->symbols());
     dispatch_event(EVENT_ACKED);
 }
 
@@ -90,6 +108,41 @@ void decoder::send_request(size_t seq)
     VLOG(LOG_CTRL) << "Decoder " << m_coder << ": Sent request packet";
 }
 
+template<>
+void decoder::set_arrival_timeout(double ticks)
+{
+    double t = FLAGS_packet_timeout_max;
+
+    if (ticks >= 0)
+        t = FLAGS_packet_timeout*coarse_clock::seconds(ticks);
+
+    t = std::max(t, FLAGS_packet_timeout_min);
+    t = std::min(t, FLAGS_packet_timeout_max);
+
+    set_pkt_timeout(t);
+}
+
+template<>
+void decoder::add_arrival()
+{
+    m_arrivals.add(coarse_clock::now());
+
+    if (m_arrivals.measured())
+        set_arrival_timeout(m_arrivals.average());
+}
+
+template<>
+void decoder::complete_flushed()
+{
+    /* the shadow rank covers the mark, but staged symbols aren't decoded */
+    this->flush();
+    send_partial_decoded_packets(m_flush_symbols);
+
+    inc("flushed generations received");
+    arrival_update(_key, m_arrivals);
+    dispatch_event(EVENT_COMPLETE);
+}
+
 template<>
 void decoder::init()
 {
@@ -98,7 +151,8 @@ void decoder::init()
     set_group("decoder");
     set_state(STATE_WAIT);
     init_timeout(FLAGS_decoder_timeout);
-    set_pkt_timeout(FLAGS_packet_timeout);
+    set_arrival_timeout(arrival_estimate(_key));
+    this->set_deferred(FLAGS_deferred_decoding);
 
     /* Reset list of decoded packets. */
     m_decoded_symbols.resize(this->symbols());
@@ -107,35 +161,52 @@ void decoder::init()
     m_enc_pkt_count = 0;
     m_red_pkt_count = 0;
     m_req_seq = 1;
+    m_flush_symbols = 0;
+    m_arrivals.reset();
+
+    /* link quality towards source decides how often requests are sent */
+    m_io->read_link(_key.src);
     VLOG(LOG_GEN) << "Decoder " << m_coder << ": Initialized " << _key;
 }
 
 template<>
 void decoder::add_enc_packet(const uint8_t *data, const uint16_t len)
 {
-    size_t rank, symbol_index, msecs;
+    size_t rank, symbol_index, msecs, flush_rank;
     bool systematic;
     size_t size = this->payload_size();
 
     guard g(m_lock);
 
-    if (this->is_complete()) {
+    if (this->is_complete() || is_flushed()) {
         inc("redundant received");
         if (++m_red_pkt_count % FLAGS_ack_interval == 0)
             send_ack_packet();
         return;
     }
 
-    CHECK_EQ(len, size) << "Decoder " << m_coder
-                        << ": Invalid length:" << len << " != " << size;
+    if (!coded_length_valid(len, size))
+        return;
 
+    add_arrival();
     rank = this->rank();
     this->decode(const_cast<uint8_t *>(data));
     m_enc_pkt_count++;
 
+    /* the mark may be staged or lost, so take its index from the trailer */
+    flush_rank = frame_flush_rank(data, len, size);
+    if (flush_rank && !m_flush_symbols)
+        m_flush_symbols = flush_rank - 1;
+
     if (this->rank() == rank) {
         VLOG(LOG_PKT) << "Decoder " << m_coder << ": Added non-innovative";
         inc("non-innovative received");
+
+        if (is_flushed()) {
+            complete_flushed();
+            return;
+        }
+
         update_timestamp();
         update_packet_timestamp();
         return;
@@ -145,12 +216,14 @@ void decoder::add_enc_packet(const uint8_t *data, const uint16_t len)
     symbol_index = this->last_symbol_index();
 
     if (this->is_complete()) {
+        arrival_update(_key, m_arrivals);
         dispatch_event(EVENT_COMPLETE);
         return;
     }
 
+    /* staged symbols are not decoded yet, so only deliver those that are */
     if (this->is_partial_complete())
-        send_partial_decoded_packets(this->rank());
+        send_partial_decoded_packets(this->decoded_rank());
 
     if (systematic) {
         inc("systematic received");
@@ -162,6 +235,11 @@ void decoder::add_enc_packet(const uint8_t *data, const uint16_t len)
         inc("encoded received");
     }
 
+    if (is_flushed()) {
+        complete_flushed();
+        return;
+    }
+
     update_timestamp();
     update_packet_timestamp();
 }
@@ -172,6 +250,12 @@ bool decoder::process()
     if (curr_state() == STATE_DONE)
         return true;
 
+    /* let the next generations of the flow benefit from this one */
+    if (is_timed_out()) {
+        guard g(m_lock);
+        arrival_update(_key, m_arrivals);
+    }
+
     if (is_timed_out() && !this->is_complete() &&
         !this->is_partial_complete()) {
         LOG(ERROR) << "Decoder " << m_coder << ": Timed out (rank "
@@ -187,17 +271,32 @@ bool decoder::process()
     }
 
     if (curr_state() == STATE_WAIT && packet_timed_out()) {
+        guard g(m_lock);
 
-        if (this->is_partial_complete())
-            return false;
+        /* decode staged packets to deliver what is possible */
+        this->flush();
+        if (this->is_partial_complete()) {
+            send_partial_decoded_packets(this->decoded_rank());
+
+            if (is_flushed())
+                complete_flushed();
 
-        double req_budget = source_budget(1, 254, 254, m_e3);
+            return false;
+        }
 
         VLOG(LOG_GEN) << "Decoder " << m_coder << ": Request more data (rank "
                       << this->rank() << ", seq " << m_req_seq << ")";
 
-        for (; req_budget >= 0; req_budget--)
-            send_request(m_req_seq);
+        if (FLAGS_aggregate_requests) {
+            m_io->schedule_request(_key, this->rank(), m_req_seq);
+            inc("request scheduled");
+        } else {
+            double req_budget = source_budget(1, 254, 254, m_e3);
+
+            for (; req_budget >= 0; req_budget--)
+                send_request(m_req_seq);
+        }
+
         m_req_seq++;
         update_packet_timestamp();
 
@@ -206,3 +305,12 @@ bool decoder::process()
 
     return false;
 }
+
+template<>
+size_t decoder::storage_size(size_t symbols, size_t symbol_size)
+{
+    /* symbols and coefficients, and the same again while staged */
+    size_t size = symbols * (align_up(symbol_size) + align_up(symbols));
+
+    return FLAGS_deferred_decoding ? 2 * size : size;
+}
@@ -3,49 +3,29 @@
 #ifndef FOX_DECODER_HPP_
 #define FOX_DECODER_HPP_
 
-#include <kodo/rlnc/full_vector_codes.hpp>
 #include <vector>
 
+#include "coder_stacks.hpp"
 #include "coder.hpp"
-#include "systematic_decoder.hpp"
 
 /**
  * class decoder - decoder based on the kodo library.
  */
 template<class Field>
 class full_rlnc_decoder_deep
-    : public
-             // Payload API
-             payload_decoder<
-             // Codec Header API
-             systematic_decoder<
-             systematic_decoder_info<
-             symbol_id_decoder<
-             // Symbol ID API
-             plain_symbol_id_reader<
-             // Codec API
-             aligned_coefficients_decoder<
-             linear_block_decoder<
-             // Coefficient Storage API
-             coefficient_storage<
-             coefficient_info<
-             // Storage API
-             deep_symbol_storage<
-             storage_bytes_used<
-             storage_block_info<
-             // Finite Field API
-             finite_field_math<typename fifi::default_field<Field>::type,
-             finite_field_info<Field,
-             // Factory API
-             final_coder_factory<
-             // Final type
-             full_rlnc_decoder_deep<Field>
-                 > > > > > > > > > > > > > > >, public coder
+    : public decoder_stack<typename fox_math<Field>::type,
+                           full_rlnc_decoder_deep<Field> >, public coder
 {
     std::vector<bool> m_decoded_symbols;
     std::atomic<size_t> m_enc_pkt_count, m_red_pkt_count;
     size_t m_req_seq;
 
+    /* number of plain packets in a flushed generation; zero until the
+     * mark ending it is decoded or a coded packet carries its rank */
+    size_t m_flush_symbols;
+
+    arrival_meter m_arrivals;
+
     /**
      * enum m_state - states that this decoder can reside in
      * @STATE_INVALID:   inherited state that should never be entered
@@ -106,34 +86,88 @@ class full_rlnc_decoder_deep
 
     void send_partial_decoded_packets(size_t rank);
 
+    /**
+     * send_request() - Write request for more data to batman-adv.
+     * @param seq Sequence number of the request.
+     */
     void send_request(size_t seq);
 
-  public:
     /**
-     * full_rlnc_decoder_deep() - Construct decoder
+     * is_flushed() - Return if a generation closed early is decoded.
      *
-     * Allocates packet buffers and initalizes the state machine.
+     * The encoder only codes over the plain packets and the mark, so the
+     * generation is decoded once the rank exceeds the mark index.
      */
-    full_rlnc_decoder_deep()
+    bool is_flushed()
     {
-        handler_func dec, ack;
+        return m_flush_symbols && this->rank() > m_flush_symbols;
+    }
+
+    /**
+     * complete_flushed() - Deliver and complete a flushed generation.
+     *
+     * Eliminates the staged symbols of a deferred decoder before delivering
+     * the plain packets in front of the mark.
+     */
+    void complete_flushed();
+
+    /**
+     * set_arrival_timeout() - Set packet timeout from inter-arrival time.
+     * @param ticks Average inter-arrival time; negative if unknown.
+     *
+     * Waits --packet_timeout inter-arrival times for more data, bounded by
+     * --packet_timeout_min and --packet_timeout_max.
+     */
+    void set_arrival_timeout(double ticks);
+
+    /**
+     * add_arrival() - Account arrival of a packet in this generation.
+     *
+     * Switches the packet timeout from the average of the flow to the
+     * average of this generation once ARRIVAL_SPAN inter-arrival times have
+     * been measured.
+     */
+    void add_arrival();
+
 
-        /* prepare the state tables */
-        states::init(m_coder, STATE_NUM, EVENT_NUM);
+    /* allowed transitions between states */
+    static constexpr transition s_transitions[] = {
+        {STATE_WAIT, EVENT_TIMEOUT, STATE_DONE},
+        {STATE_WAIT, EVENT_COMPLETE, STATE_WRITE_DEC},
+        {STATE_WRITE_DEC, EVENT_ACKED, STATE_ACKED},
+        {STATE_ACKED, EVENT_TIMEOUT, STATE_DONE},
+        {STATE_DONE, EVENT_COMPLETE, STATE_DONE},
+    };
+
+    static constexpr size_t s_transition_num =
+        sizeof(s_transitions)/sizeof(s_transitions[0]);
 
-        /* add states to table */
-        dec = std::bind(&full_rlnc_decoder_deep::send_decoded_packets, this);
-        ack = std::bind(&full_rlnc_decoder_deep::wait, this);
+    static_assert(valid(s_transitions, s_transition_num, STATE_NUM,
+                        EVENT_NUM), "invalid decoder transitions");
 
-        add_state(STATE_WRITE_DEC, dec);
-        add_state(STATE_ACKED, ack);
+    /* function to call when entering each state */
+    static constexpr handler_func s_handlers[STATE_NUM] = {
+        &states::invalid_state,
+        &states::wait_state,
+        &states::wait_state,
+        &states::call<full_rlnc_decoder_deep,
+                      &full_rlnc_decoder_deep::send_decoded_packets>,
+        &states::wait_state,
+    };
 
-        /* add transitions to state table */
-        add_trans(STATE_WAIT, EVENT_TIMEOUT, STATE_DONE);
-        add_trans(STATE_WAIT, EVENT_COMPLETE, STATE_WRITE_DEC);
-        add_trans(STATE_WRITE_DEC, EVENT_ACKED, STATE_ACKED);
-        add_trans(STATE_ACKED, EVENT_TIMEOUT, STATE_DONE);
-        add_trans(STATE_DONE, EVENT_COMPLETE, STATE_DONE);
+    static constexpr state_table<STATE_NUM, EVENT_NUM> s_table{
+        s_transitions, s_transition_num, s_handlers
+    };
+
+  public:
+    /**
+     * full_rlnc_decoder_deep() - Construct decoder
+     *
+     * Allocates packet buffers and sets up the state machine.
+     */
+    full_rlnc_decoder_deep()
+    {
+        states::init(m_coder, s_table);
     }
 
     /**
@@ -168,6 +202,46 @@ class full_rlnc_decoder_deep
      */
     bool process();
 
+    /**
+     * release_storage() - free coding buffers of a freed decoder
+     *
+     * Called by coder_map once no other thread uses the decoder, so that
+     * pooled objects don't keep their buffers.
+     */
+    void release_storage()
+    {
+        guard g(m_lock);
+
+        this->release_staging();
+        this->release_coefficients();
+        this->release_symbols();
+    }
+
+    /**
+     * eviction_score() - Return how useful it is to keep the decoder
+     *
+     * Used by coder_map to select a coder to free when the memory budget is
+     * exhausted. Coders with the lowest score are freed first, and coders
+     * scoring SIZE_MAX are never freed.
+     */
+    size_t eviction_score()
+    {
+        switch (curr_state()) {
+            case STATE_DONE:
+            case STATE_ACKED:
+                return 0;
+            case STATE_WAIT:
+                return this->rank() + (is_stale() ? 0 : this->symbols());
+            default:
+                return SIZE_MAX;
+        }
+    }
+
+    /**
+     * storage_size() - Return bytes of coding buffers used by one decoder
+     */
+    static size_t storage_size(size_t symbols, size_t symbol_size);
+
     /**
      * is_valid() - Return if decoder is still open for more packets
      */
@@ -177,6 +251,17 @@ class full_rlnc_decoder_deep
     }
 };
 
+template<class Field>
+constexpr states::transition full_rlnc_decoder_deep<Field>::s_transitions[];
+
+template<class Field>
+constexpr states::handler_func full_rlnc_decoder_deep<Field>::s_handlers[];
+
+template<class Field>
+constexpr states::state_table<full_rlnc_decoder_deep<Field>::STATE_NUM,
+                              full_rlnc_decoder_deep<Field>::EVENT_NUM>
+    full_rlnc_decoder_deep<Field>::s_table;
+
 typedef full_rlnc_decoder_deep<rlnc_field> decoder;
 
 #endif
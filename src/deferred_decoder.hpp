@@ -0,0 +1,263 @@
+/* Copyright 2013 Martin Hundebøll <martin@hundeboll.net> */
+
+#ifndef FOX_DEFERRED_DECODER_HPP_
+#define FOX_DEFERRED_DECODER_HPP_
+
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#include <fifi/fifi_utils.hpp>
+
+#include "aligned_alloc.hpp"
+
+namespace kodo
+{
+    /**
+     * class deferred_decoder - postpone payload elimination until needed
+     *
+     * Encoded symbols are first eliminated on their coefficient vectors
+     * only, which is enough to tell if the symbol is innovative and to track
+     * the rank. Non-innovative symbols are dropped without touching their
+     * payload, and innovative symbols are staged until the generation reaches
+     * full rank or flush() is called, e.g. before recoding or when partial
+     * delivery is wanted.
+     *
+     * Systematic symbols are passed on immediately so that they can be
+     * delivered without delay.
+     *
+     * When not deferred, symbols are passed on without the coefficient
+     * elimination, and ranks are those of the decoder below.
+     */
+    template<class SuperCoder>
+    class deferred_decoder : public SuperCoder
+    {
+      public:
+        typedef typename SuperCoder::factory factory;
+        typedef typename SuperCoder::field_type field_type;
+        typedef typename SuperCoder::value_type value_type;
+
+        void initialize(const factory &the_factory)
+        {
+            SuperCoder::initialize(the_factory);
+
+            size_t symbols = SuperCoder::symbols();
+            size_t coeffs = SuperCoder::coefficients_size();
+
+            m_rows.resize(symbols * coeffs);
+            m_vector.resize(coeffs);
+            m_pivots.assign(symbols, false);
+            m_rank = 0;
+            m_staged = 0;
+
+            if (m_deferred)
+                allocate_staging();
+        }
+
+        void decode(uint8_t *symbol_data, uint8_t *coefficients)
+        {
+            if (!m_deferred) {
+                SuperCoder::decode(symbol_data, coefficients);
+                return;
+            }
+
+            memcpy(&m_vector[0], coefficients, m_vector.size());
+
+            if (!reduce())
+                return;
+
+            stage(symbol_data, coefficients);
+
+            if (m_rank == SuperCoder::symbols())
+                flush();
+        }
+
+        void decode_symbol(uint8_t *symbol_data, uint32_t symbol_index)
+        {
+            if (!m_deferred) {
+                SuperCoder::decode_symbol(symbol_data, symbol_index);
+                return;
+            }
+
+            std::fill(m_vector.begin(), m_vector.end(), 0);
+            fifi::set_value<field_type>(vector(), symbol_index, 1);
+
+            if (!reduce())
+                return;
+
+            SuperCoder::decode_symbol(symbol_data, symbol_index);
+
+            if (m_rank == SuperCoder::symbols())
+                flush();
+        }
+
+        /**
+         * flush() - run payload elimination on all staged symbols
+         */
+        void flush()
+        {
+            for (uint32_t i = 0; i < m_staged; i++)
+                SuperCoder::decode(staged_symbol(i), staged_coefficients(i));
+
+            m_staged = 0;
+        }
+
+        /**
+         * rank() - return rank including staged symbols
+         */
+        uint32_t rank() const
+        {
+            return m_deferred ? m_rank : SuperCoder::rank();
+        }
+
+        /**
+         * decoded_rank() - return rank of symbols with eliminated payloads
+         *
+         * Staged symbols are counted by rank() but not here, so this is the
+         * rank to use with is_partial_complete() of the decoder below.
+         */
+        uint32_t decoded_rank() const
+        {
+            return SuperCoder::rank();
+        }
+
+        bool is_complete() const
+        {
+            return rank() == SuperCoder::symbols() && m_staged == 0;
+        }
+
+        uint32_t staged() const
+        {
+            return m_staged;
+        }
+
+        /**
+         * release_staging() - free staging storage until next initialize()
+         *
+         * Staged symbols are dropped.
+         */
+        void release_staging()
+        {
+            m_staging.reset();
+            m_staging_size = 0;
+            m_staged = 0;
+        }
+
+        /**
+         * set_deferred() - choose whether to defer payload elimination
+         *
+         * Must be called before symbols of a generation are decoded, as
+         * coefficients are only tracked while deferred.
+         */
+        void set_deferred(bool deferred)
+        {
+            if (m_staged)
+                flush();
+
+            m_deferred = deferred;
+
+            if (m_deferred)
+                allocate_staging();
+        }
+
+      protected:
+        /**
+         * allocate_staging() - allocate aligned storage for staged symbols
+         *
+         * Staged symbols are stored first, followed by their coefficients.
+         */
+        void allocate_staging()
+        {
+            size_t symbols = SuperCoder::symbols();
+            size_t size;
+
+            m_symbol_stride = align_up(SuperCoder::symbol_size());
+            m_coefficient_stride = align_up(SuperCoder::coefficients_size());
+            size = symbols * (m_symbol_stride + m_coefficient_stride);
+
+            if (m_staging_size < size) {
+                m_staging.reset(aligned_allocate(size));
+                m_staging_size = size;
+            }
+        }
+
+        uint8_t *staged_symbol(uint32_t index)
+        {
+            return m_staging.get() + index * m_symbol_stride;
+        }
+
+        uint8_t *staged_coefficients(uint32_t index)
+        {
+            return m_staging.get() + SuperCoder::symbols() * m_symbol_stride +
+                index * m_coefficient_stride;
+        }
+
+        value_type *vector()
+        {
+            return reinterpret_cast<value_type *>(&m_vector[0]);
+        }
+
+        value_type *row(uint32_t index)
+        {
+            size_t coeffs = SuperCoder::coefficients_size();
+            return reinterpret_cast<value_type *>(&m_rows[index * coeffs]);
+        }
+
+        /**
+         * reduce() - eliminate m_vector against known coefficient rows
+         *
+         * Returns true and stores the reduced vector as a new row if the
+         * vector is innovative; false otherwise.
+         */
+        bool reduce()
+        {
+            uint32_t length = SuperCoder::coefficients_length();
+            value_type *v = vector();
+            value_type c;
+
+            for (uint32_t i = 0; i < SuperCoder::symbols(); i++) {
+                c = fifi::get_value<field_type>(v, i);
+
+                if (!c)
+                    continue;
+
+                if (m_pivots[i]) {
+                    SuperCoder::multiply_subtract(v, row(i), c, length);
+                    continue;
+                }
+
+                /* new pivot; normalize and store vector as row */
+                if (c != 1)
+                    SuperCoder::multiply(v, SuperCoder::invert(c), length);
+
+                memcpy(row(i), v, m_vector.size());
+                m_pivots[i] = true;
+                m_rank++;
+
+                return true;
+            }
+
+            return false;
+        }
+
+        void stage(const uint8_t *symbol_data, const uint8_t *coefficients)
+        {
+            memcpy(staged_symbol(m_staged), symbol_data,
+                   SuperCoder::symbol_size());
+            memcpy(staged_coefficients(m_staged), coefficients,
+                   SuperCoder::coefficients_size());
+            m_staged++;
+        }
+
+      protected:
+        std::vector<uint8_t> m_rows, m_vector;
+        aligned_ptr m_staging;
+        size_t m_staging_size = {0};
+        size_t m_symbol_stride, m_coefficient_stride;
+        std::vector<bool> m_pivots;
+        uint32_t m_rank, m_staged;
+        bool m_deferred = {true};
+    };
+};  // namespace kodo
+
+#endif
@@ -1,19 +1,23 @@
 /* Copyright 2013 Martin Hundebøll <martin@hundeboll.net> */
 
 #include "encoder.hpp"
+#include <algorithm>
 #include <chrono>
 #include <thread>
 
 DECLARE_double(encoder_timeout);
 DECLARE_double(encoder_threshold);
+DECLARE_double(flush_idle);
 
 template<>
-void encoder::send_encoded_packet(uint8_t type)
+bool encoder::send_encoded_packet(uint8_t type)
 {
     struct nl_msg *msg;
+    bool sent;
     struct nlattr *attr;
     uint8_t *data;
     size_t symbols = this->symbols();
+    size_t size = this->payload_size();
 
     VLOG(LOG_PKT) << "Encoder " << m_coder << ": Send "
                   << (m_enc_pkt_count < symbols ? "systematic" : "encoded");
@@ -27,23 +31,37 @@ void encoder::send_encoded_packet(uint8_t type)
     nla_put(msg, BATADV_HLP_A_DST, ETH_ALEN, _key.dst);
     nla_put_u16(msg, BATADV_HLP_A_BLOCK, _key.block);
     nla_put_u8(msg, BATADV_HLP_A_TYPE, type);
-    attr = nla_reserve(msg, BATADV_HLP_A_FRAME, this->payload_size());
+    attr = nla_reserve(msg, BATADV_HLP_A_FRAME, size + flush_rank_size());
     data = reinterpret_cast<uint8_t *>(nla_data(attr));
 
     this->encode(data);
-    m_io->send_msg(msg);
+    if (flush_rank_size())
+        put_flush_rank(data + size, m_flushed ? m_plain_pkt_count + 1 : 0);
+    sent = m_io->send_paced(_key, msg);
     nlmsg_free(msg);
 
+    if (!sent)
+        return false;
+
     m_enc_pkt_count++;
     inc("encoded sent");
     m_budget--;
+
+    return true;
 }
 
 template<>
 void encoder::send_encoded_credit()
 {
+    /* keep credits for later if io can't keep up */
+    if (m_io->congested()) {
+        inc("credits postponed");
+        return;
+    }
+
     while (m_budget >= 1 && m_enc_pkt_count < m_max_budget)
-        send_encoded_packet(m_type);
+        if (!send_encoded_packet(m_type))
+            break;
 }
 
 template<>
@@ -54,9 +72,12 @@ void encoder::send_encoded_budget()
 
     guard g(m_lock);
 
+    /* process() sends the rest if the pacer is full */
     while (m_enc_pkt_count < m_max_budget)
-        send_encoded_packet(m_type);
+        if (!send_encoded_packet(m_type))
+            break;
 
+    send_held_packets();
     update_timestamp();
     dispatch_event(EVENT_BUDGET_SENT);
 }
@@ -83,17 +104,32 @@ void encoder::init()
 
     set_group("encoder");
     set_state(STATE_WAIT);
+    m_self = this->shared_from_this();
     init_timeout(FLAGS_encoder_timeout);
 
     /* allocate memory for encoder */
     if (!m_symbol_storage)
-        m_symbol_storage = new uint8_t[this->block_size()];
+        m_symbol_storage = aligned_allocate(this->symbols() *
+                                            align_up(this->symbol_size()));
+
+    /* give back admission left from previous use */
+    enc_notify();
+
+    /* drop buffers from previous use and reserve one per symbol */
+    release_buffers();
+    m_buffers.reserve(this->symbols());
+    m_held.clear();
 
     /* reset counters */
     m_plain_pkt_count = 0;
     m_enc_pkt_count = 0;
     m_last_req_seq = 0;
+    m_last_req_rank = 0;
     m_type = ENC_PACKET;
+    m_flushed = false;
+    m_repaired = false;
+    m_arrivals.reset();
+    m_arrival_seed = arrival_estimate(_key);
 
     m_io->read_link(_key.dst);
     m_io->read_one_hops(_key.dst);
@@ -101,17 +137,82 @@ void encoder::init()
     helper_msg best_helper = m_io->get_best_one_hop(_key.dst);
     m_io->read_link(best_helper.addr);
 
-    /*
-    e1 = ONE - m_io->get_link(best_helper.addr);
-    e2 = ONE - best_helper.tq_second_hop * 4.5; // Scale to revert hop penalty
-    e3 = ONE - m_io->get_link(_key.dst);
-    */
+    /* estimates arrive after the reads above, so use the ones we have */
+    m_e1 = link_error(m_io->get_link(best_helper.addr), FLAGS_e1*2.55);
+    m_e2 = link_error(best_helper.tq_second_hop*4.5,  // revert hop penalty
+                      FLAGS_e2*2.55);
+    m_e3 = link_error(m_io->get_link(_key.dst), FLAGS_e3*2.55);
+    m_has_helper = best_helper.tq_total > 1;
 
     m_max_budget = source_budget(this->symbols(), m_e1, m_e2, m_e3);
     VLOG(LOG_GEN) << "Encoder " << m_coder << ": Initialized (B: "
                   << m_max_budget << ") " << _key;
 }
 
+template<>
+void encoder::add_symbol(uint8_t *buf)
+{
+    sak::mutable_storage symbol(buf, this->symbol_size());
+    this->set_symbol(m_plain_pkt_count++, symbol);
+
+    m_arrivals.add(coarse_clock::now());
+    update_timestamp();
+    inc("plain packets added");
+    VLOG(LOG_PKT) << "Encoder " << m_coder << ": Added plain packet";
+
+    if (is_full()) {
+        inc("generations");
+        arrival_update(_key, m_arrivals);
+        dispatch_event(EVENT_FULL);
+    } else if (this->rank() > FLAGS_encoder_threshold*this->symbols() &&
+               admission_available() > 0) {
+        m_budget += recoder_credit(m_e1, m_e2, m_e3);
+        send_encoded_credit();
+    }
+}
+
+template<>
+bool encoder::idle_timed_out()
+{
+    double ticks = m_arrivals.measured() ? m_arrivals.average()
+                                         : m_arrival_seed;
+
+    /* new flows use the few packets they have */
+    if (ticks < 0 && m_arrivals.count() > 1)
+        ticks = m_arrivals.average();
+
+    if (ticks < 0)
+        return false;
+
+    /* wait longer than a step of the clock to not flush between two
+     * packets read at the same time */
+    return m_arrivals.idle() > std::max<double>(FLAGS_flush_idle*ticks,
+                                                coarse_clock::resolution());
+}
+
+template<>
+void encoder::flush_generation()
+{
+    uint8_t *buf = get_symbol_buffer(m_plain_pkt_count);
+    sak::mutable_storage symbol(buf, this->symbol_size());
+    size_t rank = m_plain_pkt_count + 1;
+
+    *reinterpret_cast<uint16_t *>(buf) = FLUSH_MARK;
+    this->set_symbol(m_plain_pkt_count, symbol);
+
+    m_flushed = true;
+    /* credits may already cover the budget; the mark must still be sent */
+    m_max_budget = std::max<double>(source_budget(rank, m_e1, m_e2, m_e3),
+                                    m_enc_pkt_count + 1);
+    arrival_update(_key, m_arrivals);
+
+    inc("generations flushed");
+    VLOG(LOG_GEN) << "Encoder " << m_coder << ": Flushed (rank " << rank
+                  << ", B: " << m_max_budget << ")";
+
+    dispatch_event(EVENT_FLUSH);
+}
+
 template<>
 void encoder::add_plain_packet(const uint8_t *data, const uint16_t len)
 {
@@ -125,7 +226,7 @@ void encoder::add_plain_packet(const uint8_t *data, const uint16_t len)
     guard g(m_lock);
 
     /* make sure encoder is in a state to accept plain packets */
-    if (curr_state() != STATE_WAIT)
+    if (curr_state() != STATE_WAIT || m_flushed)
         return;
 
     buf = get_symbol_buffer(m_plain_pkt_count);
@@ -133,33 +234,58 @@ void encoder::add_plain_packet(const uint8_t *data, const uint16_t len)
     memcpy(buf + LEN_SIZE, data, len);
 
     /* Copy data into encoder storage */
-    sak::mutable_storage symbol(buf, this->symbol_size());
-    this->set_symbol(m_plain_pkt_count++, symbol);
+    add_symbol(buf);
+}
 
-    update_timestamp();
-    inc("plain packets added");
-    VLOG(LOG_PKT) << "Encoder " << m_coder << ": Added plain packet";
+template<>
+void encoder::add_plain_packet(packet_buffer buf)
+{
+    uint8_t *symbol;
+    size_t size = this->symbol_size();
 
-    if (is_full()) {
-        inc("generations");
-        dispatch_event(EVENT_FULL);
-    } else if (this->rank() > FLAGS_encoder_threshold*this->symbols() &&
-               semaphore_count() > 0) {
-        m_budget += recoder_credit(m_e1, m_e2, m_e3);
-        send_encoded_credit();
-    }
+    CHECK_LE(buf.len(), size - LEN_SIZE) << "Encoder " << m_coder
+                                         << ": Plain packet is too long: "
+                                         << buf.len() << " > "
+                                         << size - LEN_SIZE;
+    CHECK_GE(buf.headroom(), LEN_SIZE) << "Encoder " << m_coder
+                                       << ": No room for length field";
+    CHECK_GE(buf.tailroom() + LEN_SIZE, size) << "Encoder " << m_coder
+                                              << ": Buffer too small";
+
+    guard g(m_lock);
+
+    /* make sure encoder is in a state to accept plain packets */
+    if (curr_state() != STATE_WAIT || m_flushed)
+        return;
+
+    /* place length field in headroom and use buffer as symbol */
+    symbol = buf.data() - LEN_SIZE;
+    *reinterpret_cast<uint16_t *>(symbol) = buf.len();
+    m_buffers.push_back(std::move(buf));
+
+    add_symbol(symbol);
 }
 
 template<>
 void encoder::add_ack_packet()
 {
+    size_t sent;
+
     guard g(m_lock);
 
     if (curr_state() == STATE_DONE)
         return;
 
-    if (m_plain_pkt_count == this->symbols())
-        enc_notify();
+    enc_notify();
+
+    /* packets still waiting in the pacer never reach the air */
+    sent = m_enc_pkt_count - m_io->cancel_paced(_key);
+
+    /* the receiver needed at most the packets sent so far */
+    m_io->link_delivery(_key.dst, this->rank(), sent, true);
+
+    if (!m_repaired && curr_state() != STATE_WAIT && m_max_budget > 0)
+        overshoot_acked(_key, std::max(1 - sent/m_max_budget, 0.0));
 
     dispatch_event(EVENT_ACKED);
     inc("ack packets added");
@@ -177,6 +303,24 @@ void encoder::add_req_packet(const uint16_t rank, const uint16_t seq)
     if (m_last_req_seq == seq || rank == this->rank())
         return;
 
+    m_io->link_delivery(_key.dst, rank, m_enc_pkt_count);
+
+    /* leave the request to helpers unless they didn't repair the last one */
+    if (m_has_helper && (m_last_req_seq == 0 || rank != m_last_req_rank)) {
+        m_last_req_seq = seq;
+        m_last_req_rank = rank;
+        inc("requests left to helpers");
+        VLOG(LOG_CTRL) << "Encoder " << m_coder << ": Request (rank " << rank
+                       << ") left to helpers";
+        return;
+    }
+
+    /* raise overshoot once per generation */
+    if (!m_repaired)
+        overshoot_repaired(_key);
+
+    m_repaired = true;
+
     m_budget = credits;
     if (m_enc_pkt_count >= m_max_budget)
         m_max_budget += credits;
@@ -198,6 +342,30 @@ void encoder::add_req_packet(const uint16_t rank, const uint16_t seq)
                    << ", credits " << credits << ")";
 }
 
+template<>
+void encoder::close_generation()
+{
+    guard g(m_lock);
+
+    if (curr_state() == STATE_WAIT && m_plain_pkt_count > 0 && is_valid())
+        flush_generation();
+}
+
+template<>
+bool encoder::hold_plain_packet(const uint8_t *data, const uint16_t len)
+{
+    guard g(m_lock);
+
+    if (!m_flushed || curr_state() == STATE_WAIT_ACK ||
+        curr_state() == STATE_DONE)
+        return false;
+
+    m_held.emplace_back(data, data + len);
+    inc("plain packets held");
+
+    return true;
+}
+
 template<>
 bool encoder::process()
 {
@@ -209,14 +377,36 @@ bool encoder::process()
             LOG(ERROR) << "Encoder " << m_coder
                           << ": Timed out while blocked";
             enc_notify();
+
+            /* coder_map only frees coders that reached their final state */
+            dispatch_event(EVENT_TIMEOUT);
+            send_held_packets();
             return true;
         }
         return false;
     }
 
     /* check if decoder is ready to be reused */
-    if (curr_state() == STATE_DONE)
+    if (curr_state() == STATE_DONE) {
+        send_held_packets();
+        release_buffers();
         return true;
+    }
+
+    /* close partial generation when the source pauses */
+    if (FLAGS_flush_idle > 0 && curr_state() == STATE_WAIT &&
+        m_plain_pkt_count > 0 && is_valid() && idle_timed_out()) {
+        flush_generation();
+        return false;
+    }
+
+    /* send packets the pacer had no room for */
+    if (curr_state() == STATE_WAIT_ACK && m_enc_pkt_count < m_max_budget &&
+        !m_io->congested()) {
+        while (m_enc_pkt_count < m_max_budget)
+            if (!send_encoded_packet(m_type))
+                break;
+    }
 
     /* check if decoder is timed out */
     if (is_timed_out()) {
@@ -225,9 +415,14 @@ bool encoder::process()
                    << ", state " << static_cast<int>(curr_state()) << ")";
         dispatch_event(EVENT_TIMEOUT);
         inc("timeouts");
-        if (m_plain_pkt_count == this->symbols())
-            enc_notify();
+        enc_notify();
     }
 
     return false;
 }
+
+template<>
+size_t encoder::storage_size(size_t symbols, size_t symbol_size)
+{
+    return symbols * align_up(symbol_size);
+}
@@ -7,12 +7,13 @@
 #include <netlink/genl/genl.h>
 
 #include <boost/make_shared.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/weak_ptr.hpp>
 
-#include <kodo/rlnc/full_vector_codes.hpp>
-#include <kodo/storage_aware_generator.hpp>
-#include <kodo/shallow_symbol_storage.hpp>
-
+#include "coder_stacks.hpp"
 #include "coder.hpp"
+#include "buffer_pool.hpp"
+#include "aligned_alloc.hpp"
 
 DECLARE_bool(systematic);
 
@@ -21,40 +22,27 @@ DECLARE_bool(systematic);
  */
 template<class Field>
 class full_rlnc_encoder_deep
-    : public
-           // Payload Codec API
-           payload_encoder<
-           // Codec Header API
-           systematic_encoder<
-           symbol_id_encoder<
-           // Symbol ID API
-           plain_symbol_id_writer<
-           // Coefficient Generator API
-           storage_aware_generator<
-           uniform_generator<
-           // Codec API
-           encode_symbol_tracker<
-           zero_symbol_encoder<
-           linear_block_encoder<
-           storage_aware_encoder<
-           // Coefficient Storage API
-           coefficient_info<
-           // Symbol Storage API
-           mutable_shallow_symbol_storage<
-           storage_bytes_used<
-           storage_block_info<
-           // Finite Field API
-           finite_field_math<typename fifi::default_field<Field>::type,
-           finite_field_info<Field,
-           // Factory API
-           final_coder_factory<
-           // Final type
-           full_rlnc_encoder_deep<Field
-               > > > > > > > > > > > > > > > > > >, public coder
+    : public encoder_stack<typename fox_math<Field>::type,
+                           full_rlnc_encoder_deep<Field> >, public coder,
+      public admission_client,
+      public boost::enable_shared_from_this<full_rlnc_encoder_deep<Field> >
 {
     size_t m_enc_pkt_count, m_plain_pkt_count, m_last_req_seq;
+    size_t m_last_req_rank;
+    arrival_meter m_arrivals;
+    double m_arrival_seed;
+    bool m_flushed, m_repaired, m_has_helper;
+    std::atomic<size_t> m_ticket;
+
+    /* reference given to the admission queue, which may start the
+     * generation after the encoder is freed */
+    admission_client::weak_pointer m_self;
     volatile double m_budget, m_max_budget;
     uint8_t *m_symbol_storage;
+    std::vector<packet_buffer> m_buffers;
+
+    /* plain packets of the flow held until the flushed budget is queued */
+    std::vector<std::vector<uint8_t>> m_held;
     uint8_t m_type;
 
     /**
@@ -62,7 +50,10 @@ class full_rlnc_encoder_deep
      * @STATE_INVALID:    inherited state that should never be entered
      * @STATE_WAIT:       inherited (intial) state when waiting for the first event
      * @STATE_DONE:       inherited (final) state to enter when encoding is done
-     * @STATE_SEND_ENC:   sends encoded packets until the generation is acked
+     * @STATE_FULL:       waits for admission of the full or flushed
+     *                    generation
+     * @STATE_SEND_BUDGET: sends the budget of the full or flushed generation
+     * @STATE_WAIT_ACK:   waits for the generation to be acked
      * @STATE_NUM:        counter for the number of states in this class
      */
     enum m_state : state_type {
@@ -78,6 +69,9 @@ class full_rlnc_encoder_deep
     /**
      * enum _event - event that can change the state of this decoder
      * @EVENT_FULL:    generation is ready to be encoded
+     * @EVENT_START:   full generation is admitted
+     * @EVENT_BUDGET_SENT: budget has been sent
+     * @EVENT_FLUSH:   generation is closed before it was full
      * @EVENT_TIMEOUT: generation has timed out
      * @EVENT_ACKED:   generation has been acked by next hop
      * @EVENT_DONE:    generation hs nothing more to do
@@ -89,27 +83,88 @@ class full_rlnc_encoder_deep
         EVENT_BUDGET_SENT,
         EVENT_ACKED,
         EVENT_TIMEOUT,
+        EVENT_FLUSH,
         EVENT_NUM
     };
 
+    /**
+     * enc_wait() - request admission of the full or flushed generation
+     *
+     * Entered when the generation is full or flushed. The state thread
+     * waits for EVENT_START like in any other state, and the event is
+     * dispatched either at once or by the encoder releasing a slot.
+     *
+     * Only full generations block batman-adv, as a flushed generation is
+     * closed because the flow is idle or no longer coded, and blocking
+     * would hold back packets that are not waiting for this encoder.
+     */
     void enc_wait()
     {
-        block_packets(BATADV_HLP_C_BLOCK);
-        semaphore_wait();
+        size_t ticket = admission_ticket();
+
+        if (!m_flushed)
+            block_packets(BATADV_HLP_C_BLOCK);
+
+        m_ticket = ticket;
+
+        if (admission_request(_key, ticket, m_self))
+            admitted(ticket);
+        else
+            inc("admission queued");
+
+        wait();
+    }
+
+    /**
+     * admitted() - start encoding after admission
+     * @param ticket Ticket the generation was admitted with; ignored if
+     *        the generation has since been released.
+     */
+    void admitted(size_t ticket)
+    {
+        if (m_ticket != ticket)
+            return;
+
         dispatch_event(EVENT_START);
         update_timestamp();
     }
 
+    /**
+     * admission_start() - start encoding after waiting for admission
+     * @param ticket Ticket the generation was admitted with.
+     *
+     * Called by the admission queue, which keeps the encoder alive while
+     * it is started.
+     */
+    void admission_start(size_t ticket)
+    {
+        admitted(ticket);
+    }
+
+    /**
+     * enc_notify() - release slot or cancel admission request
+     *
+     * Does nothing if the generation has no ticket, so that it is safe to
+     * call more than once.
+     */
     void enc_notify()
     {
-        block_packets(BATADV_HLP_C_UNBLOCK);
-        semaphore_notify();
+        size_t ticket = m_ticket.exchange(0);
+
+        if (!ticket)
+            return;
+
+        if (!m_flushed)
+            block_packets(BATADV_HLP_C_UNBLOCK);
+        admission_release(_key, ticket);
     }
 
     /**
      * _write_enc_packet() - function encode and write a single packet
+     *
+     * Returns false if the pacer is full; the packet is then not counted.
      */
-    void send_encoded_packet(uint8_t type);
+    bool send_encoded_packet(uint8_t type);
 
     /**
      * _write_enc_packets() - Write encoded packets to batman-adv.
@@ -123,43 +178,113 @@ class full_rlnc_encoder_deep
 
     void block_packets(int block_cmd);
 
+    /**
+     * idle_timed_out() - Return if plain packets have stopped arriving.
+     *
+     * True when no plain packet has arrived for --flush_idle average
+     * inter-arrival times of the generation, or of its flow until enough
+     * packets are measured. Always false for the first packet of a new
+     * flow.
+     */
+    bool idle_timed_out();
+
+    /**
+     * flush_generation() - Close generation at its current size.
+     *
+     * Adds a symbol with FLUSH_MARK as length field after the plain packets,
+     * so that decoders know where the generation ends, and sends a budget
+     * scaled to the rank once admitted like a full generation. Coded
+     * packets sent afterwards carry the rank, so that next hops scale their
+     * budgets too.
+     */
+    void flush_generation();
+
+    /**
+     * get_symbol_buffer() - Return storage for symbol i.
+     *
+     * Symbols are padded to a multiple of FOX_ALIGNMENT, so each of them
+     * starts on an alignment boundary.
+     */
     uint8_t *get_symbol_buffer(size_t i)
     {
-        return m_symbol_storage + i * this->symbol_size();
+        return m_symbol_storage + i * align_up(this->symbol_size());
+    }
+
+    /**
+     * add_symbol() - Register symbol with encoder and update state.
+     * @param buf Symbol buffer with length field and plain data.
+     *
+     * Points the shallow symbol storage to the buffer, so the buffer must
+     * be kept until the generation is done.
+     */
+    void add_symbol(uint8_t *buf);
+
+    /**
+     * release_buffers() - Return pooled buffers to their pool.
+     */
+    void release_buffers()
+    {
+        m_buffers.clear();
+    }
+
+    /**
+     * send_held_packets() - Forward plain packets held for the flow
+     */
+    void send_held_packets()
+    {
+        for (auto &p : m_held)
+            m_io->send_plain(_key, p.data(), p.size());
+
+        m_held.clear();
     }
 
+    /* allowed transitions between states */
+    static constexpr transition s_transitions[] = {
+        {STATE_WAIT, EVENT_FULL, STATE_FULL},
+        {STATE_WAIT, EVENT_TIMEOUT, STATE_DONE},
+        {STATE_WAIT, EVENT_ACKED, STATE_DONE},
+        {STATE_WAIT, EVENT_FLUSH, STATE_FULL},
+        {STATE_FULL, EVENT_START, STATE_SEND_BUDGET},
+        {STATE_FULL, EVENT_ACKED, STATE_DONE},
+        {STATE_FULL, EVENT_TIMEOUT, STATE_DONE},
+        {STATE_SEND_BUDGET, EVENT_BUDGET_SENT, STATE_WAIT_ACK},
+        {STATE_SEND_BUDGET, EVENT_ACKED, STATE_DONE},
+        {STATE_WAIT_ACK, EVENT_ACKED, STATE_DONE},
+        {STATE_WAIT_ACK, EVENT_TIMEOUT, STATE_DONE},
+    };
+
+    static constexpr size_t s_transition_num =
+        sizeof(s_transitions)/sizeof(s_transitions[0]);
+
+    static_assert(valid(s_transitions, s_transition_num, STATE_NUM,
+                        EVENT_NUM), "invalid encoder transitions");
+
+    /* function to call when entering each state */
+    static constexpr handler_func s_handlers[STATE_NUM] = {
+        &states::invalid_state,
+        &states::wait_state,
+        &states::wait_state,
+        &states::call<full_rlnc_encoder_deep,
+                      &full_rlnc_encoder_deep::enc_wait>,
+        &states::call<full_rlnc_encoder_deep,
+                      &full_rlnc_encoder_deep::send_encoded_budget>,
+        &states::wait_state,
+    };
+
+    static constexpr state_table<STATE_NUM, EVENT_NUM> s_table{
+        s_transitions, s_transition_num, s_handlers
+    };
+
   public:
     /**
      * full_rlnc_encoder_deep() - Construct encoder class
      *
-     * Allocates packet buffers and initializes the state machine.
+     * Allocates packet buffers and sets up the state machine.
      */
-    full_rlnc_encoder_deep() : m_symbol_storage(NULL)
+    full_rlnc_encoder_deep()
+        : m_flushed(false), m_repaired(false), m_ticket(0), m_symbol_storage(NULL)
     {
-        handler_func full, enc, ack, cre;
-
-        /* prepare state tables */
-        states::init(m_coder, STATE_NUM, EVENT_NUM);
-
-        /* add states to the state table */
-        full = std::bind(&full_rlnc_encoder_deep::enc_wait, this);
-        enc = std::bind(&full_rlnc_encoder_deep::send_encoded_budget, this);
-        ack = std::bind(&full_rlnc_encoder_deep::wait, this);
-
-        add_state(STATE_FULL, full);
-        add_state(STATE_SEND_BUDGET, enc);
-        add_state(STATE_WAIT_ACK, ack);
-
-        /* add allowed transitions between states */
-        add_trans(STATE_WAIT, EVENT_FULL, STATE_FULL);
-        add_trans(STATE_WAIT, EVENT_TIMEOUT, STATE_DONE);
-        add_trans(STATE_WAIT, EVENT_ACKED, STATE_DONE);
-        add_trans(STATE_FULL, EVENT_START, STATE_SEND_BUDGET);
-        add_trans(STATE_FULL, EVENT_ACKED, STATE_DONE);
-        add_trans(STATE_SEND_BUDGET, EVENT_BUDGET_SENT, STATE_WAIT_ACK);
-        add_trans(STATE_SEND_BUDGET, EVENT_ACKED, STATE_DONE);
-        add_trans(STATE_WAIT_ACK, EVENT_ACKED, STATE_DONE);
-        add_trans(STATE_WAIT_ACK, EVENT_TIMEOUT, STATE_DONE);
+        states::init(m_coder, s_table);
 
         if (!FLAGS_systematic)
             this->set_systematic_off();
@@ -167,8 +292,11 @@ class full_rlnc_encoder_deep
 
     ~full_rlnc_encoder_deep()
     {
+        /* give back slot or leave the admission queue */
+        enc_notify();
+
         if (m_symbol_storage)
-            delete[] m_symbol_storage;
+            aligned_release(m_symbol_storage);
     }
 
     /**
@@ -194,6 +322,17 @@ class full_rlnc_encoder_deep
      */
     void add_plain_packet(const uint8_t *data, const uint16_t len);
 
+    /**
+     * add_plain_packet() - Add pooled uncoded packet to encoder.
+     * @param buf Pooled buffer with plain data and room for length field.
+     *
+     * Writes the length field into the headroom in front of the plain
+     * data and uses the buffer directly as symbol storage. The encoder
+     * owns the buffer until the generation is done, after which it is
+     * returned to the pool.
+     */
+    void add_plain_packet(packet_buffer buf);
+
     /**
      * add_ack_packet() - add aknowledgement packet to encoder
      *
@@ -201,8 +340,36 @@ class full_rlnc_encoder_deep
      */
     void add_ack_packet();
 
+    /**
+     * add_req_packet() - answer repair request from the destination
+     * @param rank Rank of the generation at the destination.
+     * @param seq Sequence number of the request.
+     *
+     * If the path has a helper, the first request is left to the helpers,
+     * and the encoder only answers when the destination requests again
+     * without having gained rank since.
+     */
     void add_req_packet(const uint16_t rank, const uint16_t seq);
 
+    /**
+     * close_generation() - Flush generation if it is partly filled
+     *
+     * Used when the flow stops being coded, so that the plain packets
+     * already added don't wait for --flush_idle or the timeout.
+     */
+    void close_generation();
+
+    /**
+     * hold_plain_packet() - Keep plain packet until the budget is queued
+     * @param data Plain packet forwarded without coding.
+     * @param len Length of the packet.
+     *
+     * Used for the flow after close_generation(), so that plain packets
+     * don't overtake the coded packets of the flushed generation. Returns
+     * false if the packet can be forwarded at once.
+     */
+    bool hold_plain_packet(const uint8_t *data, const uint16_t len);
+
     /**
      * process() - Check encoder status and take necessary actions.
      *
@@ -213,12 +380,42 @@ class full_rlnc_encoder_deep
      */
     bool process();
 
+    /**
+     * release_storage() - return pooled buffers of a freed encoder
+     *
+     * Called by coder_map once no other thread uses the encoder.
+     */
+    void release_storage()
+    {
+        guard g(m_lock);
+
+        release_buffers();
+    }
+
+    /**
+     * eviction_score() - Return how useful it is to keep the encoder
+     *
+     * Used by coder_map to select a coder to free when the memory budget is
+     * exhausted. Coders with the lowest score are freed first, and coders
+     * scoring SIZE_MAX are never freed.
+     */
+    size_t eviction_score()
+    {
+        /* plain packets from the source are lost if an encoder is freed */
+        return curr_state() == STATE_DONE ? 0 : SIZE_MAX;
+    }
+
+    /**
+     * storage_size() - Return bytes of coding buffers used by one encoder
+     */
+    static size_t storage_size(size_t symbols, size_t symbol_size);
+
     /**
      * is_valid() - return if decoder is in a state to accept plain packets
      */
     virtual bool is_valid()
     {
-        return !is_full();
+        return !is_full() && !m_flushed;
     }
 
     /**
@@ -230,6 +427,17 @@ class full_rlnc_encoder_deep
     }
 };
 
+template<class Field>
+constexpr states::transition full_rlnc_encoder_deep<Field>::s_transitions[];
+
+template<class Field>
+constexpr states::handler_func full_rlnc_encoder_deep<Field>::s_handlers[];
+
+template<class Field>
+constexpr states::state_table<full_rlnc_encoder_deep<Field>::STATE_NUM,
+                              full_rlnc_encoder_deep<Field>::EVENT_NUM>
+    full_rlnc_encoder_deep<Field>::s_table;
+
 typedef full_rlnc_encoder_deep<rlnc_field> encoder;
 typedef full_rlnc_encoder_deep<rlnc_field2> encoder2;
 
@@ -0,0 +1,120 @@
+/* Copyright 2013 Martin Hundebøll <martin@hundeboll.net> */
+
+#ifndef FOX_FIELD_MATH_HPP_
+#define FOX_FIELD_MATH_HPP_
+
+#include <string>
+#include <ostream>
+
+#include <fifi/default_field.hpp>
+#include <fifi/full_table.hpp>
+#include <fifi/log_table.hpp>
+#include <fifi/extended_log_table.hpp>
+#include <fifi/simple_online.hpp>
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <cpuid.h>
+#endif
+
+/**
+ * struct fox_math - finite field arithmetic used by all coder stacks
+ * @param Field Finite field to do arithmetic in.
+ *
+ * Defaults to what fifi considers the fastest implementation for the field.
+ * Build with FIELD_MATH=<name> (e.g. log_table) to use another one, which is
+ * useful when the self benchmark reports a faster kernel on the target CPU.
+ */
+template<class Field>
+struct fox_math
+{
+#ifdef FOX_FIELD_MATH
+    typedef fifi::FOX_FIELD_MATH<Field> type;
+#else
+    typedef typename fifi::default_field<Field>::type type;
+#endif
+};
+
+/**
+ * struct math_name - printable name of a field arithmetic implementation
+ */
+template<class Math>
+struct math_name
+{
+    static const char *get() { return "unknown"; }
+};
+
+template<class Field>
+struct math_name<fifi::full_table<Field>>
+{
+    static const char *get() { return "full_table"; }
+};
+
+template<class Field>
+struct math_name<fifi::log_table<Field>>
+{
+    static const char *get() { return "log_table"; }
+};
+
+template<class Field>
+struct math_name<fifi::extended_log_table<Field>>
+{
+    static const char *get() { return "extended_log_table"; }
+};
+
+template<class Field>
+struct math_name<fifi::simple_online<Field>>
+{
+    static const char *get() { return "simple_online"; }
+};
+
+/**
+ * struct cpu_features - vector instruction sets supported by this CPU
+ */
+struct cpu_features
+{
+    bool sse2 = {false};
+    bool ssse3 = {false};
+    bool sse41 = {false};
+    bool avx = {false};
+    bool avx2 = {false};
+
+    /**
+     * detect() - read supported instruction sets with cpuid
+     */
+    static cpu_features detect()
+    {
+        cpu_features f;
+
+#if defined(__i386__) || defined(__x86_64__)
+        unsigned int eax, ebx, ecx, edx;
+
+        if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+            return f;
+
+        f.sse2 = edx & bit_SSE2;
+        f.ssse3 = ecx & bit_SSSE3;
+        f.sse41 = ecx & bit_SSE4_1;
+
+        /* AVX registers are only usable if the OS saves them */
+        f.avx = (ecx & bit_AVX) && (ecx & bit_OSXSAVE);
+
+        if (f.avx && __get_cpuid_max(0, NULL) >= 7) {
+            __cpuid_count(7, 0, eax, ebx, ecx, edx);
+            f.avx2 = ebx & bit_AVX2;
+        }
+#endif
+
+        return f;
+    }
+
+    friend std::ostream &operator<<(std::ostream &out, const cpu_features &f)
+    {
+        out << "sse2=" << f.sse2 << " ssse3=" << f.ssse3
+            << " sse4.1=" << f.sse41 << " avx=" << f.avx
+            << " avx2=" << f.avx2;
+
+        return out;
+    }
+};
+
+#endif
@@ -8,6 +8,7 @@
 #include <thread>
 #include <mutex>
 #include <string>
+#include <sstream>
 
 #include "fox.hpp"
 #include "io.hpp"
@@ -18,14 +19,26 @@
 #include "recoder.hpp"
 #include "helper.hpp"
 #include "counters.hpp"
+#include "field_math.hpp"
+#include "self_benchmark.hpp"
+#include "arena.hpp"
+#include "benchmark.hpp"
+#include "coarse_clock.hpp"
+#include "budgets.hpp"
+#include "bypass.hpp"
 
 
 DEFINE_string(device, "bat0", "Virtual interface from batman-adv");
 DEFINE_int32(generation_size, 64, "The generation size, the number of packets "
                                   "which are coded together.");
 DEFINE_int32(packet_size, 1454, "The payload size without RLNC overhead.");
-DEFINE_double(packet_timeout, .3, "The number of averaged inter-packet "
-                                       "arrival times to wait for more data");
+DEFINE_double(packet_timeout, 4, "The number of averaged inter-packet "
+                                "arrival times to wait for more data");
+DEFINE_double(packet_timeout_min, .005, "Shortest time to wait for more data "
+                                        "before requesting it.");
+DEFINE_double(packet_timeout_max, .3, "Longest time to wait for more data "
+                                      "before requesting it; also used until "
+                                      "the arrival time of a flow is known.");
 DEFINE_double(encoder_timeout, 1, "Time to wait for more packets before "
                                   "dropping encoder generation.");
 DEFINE_double(decoder_timeout, 2, "Time to wait for more packets before "
@@ -36,17 +49,104 @@ DEFINE_double(helper_timeout, 1, "Time to wait for more packets before "
                                  "dropping helper generation.");
 DEFINE_double(fixed_overshoot, 1.06, "Fixed factor to increase "
                                      "encoder/recoder budgets.");
+DEFINE_bool(adaptive_overshoot, true, "Adapt the overshoot factor of each flow "
+                                      "from repair requests and "
+                                      "acknowledgements, starting from "
+                                      "--fixed_overshoot.");
+DEFINE_double(overshoot_min, 1, "Smallest adaptive overshoot factor.");
+DEFINE_double(overshoot_max, 2, "Largest adaptive overshoot factor.");
+DEFINE_double(overshoot_target, .05, "Share of generations allowed to need "
+                                     "repair requests with adaptive "
+                                     "overshoot.");
 DEFINE_int32(encoders, 2, "Number of concurrent encoder.");
+DEFINE_int32(admission_queue, 64, "Number of full generations that can wait "
+             "for admission, and number of flows to keep admission "
+             "statistics of; more generations are admitted at once.");
 DEFINE_int32(e1, 10, "Error probability from source to helper in percentage.");
 DEFINE_int32(e2, 10, "Error probability from helper to dest in percentage.");
 DEFINE_int32(e3, 30, "Error probability from source to dest in percentage.");
+DEFINE_bool(link_estimates, true, "Derive coding budgets from link qualities "
+                                  "reported by batman-adv and corrected by "
+                                  "feedback; otherwise use --e1, --e2, and "
+                                  "--e3.");
 DEFINE_int32(ack_interval, 3, "Number of redundant packets to receive before"
                               "repeating an ACK packet.");
+DEFINE_bool(helper_split, true, "Split the helper budget of a path between "
+                                "its helpers by the quality of the path through each helper.");
 DEFINE_double(helper_threshold, 1.0, "Ratio to multiply with helper"
                                      "threshold.");
 DEFINE_bool(systematic, true, "Use systematic packets when encoding packets");
+DEFINE_double(flush_idle, 0, "Number of averaged inter-packet arrival times "
+                             "without plain packets before a generation is "
+                             "sent before it is full (0 to wait for "
+                             "--encoder_timeout).");
+DEFINE_bool(flush_rank, false, "Append the rank of flushed generations to "
+                               "coded packets, so that next hops don't wait "
+                               "for the mark; all nodes must accept it.");
+DEFINE_bool(bypass, false, "Forward flows without coding while the link to "
+                           "the destination is nearly lossless; needs "
+                           "batman-adv to forward returned plain packets.");
+DEFINE_int32(bypass_enter, 2, "Loss percentage of the link to the destination "
+                              "below which flows are forwarded uncoded.");
+DEFINE_int32(bypass_leave, 5, "Loss percentage of the link to the destination "
+                              "above which uncoded flows are coded again.");
+DEFINE_double(bypass_refresh, 1, "Seconds between link estimate requests for "
+                                 "flows forwarded uncoded.");
 DEFINE_double(encoder_threshold, 0.1, "Threshold ratio to start sending credits");
-DEFINE_bool(benchmark, false, "Disable any coding done by fox to test raw performance.");
+DEFINE_string(benchmark, "", "Benchmark mode: \"reflect\" returns plain packets "
+                             "to batman-adv without coding; \"source\", "
+                             "\"relay\", or \"helper\" run synthetic traffic "
+                             "through the coders over an emulated lossy "
+                             "network without batman-adv.");
+DEFINE_int32(bench_rate, 2000, "Packets per second generated in benchmark "
+                               "mode (0 for no limit).");
+DEFINE_string(bench_sizes, "1400", "Packet sizes generated in benchmark mode "
+                                   "as a list of size[:weight].");
+DEFINE_int32(bench_flows, 1, "Number of flows generated in benchmark mode.");
+DEFINE_double(bench_time, 10, "Seconds to generate packets in benchmark "
+                              "mode.");
+DEFINE_bool(deferred_decoding, true, "Eliminate only coefficients when packets "
+                                     "arrive and postpone payload decoding.");
+DEFINE_bool(self_benchmark, false, "Measure coding throughput of each field "
+                                   "kernel before serving traffic.");
+DEFINE_double(self_benchmark_time, .5, "Seconds to run each kernel in the "
+                                       "self benchmark.");
+DEFINE_bool(arena, true, "Allocate generation buffers from an arena backed "
+                         "by huge pages.");
+DEFINE_int32(rx_buffers, 512, "Number of pooled receive buffers handed to "
+                              "encoders without copying (0 to disable).");
+DEFINE_int32(control_delay, 10, "Milliseconds to collect acknowledgements and "
+                                "requests before sending them in one frame "
+                                "per flow.");
+DEFINE_bool(cumulative_acks, false, "Send acknowledgements in one ACKS frame "
+                                    "per flow every --control_delay ms instead "
+                                    "of single ACK frames; all nodes must "
+                                    "accept ACKS frames.");
+DEFINE_bool(aggregate_requests, false, "Send repair requests in one REQS "
+                                       "frame per flow every --control_delay "
+                                       "ms instead of single REQ frames; all "
+                                       "nodes must accept REQS frames.");
+DEFINE_int32(pace_rate, 0, "Rate in kbit/s to send coded packets at; 0 to "
+                          "derive it from link quality, -1 for no limit.");
+DEFINE_int32(pace_capacity, 20000, "Nominal interface capacity in kbit/s used "
+                                   "to derive the pacing rate.");
+DEFINE_int32(pace_burst, 4, "Number of coded packets that can be sent "
+                            "back-to-back when paced.");
+DEFINE_int32(pace_queue, 1024, "Maximum number of coded packets waiting to "
+                               "be paced.");
+DEFINE_int32(retry_queue, 256, "Maximum number of netlink messages waiting "
+                               "for room in the socket buffer.");
+DEFINE_int32(rx_batch, 32, "Maximum number of netlink datagrams read with "
+                           "one system call.");
+DEFINE_int32(workers, 2, "Number of threads passing received frames to "
+                         "coders (0 to handle them on the netlink thread).");
+DEFINE_int32(work_queue, 256, "Maximum number of received frames waiting for "
+                              "each worker.");
+DEFINE_int32(memory_budget, 64, "Maximum number of megabytes used by coders "
+                                "(0 for no limit).");
+DEFINE_int32(clock_tick, 1, "Milliseconds between updates of the coarse clock "
+                            "used for coder timeouts (0 to read the clock on "
+                            "each use).");
 
 static std::mutex exit_lock;
 static std::atomic<bool> running(true), quit(false);
@@ -60,14 +160,107 @@ encoder_map::pointer enc_map;
 decoder_map::pointer dec_map;
 recoder_map::pointer rec_map;
 helper_map::pointer hlp_map;
+bypass_policy *bypass_flows = NULL;
+
+/**
+ * report_arena() - Export arena occupancy to counters.
+ */
+void report_arena()
+{
+    arena *a = arena::instance();
+    arena::stats s;
+
+    if (!a)
+        return;
+
+    s = a->get_stats();
+    counts->set("arena chunks", s.chunks);
+    counts->set("arena huge chunks", s.huge_chunks);
+    counts->set("arena bytes mapped", s.mapped);
+    counts->set("arena bytes in use", s.in_use);
+    counts->set("arena bytes cached", s.cached);
+}
+
+/**
+ * report_admission() - Export per-flow encoder admission delay to counters.
+ * @param admission Queue limiting the number of concurrent encoders.
+ */
+void report_admission(admission_queue *admission)
+{
+    std::stringstream name;
+
+    counts->set("admission overflows", admission->overflows());
+
+    for (auto &s : admission->get_stats()) {
+        name.str("");
+        key::print_eth(name, s.flow.src);
+        name << " -> ";
+        key::print_eth(name, s.flow.dst);
+
+        counts->set("admission " + name.str() + " queued", s.queued);
+        counts->set("admission " + name.str() + " admitted", s.admitted);
+        counts->set("admission " + name.str() + " avg delay us",
+                    s.admitted ? s.delay_us/s.admitted : 0);
+        counts->set("admission " + name.str() + " max delay us",
+                    s.max_delay_us);
+    }
+}
+
+/**
+ * report_overshoot() - Export per-flow overshoot factors to counters.
+ * @param overshoot Controller adapting the factors.
+ *
+ * Factors are exported in thousandths, as counters are integers.
+ */
+void report_overshoot(overshoot_controller *overshoot)
+{
+    std::stringstream name;
+
+    for (auto &s : overshoot->get_stats()) {
+        name.str("");
+        key::print_eth(name, s.flow.src);
+        name << " -> ";
+        key::print_eth(name, s.flow.dst);
+
+        counts->set("overshoot " + name.str() + " factor permille",
+                    s.factor*1000 + .5);
+        counts->set("overshoot " + name.str() + " repaired", s.repaired);
+        counts->set("overshoot " + name.str() + " acked", s.acked);
+    }
+}
+
+/**
+ * report_bypass() - Export per-flow bypass state to counters.
+ */
+void report_bypass()
+{
+    std::stringstream name;
+
+    if (!bypass_flows)
+        return;
+
+    for (auto &s : bypass_flows->get_stats()) {
+        name.str("");
+        key::print_eth(name, s.flow.src);
+        name << " -> ";
+        key::print_eth(name, s.flow.dst);
+
+        counts->set("bypass " + name.str() + " active", s.bypass);
+        counts->set("bypass " + name.str() + " packets", s.bypassed);
+        counts->set("bypass " + name.str() + " switches", s.switches);
+    }
+}
 
 /**
  * house_keeping_thread() - Visit each coder_map to process coders.
+ * @param admission Queue limiting the number of concurrent encoders.
+ * @param overshoot Controller adapting budget overshoot.
  *
  * Call the process_coders() function in each coder_map to handle timed out
  * coders.
  */
-void house_keeping_thread()
+void house_keeping_thread(admission_queue *admission,
+                          overshoot_controller *overshoot)
 {
     std::chrono::milliseconds interval(50);
 
@@ -77,6 +270,146 @@ void house_keeping_thread()
         dec_map->process_coders();
         rec_map->process_coders();
         hlp_map->process_coders();
+        report_arena();
+        report_admission(admission);
+        report_overshoot(overshoot);
+        report_bypass();
+    }
+}
+
+/**
+ * handle_bypass() - Forward plain packet uncoded if its flow is bypassed.
+ * @param k Key of the flow the packet belongs to.
+ * @param data Plain packet.
+ * @param len Length of the packet.
+ *
+ * Returns true if the packet was forwarded and should not be encoded.
+ */
+bool handle_bypass(const struct key &k, const uint8_t *data,
+                   const uint16_t len)
+{
+    encoder::pointer enc;
+    uint8_t tq;
+    size_t e;
+    bool entered;
+
+    if (!bypass_flows)
+        return false;
+
+    if (bypass_flows->refresh(k))
+        io->read_link(k.dst);
+
+    /* flows to destinations without a link estimate are always coded */
+    tq = io->get_link(k.dst);
+    if (!FLAGS_link_estimates)
+        e = FLAGS_e3*2.55;
+    else
+        e = tq <= 1 ? BUDGET_ONE : BUDGET_ONE - tq;
+
+    if (!bypass_flows->bypass(k, e, entered))
+        return false;
+
+    enc = enc_map->find_latest_coder(k);
+
+    /* send what the flow has in its open generation before going uncoded */
+    if (entered && enc)
+        enc->close_generation();
+
+    /* and don't let plain packets overtake it */
+    if (enc && enc->hold_plain_packet(data, len))
+        return true;
+
+    io->send_plain(k, data, len);
+
+    return true;
+}
+
+/**
+ * handle_ack() - Pass acknowledgement to the coders of the acked block.
+ * @param k Key of the acknowledged block.
+ *
+ * A node is normally either source, relay or helper of a flow, but all
+ * of them exist in the same process when benchmarking.
+ */
+void handle_ack(const struct key &k)
+{
+    encoder::pointer e;
+    recoder::pointer r;
+    helper::pointer h;
+
+    e = enc_map->find_coder(k);
+    if (e)
+        e->add_ack_packet();
+
+    r = rec_map->find_coder(k);
+    if (r)
+        r->add_ack_packet();
+
+    h = hlp_map->find_coder(k);
+    if (h)
+        h->add_ack_packet();
+}
+
+/**
+ * handle_acks() - Pass cumulative acknowledgement to all acked coders.
+ * @param k Key of the first block covered by the bitmap.
+ * @param bitmap Bitmap with a bit set for each acknowledged block.
+ * @param len Length of bitmap in bytes.
+ */
+void handle_acks(const struct key &k, const uint8_t *bitmap,
+                 const uint16_t len)
+{
+    struct key b(k);
+
+    for (size_t i = 0; i < len*8; i++) {
+        if (!(bitmap[i/8] & (1 << (i % 8))))
+            continue;
+
+        b.block = (k.block + i) & 0xFFFF;
+        handle_ack(b);
+    }
+}
+
+/**
+ * handle_request() - Pass request to the coder of the requested block.
+ * @param k Key of the requested block.
+ * @param rank Rank of the block at the requesting decoder.
+ * @param seq Sequence number of the request.
+ */
+void handle_request(const struct key &k, const uint16_t rank,
+                    const uint16_t seq)
+{
+    encoder::pointer e;
+    helper::pointer h;
+
+    e = enc_map->find_coder(k);
+    if (e) {
+        e->add_req_packet(rank, seq);
+        return;
+    }
+
+    h = hlp_map->find_coder(k);
+    if (h)
+        h->add_req_packet(rank, seq);
+}
+
+/**
+ * handle_requests() - Pass aggregated requests to the requested coders.
+ * @param k Key of the flow the requests belong to.
+ * @param data Array of request entries.
+ * @param len Length of data in bytes.
+ */
+void handle_requests(const struct key &k, const uint8_t *data,
+                     const uint16_t len)
+{
+    const struct req_entry *reqs;
+    struct key b(k);
+
+    reqs = reinterpret_cast<const struct req_entry *>(data);
+
+    for (size_t i = 0; i < len/sizeof(*reqs); i++) {
+        b.block = ntohs(reqs[i].block);
+        handle_request(b, ntohs(reqs[i].rank), ntohs(reqs[i].seq));
     }
 }
 
@@ -98,6 +431,9 @@ bool handle_packet(const uint8_t type, const struct key &k, const uint8_t *data,
 
     switch (type) {
         case PLAIN_PACKET:
+            if (handle_bypass(k, data, len))
+                break;
+
             e = enc_map->get_latest_coder(k);
             if (!e)
                 break;
@@ -126,37 +462,19 @@ bool handle_packet(const uint8_t type, const struct key &k, const uint8_t *data,
             break;
 
         case ACK_PACKET:
-            e = enc_map->find_coder(k);
-            if (e) {
-                e->add_ack_packet();
-                break;
-            }
-
-            r = rec_map->find_coder(k);
-            if (r) {
-                r->add_ack_packet();
-                break;
-            }
+            handle_ack(k);
+            break;
 
-            h = hlp_map->find_coder(k);
-            if (h) {
-                h->add_ack_packet();
-                break;
-            }
+        case ACKS_PACKET:
+            handle_acks(k, data, len);
             break;
 
         case REQ_PACKET:
-            e = enc_map->find_coder(k);
-            if (e) {
-                e->add_req_packet(rank, seq);
-                break;
-            }
+            handle_request(k, rank, seq);
+            break;
 
-            h = hlp_map->find_coder(k);
-            if (h) {
-                h->add_req_packet(rank, seq);
-                break;
-            }
+        case REQS_PACKET:
+            handle_requests(k, data, len);
             break;
 
         default:
@@ -167,6 +485,30 @@ bool handle_packet(const uint8_t type, const struct key &k, const uint8_t *data,
     return true;
 }
 
+/**
+ * handle_plain_buffer() - Pass pooled plain packet to encoder.
+ * @param k Key of the flow the packet belongs to.
+ * @param buf Pooled buffer with plain packet; ownership moves to encoder.
+ *
+ * Like handle_packet() for PLAIN_PACKET, but lets the encoder keep the
+ * receive buffer as symbol storage instead of copying the packet.
+ */
+bool handle_plain_buffer(const struct key &k, packet_buffer buf)
+{
+    encoder::pointer e;
+
+    if (handle_bypass(k, buf.data(), buf.len()))
+        return true;
+
+    e = enc_map->get_latest_coder(k);
+    if (!e)
+        return true;
+
+    e->add_plain_packet(std::move(buf));
+
+    return true;
+}
+
 /**
  * sigint() - handle SIGINT signal by telling threads to quit
  */
@@ -213,51 +555,125 @@ int main(int argc, char **argv)
     signal(SIGTERM, sigint);
     signal(SIGQUIT, sigquit);
 
+    benchmark::pointer bench;
     uint32_t symbols = FLAGS_generation_size;
     uint32_t symbol_size = FLAGS_packet_size;
+    uint32_t trailer = FLAGS_flush_rank ? FLUSH_RANK_SIZE : 0;
+    uint32_t frame_size = symbols + symbol_size + trailer;
 
-    LOG_IF(FATAL, (symbols + symbol_size) > RLNC_MAX_PAYLOAD)
-        << "Payload size exceeds MTU: " << (symbols + symbol_size) << " > "
+    LOG_IF(FATAL, frame_size > RLNC_MAX_PAYLOAD)
+        << "Payload size exceeds MTU: " << frame_size << " > "
         << RLNC_MAX_PAYLOAD << std::endl << "Try with " << argv[0]
-        << " --packet_size=" << (RLNC_MAX_PAYLOAD - symbols) << std::endl;
+        << " --packet_size="
+        << (RLNC_MAX_PAYLOAD - symbols - trailer) << std::endl;
+
+    LOG_IF(FATAL, FLAGS_overshoot_target <= 0 || FLAGS_overshoot_target >= 1)
+        << "Overshoot target must be between 0 and 1";
 
     srand(static_cast<uint32_t>(time(0)));
 
+    /* coders read time from here on */
+    if (FLAGS_clock_tick > 0)
+        coarse_clock::start(FLAGS_clock_tick);
+
+    /* generation buffers are allocated from here on */
+    if (FLAGS_arena)
+        arena::enable();
+
+    /* create counter object before anything reports to it */
+    counts = counters::pointer(new counters());
+
+    /* report field arithmetic and the vector instructions available to it */
+    cpu_features cpu(cpu_features::detect());
+    std::string kernel(math_name<fox_math<rlnc_field>::type>::get());
+    LOG(INFO) << "Field kernel: " << kernel << " (" << cpu << ")";
+    counts->set("fox field kernel " + kernel, 1);
+    counts->set("fox cpu ssse3", cpu.ssse3);
+    counts->set("fox cpu avx2", cpu.avx2);
+
+    if (FLAGS_self_benchmark) {
+        std::string best(self_benchmark(symbols, symbol_size, counts));
+
+        LOG_IF(WARNING, best != kernel) << "Self benchmark: " << best
+                                        << " is faster than " << kernel
+                                        << "; rebuild with FIELD_MATH="
+                                        << best;
+    }
+
     /* create io object depending on whether one or two files should be used */
     io = io::pointer(new class io());
+    io->set_counts(counts);
+
+    /* replace batman-adv with an emulated network */
+    if (benchmark::enabled(FLAGS_benchmark)) {
+        bench = benchmark::pointer(new benchmark(FLAGS_benchmark));
+        bench->set_counts(counts);
+        bench->set_io(io);
+        io->set_loopback(std::bind(&benchmark::air_send, bench,
+                                   std::placeholders::_1));
+    }
+
     CHECK(io->open()) << "Failed to open IO";
 
-    /* create counter and map objects */
-    semaphore enc_sem(FLAGS_encoders);
-    counts = counters::pointer(new counters());
+    /* create map objects */
+    admission_queue enc_admission(FLAGS_encoders, FLAGS_admission_queue);
+    arrival_estimator enc_arrival, dec_arrival;
+    overshoot_controller overshoot(FLAGS_overshoot_min, FLAGS_overshoot_max,
+                                   FLAGS_overshoot_target);
+    bypass_policy bypass(FLAGS_bypass_enter*2.55, FLAGS_bypass_leave*2.55,
+                         FLAGS_bypass_refresh);
+    memory_budget mem_budget(static_cast<size_t>(FLAGS_memory_budget) << 20);
     enc_map = encoder_map::pointer(new encoder_map(symbols, symbol_size));
     dec_map = decoder_map::pointer(new decoder_map(symbols, symbol_size));
     rec_map = recoder_map::pointer(new recoder_map(symbols, symbol_size));
     hlp_map = helper_map::pointer(new helper_map(symbols, symbol_size));
 
     /* fabricate objects */
-    io->set_counts(counts);
-
-    enc_map->set_semaphore(&enc_sem);
+    enc_map->set_admission(&enc_admission);
+    enc_map->set_arrival(&enc_arrival);
+    enc_map->set_memory_budget(&mem_budget);
     enc_map->set_counts(counts);
     enc_map->set_io(io);
 
+    dec_map->set_arrival(&dec_arrival);
+    dec_map->set_memory_budget(&mem_budget);
     dec_map->set_counts(counts);
     dec_map->set_io(io);
 
+    rec_map->set_memory_budget(&mem_budget);
     rec_map->set_counts(counts);
     rec_map->set_io(io);
 
+    hlp_map->set_memory_budget(&mem_budget);
     hlp_map->set_counts(counts);
     hlp_map->set_io(io);
 
+    if (FLAGS_bypass)
+        bypass_flows = &bypass;
+
+    /* decoders keep the fixed factor for their acknowledgements */
+    if (FLAGS_adaptive_overshoot) {
+        enc_map->set_overshoot(&overshoot);
+        rec_map->set_overshoot(&overshoot);
+        hlp_map->set_overshoot(&overshoot);
+    }
+
     /* start house keeping thread and start reading packets */
-    std::thread house_keeping(house_keeping_thread);
+    std::thread house_keeping(house_keeping_thread, &enc_admission,
+                              &overshoot);
+
+    if (bench) {
+        bench->run(running);
+        bench->stop();
+        running = false;
+    }
 
     /* wait for thread to finish */
     house_keeping.join();
+    bypass_flows = NULL;
     counts->print();
     io.reset();
+    coarse_clock::stop();
 
     muntrace();
 
@@ -27,7 +27,10 @@ typedef std::lock_guard<std::mutex> guard;
 #define ETH_ALEN 6
 #define RLNC_MAX_PAYLOAD (1550 - 18 - 14)
 
+class packet_buffer;
+
 bool handle_packet(const uint8_t type, const struct key &k, const uint8_t *data,
                    const uint16_t len, const uint16_t rank, const uint16_t seq);
+bool handle_plain_buffer(const struct key &k, packet_buffer buf);
 
 #endif
@@ -0,0 +1,41 @@
+/* Copyright 2013 Martin Hundebøll <martin@hundeboll.net> */
+
+#ifndef FOX_FUTEX_HPP_
+#define FOX_FUTEX_HPP_
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stdint.h>
+#include <atomic>
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t),
+              "atomic words must be usable as futex words");
+
+/**
+ * futex_wait() - sleep while a word has the expected value
+ * @param word Word to wait on.
+ * @param val Value the word must have for the caller to sleep.
+ *
+ * Returns immediately if the word has changed, and may return spuriously,
+ * so callers must check their condition again.
+ */
+static inline void futex_wait(std::atomic<uint32_t> *word, uint32_t val)
+{
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAIT_PRIVATE,
+            val, NULL, NULL, 0);
+}
+
+/**
+ * futex_wake() - wake threads sleeping on a word
+ * @param word Word the threads wait on.
+ * @param n Maximum number of threads to wake.
+ */
+static inline void futex_wake(std::atomic<uint32_t> *word, int n = INT_MAX)
+{
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAKE_PRIVATE,
+            n, NULL, NULL, 0);
+}
+
+#endif
@@ -3,16 +3,19 @@
 #include "helper.hpp"
 
 DECLARE_double(helper_timeout);
+DECLARE_bool(deferred_decoding);
 DECLARE_int32(e1);
 DECLARE_int32(e2);
 DECLARE_int32(e3);
 
 template<>
-void helper::send_hlp_packet()
+bool helper::send_hlp_packet()
 {
     struct nl_msg *msg;
+    bool sent;
     struct nlattr *attr;
     uint8_t *data;
+    size_t size = this->payload_size();
 
     msg = nlmsg_alloc();
     genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, m_io->genl_family(),
@@ -23,16 +26,25 @@ void helper::send_hlp_packet()
     nla_put(msg, BATADV_HLP_A_DST, ETH_ALEN, _key.dst);
     nla_put_u16(msg, BATADV_HLP_A_BLOCK, _key.block);
     nla_put_u8(msg, BATADV_HLP_A_TYPE, HLP_PACKET);
-    attr = nla_reserve(msg, BATADV_HLP_A_FRAME, this->payload_size());
+    attr = nla_reserve(msg, BATADV_HLP_A_FRAME, size + flush_rank_size());
     data = reinterpret_cast<uint8_t *>(nla_data(attr));
 
+    /* recoding needs all received payloads to be decoded */
+    this->flush();
     this->recode(data);
-    m_io->send_msg(msg);
+    if (flush_rank_size())
+        put_flush_rank(data + size, m_flush_rank);
+    sent = m_io->send_paced(_key, msg);
     nlmsg_free(msg);
 
+    if (!sent)
+        return false;
+
     m_hlp_pkt_count++;
     inc("helper packets");
     VLOG(LOG_PKT) << "Helper " << m_coder << ": Sent helper packet";
+
+    return true;
 }
 
 template<>
@@ -40,7 +52,8 @@ void helper::send_hlp_credits()
 {
     m_budget += m_credit;
 
-    if (m_budget <= 0)
+    /* keep credits for later if io can't keep up */
+    if (m_budget <= 0 || m_io->congested())
         return;
 
     VLOG_IF(LOG_GEN, m_hlp_pkt_count == 0) << "Helper " << m_coder
@@ -48,13 +61,28 @@ void helper::send_hlp_credits()
                                            << " helper packets ";
 
     for (; m_budget >= 1 && m_hlp_pkt_count <= m_max_budget; m_budget--)
-        send_hlp_packet();
+        if (!send_hlp_packet())
+            break;
 
     if (m_hlp_pkt_count >= m_max_budget)
         VLOG(LOG_GEN) << "Helper " << m_coder << ": Sent "
                       << m_hlp_pkt_count << " packets";
 }
 
+template<>
+void helper::send_req_credits()
+{
+    /* keep credits for process() if io can't keep up */
+    if (m_io->congested()) {
+        inc("credits postponed");
+        return;
+    }
+
+    for (; m_budget >= 1 && m_hlp_pkt_count < m_max_budget; m_budget--)
+        if (!send_hlp_packet())
+            break;
+}
+
 template<>
 void helper::init()
 {
@@ -63,27 +91,26 @@ void helper::init()
     set_group("helper");
     set_state(STATE_WAIT);
     init_timeout(FLAGS_helper_timeout);
+    this->set_deferred(FLAGS_deferred_decoding);
 
     /* reset counters */
     m_hlp_pkt_count = 0;
     m_enc_pkt_count = 0;
     m_budget = 0;
+    m_last_req_seq = 0;
+    m_flush_rank = 0;
 
     /* get link values */
     m_io->read_helpers(_key);
     m_io->read_links(_key);
-    /*
-    e1 = ONE - m_io->get_link(_key.src);
-    e2 = ONE - m_io->get_link(_key.dst);
-    e3 = ONE - m_io->get_zero_helper(_key);
-    */
-    e1 = FLAGS_e1*2.55;
-    e2 = FLAGS_e2*2.55;
-    e3 = FLAGS_e3*2.55;
+    e1 = link_error(m_io->get_link(_key.src), FLAGS_e1*2.55);
+    e2 = link_error(m_io->get_link(_key.dst), FLAGS_e2*2.55);
+    e3 = link_error(m_io->get_zero_helper(_key), FLAGS_e3*2.55);
+    m_share = FLAGS_helper_split ? m_io->get_helper_share(_key) : 1;
 
     m_max_budget = max_budget();
     m_threshold = get_threshold();
-    m_credit = credit();
+    m_credit = credit()*m_share;
 
     VLOG(LOG_GEN) << "Helper " << m_coder << ": Initialized "
                   << _key << std::endl
@@ -91,7 +118,8 @@ void helper::init()
                   << ", e2: " << static_cast<int>(e2)
                   << ", e3: " << static_cast<int>(e3) << std::endl
                   << " threshold: " << m_threshold << std::endl
-                  << " credit: " << credit() << std::endl
+                  << " credit: " << m_credit << std::endl
+                  << " share: " << m_share << std::endl
                   << " budget: " << m_max_budget;
 }
 
@@ -99,6 +127,7 @@ template<>
 void helper::add_enc_packet(const uint8_t *data, const uint16_t len)
 {
     size_t rank;
+    size_t size = this->payload_size();
 
     guard g(m_lock);
 
@@ -106,14 +135,13 @@ void helper::add_enc_packet(const uint8_t *data, const uint16_t len)
     if (curr_state() == STATE_DONE)
         return;
 
-    CHECK_EQ(len, this->payload_size()) << "Helper " << m_coder
-                                        << ": Encoded data has wrong length:"
-                                        << len << " != "
-                                        << this->payload_size();
+    if (!coded_length_valid(len, size))
+        return;
 
     /* add packet to recoder */
     rank = this->rank();
     this->decode(const_cast<uint8_t *>(data));
+    set_flush_rank(frame_flush_rank(data, len, size));
     update_timestamp();
     m_enc_pkt_count++;
     inc("encoded received");
@@ -132,6 +160,7 @@ void helper::add_enc_packet(const uint8_t *data, const uint16_t len)
 template<>
 void helper::add_ack_packet()
 {
+    m_io->cancel_paced(_key);
     dispatch_event(EVENT_ACKED);
     inc("acks received");
     VLOG(LOG_CTRL) << "Helper " << m_coder << ": Acked after sending "
@@ -141,7 +170,38 @@ void helper::add_ack_packet()
 template<>
 void helper::add_req_packet(const uint16_t rank, const uint16_t seq)
 {
+    size_t deficit;
+    double credits;
+
+    guard g(m_lock);
+
+    if (curr_state() == STATE_DONE || m_last_req_seq == seq)
+        return;
+
+    m_last_req_seq = seq;
 
+    /* leave the request to the source if we can't help */
+    if (this->rank() <= rank) {
+        inc("requests ignored");
+        return;
+    }
+
+    /* packets reach the destination over e2, and other helpers of the
+     * path answer their share of the deficit */
+    deficit = this->rank() - rank;
+    credits = source_budget(deficit, ONE - 1, ONE - 1, e2)*m_share;
+    m_budget += credits;
+
+    if (m_hlp_pkt_count >= m_max_budget)
+        m_max_budget = m_hlp_pkt_count + credits;
+
+    update_timestamp();
+    inc("request packets added");
+    VLOG(LOG_CTRL) << "Helper " << m_coder << ": Request (rank " << rank
+                   << ", deficit " << deficit << ", credits " << credits
+                   << ")";
+
+    send_req_credits();
 }
 
 template<>
@@ -157,7 +217,23 @@ bool helper::process()
                       << this->rank() << ")";
         inc("timeouts");
         dispatch_event(EVENT_TIMEOUT);
+        return false;
+    }
+
+    /* send credits postponed by congestion */
+    if (m_budget >= 1) {
+        guard g(m_lock);
+        send_req_credits();
     }
 
     return false;
 }
+
+template<>
+size_t helper::storage_size(size_t symbols, size_t symbol_size)
+{
+    /* symbols and coefficients, and the same again while staged */
+    size_t size = symbols * (align_up(symbol_size) + align_up(symbols));
+
+    return FLAGS_deferred_decoding ? 2 * size : size;
+}
@@ -9,9 +9,11 @@
 
 #include "coder.hpp"
 #include "systematic_decoder.hpp"
+#include "deferred_decoder.hpp"
+#include "aligned_storage.hpp"
 
 DECLARE_double(helper_threshold);
-DECLARE_double(fixed_overshoot);
+DECLARE_bool(helper_split);
 
 /**
  * class helper - recoder class to assist one-hop links
@@ -29,41 +31,49 @@ class full_rlnc_helper_deep
              // Symbol ID API
              plain_symbol_id_reader<
              // Codec API
+             deferred_decoder<
              aligned_coefficients_decoder<
              linear_block_decoder<
              // Coefficient Storage API
-             coefficient_storage<
+             aligned_coefficient_storage<
              coefficient_info<
              // Storage API
-             deep_symbol_storage<
+             aligned_symbol_storage<
+             mutable_shallow_symbol_storage<
              storage_bytes_used<
              storage_block_info<
              // Finite Field API
-             finite_field_math<typename fifi::default_field<Field>::type,
+             finite_field_math<typename fox_math<Field>::type,
              finite_field_info<Field,
              // Factory API
              final_coder_factory_pool<
              // Final type
              full_rlnc_helper_deep<Field>
-                 > > > > > > > > > > > > > > > >, public coder
+                 > > > > > > > > > > > > > > > > > >, public coder
 {
     std::atomic<size_t> m_hlp_pkt_count, m_enc_pkt_count;
     ssize_t m_max_budget, m_threshold;
-    double m_budget, m_credit;
+    double m_budget, m_credit, m_share;
+    uint16_t m_last_req_seq;
     uint8_t e1, e2, e3;
 
+    /* rank of a flushed generation as carried by coded packets; zero while
+     * the generation is open */
+    size_t m_flush_rank;
+
     /**
      * enum _state - states that this helper can reside in
      * @STATE_INVALID:    inherited state that should never be entered
      * @STATE_WAIT:       inherited (intial) state when waiting for the first event
      * @STATE_DONE:       inherited (final) state to enter when encoding is done
-     * @STATE_SEND_HLP:   sends encoded packets until the generation is acked
+     * @STATE_SENT:       budget is sent; kept to answer repair requests
      * @STATE_NUM:        counter for the number of states in this class
      */
     enum m_state : state_type {
         STATE_INVALID = __STATE_INVALID,
         STATE_WAIT = __STATE_WAIT,
         STATE_DONE = __STATE_DONE,
+        STATE_SENT,
         STATE_NUM
     };
 
@@ -85,9 +95,10 @@ class full_rlnc_helper_deep
      * _write_hlp_packet() - Write one recoded packet to batman-adv.
      *
      * Reads one recoded packet from the recoder and writes it to
-     * batman-adv.
+     * batman-adv. Returns false if the pacer is full; the packet is then
+     * not counted.
      */
-    void send_hlp_packet();
+    bool send_hlp_packet();
 
     /**
      * _write_hlp_packets() - Write recoded packets to assist a link.
@@ -97,10 +108,40 @@ class full_rlnc_helper_deep
      */
     void send_hlp_credits();
 
-    size_t max_budget()
+    /**
+     * send_req_credits() - send credits added by repair requests
+     *
+     * Credits are kept while io is congested, and sent by process().
+     */
+    void send_req_credits();
+
+    /**
+     * generation_rank() - Return rank needed to decode the generation
+     */
+    size_t generation_rank()
     {
-        size_t nom, denom, g, r;
+        return m_flush_rank ? m_flush_rank : this->symbols();
+    }
+
+    /**
+     * set_flush_rank() - Scale budget to the rank of a flushed generation
+     * @param rank Rank carried by a coded packet; zero if not flushed.
+     */
+    void set_flush_rank(size_t rank)
+    {
+        if (!rank || rank == m_flush_rank)
+            return;
+
+        m_flush_rank = rank;
+        m_max_budget = max_budget();
+        m_threshold = get_threshold();
+        VLOG(LOG_GEN) << "Helper " << m_coder << ": Flushed (rank " << rank
+                      << ", threshold " << m_threshold << ", budget "
+                      << m_max_budget << ")";
+    }
 
+    size_t max_budget()
+    {
         if (e1 == ONE - 1 || e2 == ONE - 1 || e3 == ONE - 1) {
             std::string e;
 
@@ -116,15 +157,11 @@ class full_rlnc_helper_deep
             VLOG(LOG_GEN) << "Helper " << m_coder
                           << ": Missing link estimate (" << e << ")";
 
-            return this->symbols() / 2;
+            return generation_rank() / 2;
         }
 
-        g = this->symbols();
-        r = r_val(g, e1, e2, e3);
-        nom = e3*r - r*ONE + g*ONE;
-        denom = 2*ONE - e3 - e2;
-
-        return FLAGS_fixed_overshoot*nom/denom + (nom % denom != 0);
+        return budgets(generation_rank(), e1, e2, e3).helper(
+                overshoot_factor(_key)*m_share);
     }
 
     void update_budget()
@@ -134,15 +171,11 @@ class full_rlnc_helper_deep
 
     size_t get_threshold()
     {
-        size_t g, r;
-
         if (e1 == ONE - 1 || e2 == ONE - 1 || e3 == ONE - 1)
-            return this->symbols() / 2;
+            return generation_rank() / 2;
 
-        g = this->symbols();
-        r = r_val(g, e1, e2, e3);
-
-        return (r - r*e1/ONE)*FLAGS_helper_threshold;
+        return budgets(generation_rank(), e1, e2, e3).threshold*
+               FLAGS_helper_threshold;
     }
 
     double credit()
@@ -153,23 +186,45 @@ class full_rlnc_helper_deep
         return static_cast<double>(ONE)/(ONE - e1);
     }
 
+    /* allowed transitions between states */
+    static constexpr transition s_transitions[] = {
+        {STATE_WAIT, EVENT_TIMEOUT, STATE_DONE},
+        {STATE_WAIT, EVENT_ACKED, STATE_DONE},
+        {STATE_WAIT, EVENT_BUDGET_SENT, STATE_SENT},
+        {STATE_SENT, EVENT_TIMEOUT, STATE_DONE},
+        {STATE_SENT, EVENT_ACKED, STATE_DONE},
+        {STATE_SENT, EVENT_BUDGET_SENT, STATE_SENT},
+        {STATE_DONE, EVENT_ACKED, STATE_DONE},
+        {STATE_DONE, EVENT_BUDGET_SENT, STATE_DONE},
+    };
+
+    static constexpr size_t s_transition_num =
+        sizeof(s_transitions)/sizeof(s_transitions[0]);
+
+    static_assert(valid(s_transitions, s_transition_num, STATE_NUM,
+                        EVENT_NUM), "invalid helper transitions");
+
+    /* function to call when entering each state */
+    static constexpr handler_func s_handlers[STATE_NUM] = {
+        &states::invalid_state,
+        &states::wait_state,
+        &states::wait_state,
+        &states::wait_state,
+    };
+
+    static constexpr state_table<STATE_NUM, EVENT_NUM> s_table{
+        s_transitions, s_transition_num, s_handlers
+    };
+
   public:
     /**
      * full_rlnc_helper_deep() - Construct a helper object
      *
-     * Allocates packet buffers and initializes the state machine.
+     * Allocates packet buffers and sets up the state machine.
      */
     full_rlnc_helper_deep()
     {
-        /* prepare state tables */
-        states::init(m_coder, STATE_NUM, EVENT_NUM);
-
-        /* add allowed transitions to the state table */
-        add_trans(STATE_WAIT, EVENT_TIMEOUT, STATE_DONE);
-        add_trans(STATE_WAIT, EVENT_ACKED, STATE_DONE);
-        add_trans(STATE_WAIT, EVENT_BUDGET_SENT, STATE_DONE);
-        add_trans(STATE_DONE, EVENT_ACKED, STATE_DONE);
-        add_trans(STATE_DONE, EVENT_BUDGET_SENT, STATE_DONE);
+        states::init(m_coder, s_table);
     }
 
     /**
@@ -200,6 +255,14 @@ class full_rlnc_helper_deep
      */
     void add_ack_packet();
 
+    /**
+     * add_req_packet() - answer repair request from the destination
+     * @param rank Rank of the generation at the destination.
+     * @param seq Sequence number of the request.
+     *
+     * Sends recoded packets to cover the rank deficit of the destination,
+     * if the helper knows more than the destination does.
+     */
     void add_req_packet(const uint16_t rank, const uint16_t seq);
 
     /**
@@ -210,8 +273,60 @@ class full_rlnc_helper_deep
      * Returns true if the decoder is not needed anymore; false otherwise.
      */
     bool process();
+
+    /**
+     * release_storage() - free coding buffers of a freed helper
+     *
+     * Called by coder_map once no other thread uses the helper, so that
+     * pooled objects don't keep their buffers.
+     */
+    void release_storage()
+    {
+        guard g(m_lock);
+
+        this->release_staging();
+        this->release_coefficients();
+        this->release_symbols();
+    }
+
+    /**
+     * eviction_score() - Return how useful it is to keep the helper
+     *
+     * Used by coder_map to select a coder to free when the memory budget is
+     * exhausted. Coders with the lowest score are freed first, and coders
+     * scoring SIZE_MAX are never freed.
+     */
+    size_t eviction_score()
+    {
+        switch (curr_state()) {
+            case STATE_DONE:
+                return 0;
+            case STATE_WAIT:
+                return this->rank() + (is_stale() ? 0 : this->symbols());
+            case STATE_SENT:
+                return is_stale() ? 0 : this->rank();
+            default:
+                return SIZE_MAX;
+        }
+    }
+
+    /**
+     * storage_size() - Return bytes of coding buffers used by one helper
+     */
+    static size_t storage_size(size_t symbols, size_t symbol_size);
 };
 
+template<class Field>
+constexpr states::transition full_rlnc_helper_deep<Field>::s_transitions[];
+
+template<class Field>
+constexpr states::handler_func full_rlnc_helper_deep<Field>::s_handlers[];
+
+template<class Field>
+constexpr states::state_table<full_rlnc_helper_deep<Field>::STATE_NUM,
+                              full_rlnc_helper_deep<Field>::EVENT_NUM>
+    full_rlnc_helper_deep<Field>::s_table;
+
 typedef full_rlnc_helper_deep<rlnc_field> helper;
 
 #endif
@@ -1,6 +1,10 @@
 /* Copyright 2013 Martin Hundebøll <martin@hundeboll.net> */
 
+#include <sys/socket.h>
+#include <errno.h>
+#include <stdio.h>
 #include <string>
+#include <fstream>
 
 #include "io.hpp"
 
@@ -9,7 +13,63 @@ DECLARE_int32(encoders);
 DECLARE_int32(e1);
 DECLARE_int32(e2);
 DECLARE_int32(e3);
-DECLARE_bool(benchmark);
+DECLARE_string(benchmark);
+DECLARE_int32(packet_size);
+DECLARE_int32(rx_buffers);
+DECLARE_int32(control_delay);
+DECLARE_int32(generation_size);
+DECLARE_int32(pace_rate);
+DECLARE_int32(pace_capacity);
+DECLARE_int32(pace_burst);
+DECLARE_int32(pace_queue);
+DECLARE_int32(retry_queue);
+DECLARE_int32(rx_batch);
+DECLARE_int32(workers);
+DECLARE_int32(work_queue);
+
+void io::ctrl_thread(class io *i)
+{
+    std::chrono::milliseconds interval(FLAGS_control_delay);
+
+    while (i->m_running) {
+        std::this_thread::sleep_for(interval);
+        i->retry_messages();
+        i->send_acks();
+        i->send_requests();
+        i->gauge("work queue depth", i->m_work.depth());
+        i->gauge("pacer rate", i->m_pacer.rate());
+        i->gauge("pacer queued", i->m_pacer.queued());
+        i->gauge("pacer sent", i->m_pacer.sent());
+        i->gauge("pacer cancelled", i->m_pacer.cancelled());
+    }
+}
+
+void io::update_pace_rate()
+{
+    size_t burst = FLAGS_pace_burst*(FLAGS_packet_size + FLAGS_generation_size +
+                                     FLUSH_RANK_SIZE);
+    double rate, tq;
+
+    if (FLAGS_pace_rate < 0) {
+        m_pacer.set_rate(0, burst);
+        return;
+    }
+
+    if (FLAGS_pace_rate > 0) {
+        m_pacer.set_rate(FLAGS_pace_rate*1000/8.0, burst);
+        return;
+    }
+
+    /* scale nominal capacity by the average quality of known links, as
+     * lossy links need more transmissions on the air per packet */
+    tq = m_links.average();
+
+    rate = FLAGS_pace_capacity*1000/8.0;
+    if (tq > 0)
+        rate *= tq/255;
+
+    m_pacer.set_rate(rate, burst);
+}
 
 bool io::open_netlink()
 {
@@ -72,10 +132,71 @@ bool io::register_netlink()
     return true;
 }
 
+bool io::read_address()
+{
+    std::string path("/sys/class/net/" + FLAGS_device + "/address");
+    std::ifstream f(path);
+    std::string line;
+    unsigned int a[ETH_ALEN];
+
+    if (!std::getline(f, line))
+        return false;
+
+    if (sscanf(line.c_str(), "%x:%x:%x:%x:%x:%x",
+               &a[0], &a[1], &a[2], &a[3], &a[4], &a[5]) != ETH_ALEN)
+        return false;
+
+    for (size_t i = 0; i < ETH_ALEN; i++)
+        m_addr[i] = a[i];
+
+    return true;
+}
+
 bool io::open()
 {
-    CHECK(open_netlink()) << "IO: Failed to open netlink";
-    CHECK(register_netlink()) << "IO: Failed to register netlink";
+    /* buffers hold a full frame message, so that the frame can be used as
+     * coder symbol with its length field placed in front of the data, and
+     * coded frames carry a coefficient per symbol and maybe the flush rank */
+    m_buffers.init(FLAGS_rx_buffers + FLAGS_rx_batch +
+                   FLAGS_workers*FLAGS_work_queue,
+                   FLAGS_packet_size + FLAGS_generation_size +
+                   FLUSH_RANK_SIZE + NL_RX_HEADROOM,
+                   NL_RX_HEADROOM);
+
+    m_rx.resize(FLAGS_rx_batch);
+    m_rx_hdrs.resize(FLAGS_rx_batch);
+    m_rx_iov.resize(FLAGS_rx_batch);
+
+    for (auto &s : m_rx)
+        s.scratch.reset(aligned_allocate(m_buffers.size()));
+
+    /* coded packets carry a coefficient per symbol after the payload */
+    m_pacer.start([this](struct nl_msg *msg) { send_msg(msg); },
+                  FLAGS_pace_queue,
+                  FLAGS_packet_size + FLAGS_generation_size + FLUSH_RANK_SIZE);
+    update_pace_rate();
+
+    /* frames are handled by workers, so that the netlink thread only has
+     * to drain the socket */
+    if (FLAGS_workers > 0)
+        m_work.start(FLAGS_workers, FLAGS_work_queue,
+                     [this](rx_work &w) { handle_work(w); });
+
+    /* answer plain packets directly instead of encoding them */
+    m_reflect = FLAGS_benchmark == "reflect";
+
+    /* helpers find their own share of a path budget by address */
+    m_has_addr = read_address();
+    LOG_IF(WARNING, !m_has_addr && !m_loopback)
+        << "IO: Failed to read address of " << FLAGS_device
+        << "; helpers send full budgets";
+
+    if (!m_loopback) {
+        CHECK(open_netlink()) << "IO: Failed to open netlink";
+        CHECK(register_netlink()) << "IO: Failed to register netlink";
+    }
+
+    m_ctrl_thread = std::thread(ctrl_thread, this);
 
     return true;
 }
@@ -88,10 +209,8 @@ int io::process_messages_cb(struct nl_msg *msg, void *arg)
     struct nlmsghdr *nlh = nlmsg_hdr(msg);
     struct genlmsghdr *gnlh = (struct genlmsghdr *)nlmsg_data(nlh);
     struct helper_msg *h;
-    struct key k;
-    uint8_t tq, tq2, type;
-    uint16_t block, len, rank, seq = 0;
-    uint8_t *src, *dst, *data;
+    uint8_t tq, tq2;
+    uint8_t *src, *dst;
     int i, err;
     void *tmp;
 
@@ -173,44 +292,7 @@ int io::process_messages_cb(struct nl_msg *msg, void *arg)
             break;
 
         case BATADV_HLP_C_FRAME:
-            if (!attrs[BATADV_HLP_A_FRAME])
-                break;
-
-            if (attrs[BATADV_HLP_A_RANK])
-                rank = nla_get_u16(attrs[BATADV_HLP_A_RANK]);
-
-            if (attrs[BATADV_HLP_A_SEQ])
-                seq = nla_get_u16(attrs[BATADV_HLP_A_SEQ]);
-
-            type = nla_get_u8(attrs[BATADV_HLP_A_TYPE]);
-            tmp = nla_data(attrs[BATADV_HLP_A_SRC]);
-            src = reinterpret_cast<uint8_t *>(tmp);
-            tmp = nla_data(attrs[BATADV_HLP_A_DST]);
-            dst = reinterpret_cast<uint8_t *>(tmp);
-            block = nla_get_u16(attrs[BATADV_HLP_A_BLOCK]);
-            tmp = nla_data(attrs[BATADV_HLP_A_FRAME]);
-            data = reinterpret_cast<uint8_t *>(tmp);
-            len = nla_len(attrs[BATADV_HLP_A_FRAME]);
-            k.set(src, dst, block);
-
-            VLOG(LOG_PKT) << "IO: Received frame message: "
-                          << static_cast<int>(type);
-
-            if (FLAGS_benchmark) {
-                msg = nlmsg_alloc();
-                genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, genl_family(),
-                            0, 0, BATADV_HLP_C_FRAME, 1);
-
-                nla_put_u32(msg, BATADV_HLP_A_IFINDEX, ifindex());
-                nla_put_u8(msg, BATADV_HLP_A_TYPE, PLAIN_PACKET);
-                nla_put(msg, BATADV_HLP_A_FRAME, len, data);
-
-                send_msg(msg);
-                nlmsg_free(msg);
-                break;
-            }
-
-            handle_packet(type, k, data, len, rank, seq);
+            process_frame(attrs, NULL);
             break;
 
         default:
@@ -220,6 +302,268 @@ int io::process_messages_cb(struct nl_msg *msg, void *arg)
     return NL_STOP;
 }
 
+void io::recv_batch()
+{
+    int fd = nl_socket_get_fd(m_nl_sock);
+    int n;
+
+    for (size_t i = 0; i < m_rx.size(); i++) {
+        rx_slot &s(m_rx[i]);
+
+        if (!s.buf)
+            s.buf = m_buffers.get();
+
+        m_rx_iov[i].iov_base = s.buf ? s.buf.head() : s.scratch.get();
+        m_rx_iov[i].iov_len = m_buffers.size();
+        memset(&m_rx_hdrs[i], 0, sizeof(m_rx_hdrs[i]));
+        m_rx_hdrs[i].msg_hdr.msg_iov = &m_rx_iov[i];
+        m_rx_hdrs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    n = recvmmsg(fd, m_rx_hdrs.data(), m_rx_hdrs.size(), MSG_WAITFORONE,
+                 NULL);
+
+    if (n < 0) {
+        if (errno == ENOBUFS)
+            inc("rx overruns");
+        else if (errno != EINTR)
+            LOG(ERROR) << "Netlink read error: " << strerror(errno);
+
+        return;
+    }
+
+    inc("rx batches");
+
+    for (int i = 0; i < n; i++) {
+        if (m_rx_hdrs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+            inc("rx truncated");
+            continue;
+        }
+
+        process_datagram(m_rx[i], m_rx_hdrs[i].msg_len);
+    }
+}
+
+void io::process_datagram(rx_slot &s, size_t len)
+{
+    struct nlattr *attrs[BATADV_HLP_A_NUM], *attr;
+    uint8_t *head = s.buf ? s.buf.head() : s.scratch.get();
+    struct nlmsghdr *nlh = reinterpret_cast<struct nlmsghdr *>(head);
+    struct nlmsghdr *next;
+    struct genlmsghdr *gnlh;
+    struct nlmsgerr *err;
+    struct nl_msg *msg;
+    int rem = len, next_rem, attr_rem;
+
+    for (; nlmsg_ok(nlh, rem); nlh = next, rem = next_rem) {
+        next_rem = rem;
+        next = nlmsg_next(nlh, &next_rem);
+
+        switch (nlh->nlmsg_type) {
+            case NLMSG_NOOP:
+            case NLMSG_DONE:
+                continue;
+
+            case NLMSG_ERROR:
+                err = reinterpret_cast<struct nlmsgerr *>(nlmsg_data(nlh));
+                LOG_IF(ERROR, err->error) << "IO: Netlink error: "
+                                          << nl_geterror(nl_syserr2nlerr(
+                                                          err->error));
+                continue;
+        }
+
+        gnlh = reinterpret_cast<struct genlmsghdr *>(nlmsg_data(nlh));
+
+        /* slow path through libnl for everything but frames */
+        if (nlh->nlmsg_type != genl_family() ||
+            gnlh->cmd != BATADV_HLP_C_FRAME) {
+            msg = nlmsg_convert(nlh);
+            if (!msg)
+                continue;
+
+            process_messages_cb(msg, NULL);
+            nlmsg_free(msg);
+            continue;
+        }
+
+        /* fast path; only keep the last attribute of each type */
+        memset(attrs, 0, sizeof(attrs));
+        nla_for_each_attr(attr, genlmsg_attrdata(gnlh, 0),
+                          genlmsg_attrlen(gnlh, 0), attr_rem) {
+            if (nla_type(attr) <= BATADV_HLP_A_MAX)
+                attrs[nla_type(attr)] = attr;
+        }
+
+        inc("rx frames");
+
+        /* the buffer can only be handed on if no other messages use it */
+        if (head == reinterpret_cast<uint8_t *>(nlh) &&
+            !nlmsg_ok(next, next_rem))
+            process_frame(attrs, &s.buf);
+        else
+            process_frame(attrs, NULL);
+    }
+}
+
+void io::process_frame(struct nlattr **attrs, packet_buffer *rx)
+{
+    struct nl_msg *msg;
+    struct rx_work w;
+    struct key k;
+    uint8_t type;
+    uint16_t block, len, rank = 0, seq = 0;
+    uint8_t *src, *dst, *data;
+    void *tmp;
+
+    if (!attrs[BATADV_HLP_A_FRAME] || !attrs[BATADV_HLP_A_TYPE] ||
+        !attrs[BATADV_HLP_A_SRC] || !attrs[BATADV_HLP_A_DST] ||
+        !attrs[BATADV_HLP_A_BLOCK]) {
+        inc("invalid frames");
+        return;
+    }
+
+    if (attrs[BATADV_HLP_A_RANK])
+        rank = nla_get_u16(attrs[BATADV_HLP_A_RANK]);
+
+    if (attrs[BATADV_HLP_A_SEQ])
+        seq = nla_get_u16(attrs[BATADV_HLP_A_SEQ]);
+
+    type = nla_get_u8(attrs[BATADV_HLP_A_TYPE]);
+    tmp = nla_data(attrs[BATADV_HLP_A_SRC]);
+    src = reinterpret_cast<uint8_t *>(tmp);
+    tmp = nla_data(attrs[BATADV_HLP_A_DST]);
+    dst = reinterpret_cast<uint8_t *>(tmp);
+    block = nla_get_u16(attrs[BATADV_HLP_A_BLOCK]);
+    tmp = nla_data(attrs[BATADV_HLP_A_FRAME]);
+    data = reinterpret_cast<uint8_t *>(tmp);
+    len = nla_len(attrs[BATADV_HLP_A_FRAME]);
+    k.set(src, dst, block);
+
+    VLOG(LOG_PKT) << "IO: Received frame message: "
+                  << static_cast<int>(type);
+
+    if (m_reflect) {
+        msg = nlmsg_alloc();
+        genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, genl_family(),
+                    0, 0, BATADV_HLP_C_FRAME, 1);
+
+        nla_put_u32(msg, BATADV_HLP_A_IFINDEX, ifindex());
+        nla_put_u8(msg, BATADV_HLP_A_TYPE, PLAIN_PACKET);
+        nla_put(msg, BATADV_HLP_A_FRAME, len, data);
+
+        send_msg(msg);
+        nlmsg_free(msg);
+        return;
+    }
+
+    w.type = type;
+    w.k = k;
+    w.rank = rank;
+    w.seq = seq;
+
+    /* the work item owns the frame; use the receive buffer itself if no
+     * other messages need it, otherwise copy to a fresh buffer */
+    if (rx && *rx) {
+        w.buf = std::move(*rx);
+        w.buf.set_offset(data - w.buf.head());
+    } else if ((w.buf = m_buffers.get()) && len <= w.buf.tailroom()) {
+        memcpy(w.buf.data(), data, len);
+    } else if (!m_work.workers()) {
+        inc("buffer pool exhausted");
+        handle_packet(type, k, data, len, rank, seq);
+        return;
+    } else {
+        inc("buffer pool exhausted");
+        return;
+    }
+
+    w.buf.set_len(len);
+
+    if (!m_work.workers()) {
+        handle_work(w);
+        return;
+    }
+
+    if (!m_work.push(flow_hash(k), std::move(w)))
+        inc("work queue full");
+}
+
+void io::handle_work(rx_work &w)
+{
+    /* plain packets become encoder symbols without copying if the symbol
+     * fits in the buffer with its length field in front of the data */
+    if (w.type == PLAIN_PACKET && w.buf.len() <= FLAGS_packet_size - LEN_SIZE &&
+        w.buf.headroom() >= LEN_SIZE &&
+        w.buf.tailroom() + LEN_SIZE >= FLAGS_packet_size) {
+        handle_plain_buffer(w.k, std::move(w.buf));
+        return;
+    }
+
+    handle_packet(w.type, w.k, w.buf.data(), w.buf.len(), w.rank, w.seq);
+}
+
+bool io::send_now(struct nl_msg *msg)
+{
+    struct nlmsghdr *hdr = nlmsg_hdr(msg);
+    ssize_t ret;
+
+    nl_complete_msg(m_nl_sock, msg);
+    ret = send(nl_socket_get_fd(m_nl_sock), hdr, hdr->nlmsg_len,
+               MSG_DONTWAIT);
+
+    if (ret >= 0)
+        return true;
+
+    /* socket buffer is full; message can be written later */
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS ||
+        errno == ENOMEM)
+        return false;
+
+    LOG(ERROR) << "IO: Failed to send netlink message: " << strerror(errno);
+    inc("send errors");
+
+    return true;
+}
+
+void io::flush_retry()
+{
+    while (!m_retry.empty()) {
+        if (!send_now(m_retry.front()))
+            return;
+
+        nlmsg_free(m_retry.front());
+        m_retry.pop_front();
+        m_retry_len--;
+        inc("send retried");
+    }
+}
+
+void io::send_msg(struct nl_msg *msg)
+{
+    if (m_loopback) {
+        m_loopback(msg);
+        return;
+    }
+
+    guard g(m_nl_lock);
+
+    /* keep order of messages by writing waiting messages first */
+    flush_retry();
+
+    if (m_retry.empty() && send_now(msg))
+        return;
+
+    if (m_retry.size() >= static_cast<size_t>(FLAGS_retry_queue)) {
+        inc("send dropped");
+        return;
+    }
+
+    nlmsg_get(msg);
+    m_retry.push_back(msg);
+    m_retry_len++;
+    inc("send queued");
+}
+
 bool io::send_nl(int cmd, int type, uint8_t *data, size_t len)
 {
     struct nl_msg *msg;
@@ -237,11 +581,7 @@ bool io::send_nl(int cmd, int type, uint8_t *data, size_t len)
     CHECK_GE(nla_put(msg, type, len, data), 0)
         << "IO: Failed to put attribute";
 
-    guard g(m_nl_lock);
-
-    CHECK_GE(nl_send_auto(m_nl_sock, msg), 0)
-        << "IO: Failed to send netlink message";
-
+    send_msg(msg);
     nlmsg_free(msg);
 
     return true;
@@ -266,10 +606,83 @@ void io::read_helpers(const key &k)
     CHECK_GE(nla_put(msg, BATADV_HLP_A_DST, ETH_ALEN, k.dst), 0)
         << "IO: Failed to put destination address attribute";
 
-    guard g(m_nl_lock);
+    send_msg(msg);
+    nlmsg_free(msg);
+}
 
-    CHECK_GE(nl_send_auto(m_nl_sock, msg), 0)
-        << "IO: failed to send netlink message";
+void io::send_plain(const key &k, const uint8_t *data, uint16_t len)
+{
+    struct nl_msg *msg;
+
+    msg = CHECK_NOTNULL(nlmsg_alloc());
+    genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, genl_family(),
+                0, 0, BATADV_HLP_C_FRAME, 1);
+
+    nla_put_u32(msg, BATADV_HLP_A_IFINDEX, m_genl_if_index);
+    nla_put(msg, BATADV_HLP_A_SRC, ETH_ALEN, k.src);
+    nla_put(msg, BATADV_HLP_A_DST, ETH_ALEN, k.dst);
+    nla_put_u8(msg, BATADV_HLP_A_TYPE, PLAIN_PACKET);
+    nla_put(msg, BATADV_HLP_A_FRAME, len, data);
+
+    /* queue behind coded packets of the flow to keep it in order; the
+     * block is never acked, so the packet is never cancelled */
+    if (!m_pacer.pending(k) ||
+        !m_pacer.send(key(k.src, k.dst, SIZE_MAX), msg,
+                      nlmsg_hdr(msg)->nlmsg_len))
+        send_msg(msg);
 
     nlmsg_free(msg);
+    inc("plain packets forwarded");
+}
+
+void io::send_acks()
+{
+    std::vector<ack_window> windows(m_acks.pop());
+    struct nl_msg *msg;
+
+    for (auto &w : windows) {
+        msg = CHECK_NOTNULL(nlmsg_alloc());
+        genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, genl_family(),
+                    0, 0, BATADV_HLP_C_FRAME, 1);
+
+        nla_put_u32(msg, BATADV_HLP_A_IFINDEX, m_genl_if_index);
+        nla_put(msg, BATADV_HLP_A_SRC, ETH_ALEN, w.flow.src);
+        nla_put(msg, BATADV_HLP_A_DST, ETH_ALEN, w.flow.dst);
+        nla_put_u16(msg, BATADV_HLP_A_BLOCK, w.flow.block);
+        nla_put_u8(msg, BATADV_HLP_A_TYPE, ACKS_PACKET);
+        nla_put(msg, BATADV_HLP_A_FRAME, ACK_WINDOW_SIZE, w.bitmap);
+
+        send_msg(msg);
+        nlmsg_free(msg);
+
+        inc("acks sent");
+        VLOG(LOG_CTRL) << "IO: Sent cumulative ACK packet from " << w.flow;
+    }
+}
+
+void io::send_requests()
+{
+    std::vector<req_frame> frames(m_requests.pop());
+    struct nl_msg *msg;
+
+    for (auto &f : frames) {
+        msg = CHECK_NOTNULL(nlmsg_alloc());
+        genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, genl_family(),
+                    0, 0, BATADV_HLP_C_FRAME, 1);
+
+        nla_put_u32(msg, BATADV_HLP_A_IFINDEX, m_genl_if_index);
+        nla_put(msg, BATADV_HLP_A_SRC, ETH_ALEN, f.flow.src);
+        nla_put(msg, BATADV_HLP_A_DST, ETH_ALEN, f.flow.dst);
+        nla_put_u16(msg, BATADV_HLP_A_BLOCK, 0);
+        nla_put_u8(msg, BATADV_HLP_A_TYPE, REQS_PACKET);
+        nla_put(msg, BATADV_HLP_A_FRAME, f.reqs.size()*sizeof(req_entry),
+                f.reqs.data());
+
+        send_msg(msg);
+        nlmsg_free(msg);
+
+        inc("requests sent");
+        VLOG(LOG_CTRL) << "IO: Sent " << f.reqs.size()
+                       << " requests for " << f.flow;
+    }
 }
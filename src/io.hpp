@@ -7,9 +7,15 @@
 #include <netlink/genl/genl.h>
 #include <netlink/genl/ctrl.h>
 #include <netlink/genl/family.h>
+#include <sys/socket.h>
+#include <cstring>
 #include <mutex>
+#include <atomic>
+#include <deque>
 #include <thread>
+#include <functional>
 #include <unordered_map>
+#include <vector>
 #include <string>
 #include <utility>
 
@@ -17,6 +23,12 @@
 #include "counters.hpp"
 #include "key.hpp"
 #include "timeout.hpp"
+#include "buffer_pool.hpp"
+#include "ack_scheduler.hpp"
+#include "request_scheduler.hpp"
+#include "pacer.hpp"
+#include "work_queue.hpp"
+#include "link_estimator.hpp"
 
 
 enum batadv_rlnc_io {
@@ -28,8 +40,14 @@ enum batadv_rlnc_io {
     HLP_PACKET,
     REQ_PACKET,
     ACK_PACKET,
+    ACKS_PACKET,
+    REQS_PACKET,
 };
 
+/* largest acceptable loss probability for a scheduled request */
+#define REQ_TARGET_LOSS .01
+#define REQ_MAX_COPIES 5
+
 /**
  * struct helper_msg - information about helpers on one-hop links
  * addr: address of helper
@@ -44,6 +62,36 @@ struct helper_msg {
 
 #define LEN_SIZE sizeof(uint16_t)
 
+/* length field of the symbol that ends a generation flushed before it was
+ * full; larger than any plain packet */
+#define FLUSH_MARK 0xffff
+
+/* with --flush_rank, coded frames end with the rank of their flushed
+ * generation, mark included, so that the next hops learn it without decoding
+ * the mark; zero while the generation is open */
+#define FLUSH_RANK_SIZE sizeof(uint16_t)
+
+static inline uint16_t get_flush_rank(const uint8_t *trailer)
+{
+    uint16_t rank;
+
+    memcpy(&rank, trailer, FLUSH_RANK_SIZE);
+
+    return rank;
+}
+
+static inline void put_flush_rank(uint8_t *trailer, uint16_t rank)
+{
+    memcpy(trailer, &rank, FLUSH_RANK_SIZE);
+}
+
+/* room for netlink, generic netlink and attribute headers in front of the
+ * frame data in a receive buffer */
+#define NL_RX_HEADROOM 128
+
+/* generic netlink family id used when no kernel family is resolved */
+#define NL_LOOPBACK_FAMILY NLMSG_MIN_TYPE
+
 #ifdef nla_for_each_nested
 #undef nla_for_each_nested
 #endif
@@ -104,12 +152,32 @@ enum {
 };
 #define BATADV_HLP_C_MAX (BATADV_HLP_C_NUM - 1)
 
+/**
+ * struct rx_work - received frame waiting to be handled by a worker
+ * @type: packet type of frame
+ * @k: key of the block the frame belongs to
+ * @rank: rank attribute of frame, if any
+ * @seq: sequence attribute of frame, if any
+ * @buf: buffer with frame data
+ */
+struct rx_work {
+    uint8_t type;
+    key k;
+    uint16_t rank;
+    uint16_t seq;
+    packet_buffer buf;
+};
+
 /**
  * class io - Handle read and write operations to batman-adv.
  */
 class io : public counter_api
 {
-    std::thread m_nl_thread;
+  public:
+    typedef std::function<void (struct nl_msg *)> loopback_func;
+
+  private:
+    std::thread m_nl_thread, m_ctrl_thread;
     std::mutex m_nl_lock;
     struct nl_sock *m_nl_sock;
     struct nl_cb *m_cb;
@@ -117,14 +185,43 @@ class io : public counter_api
     struct genl_family *m_family;
     int m_genl_if_index;
     volatile bool m_running;
+    bool m_reflect;
+    loopback_func m_loopback;
     typedef std::pair<uint8_t, uint8_t> helper_val;
     typedef std::unordered_map<std::string, helper_val> helper_map;
     typedef std::unordered_map<std::string, helper_map> path_map;
     path_map m_helpers, m_one_hops;
-    std::unordered_map<std::string, uint8_t> m_links;
+    std::mutex m_paths_lock;
+    uint8_t m_addr[ETH_ALEN];
+    bool m_has_addr;
+    link_estimator m_links;
+    buffer_pool m_buffers;
+    ack_scheduler m_acks;
+    request_scheduler m_requests;
+    pacer m_pacer;
+    std::deque<struct nl_msg *> m_retry;
+    std::atomic<size_t> m_retry_len;
+
+    /**
+     * struct rx_slot - receive buffer for one datagram in a batch
+     * @buf: pooled buffer that can be handed to an encoder
+     * @scratch: private buffer used when the pool is exhausted
+     */
+    struct rx_slot {
+        packet_buffer buf;
+        aligned_ptr scratch;
+    };
+
+    std::vector<rx_slot> m_rx;
+    std::vector<struct mmsghdr> m_rx_hdrs;
+    std::vector<struct iovec> m_rx_iov;
+    work_queue<rx_work> m_work;
 
     bool open_netlink();
     bool register_netlink();
+    bool read_address();
+    bool send_now(struct nl_msg *msg);
+    void flush_retry();
 
     static int process_messages_wrapper(struct nl_msg *msg, void *arg)
     {
@@ -133,20 +230,66 @@ class io : public counter_api
 
     static void nl_thread(class io *i)
     {
-        int ret;
+        while (i->m_running)
+            i->recv_batch();
+    }
 
-        while (i->m_running) {
-            ret = nl_recvmsgs_default(i->m_nl_sock);
-            LOG_IF(ERROR, ret < 0) << "Netlink read error: " << nl_geterror(ret)
-                                   << " (" << ret << ")";
-        }
+    /**
+     * recv_batch() - read available datagrams with a single system call
+     *
+     * Blocks until at least one datagram is available and reads as many as
+     * there are receive slots.
+     */
+    void recv_batch();
+
+    /**
+     * process_datagram() - handle messages in a received datagram
+     * @param s Slot the datagram was received in.
+     * @param len Length of the datagram.
+     *
+     * Frames are parsed in place, and all other messages are passed to
+     * process_messages_cb() through libnl.
+     */
+    void process_datagram(rx_slot &s, size_t len);
+
+    /**
+     * process_frame() - handle parsed frame message
+     * @param attrs Attribute table of the message.
+     * @param rx Buffer the message was received in, or NULL. If the frame is
+     *        a plain packet, the buffer may be moved to the encoder.
+     */
+    void process_frame(struct nlattr **attrs, packet_buffer *rx);
+
+    /**
+     * handle_work() - pass received frame to coders
+     */
+    void handle_work(rx_work &w);
+
+    /**
+     * flow_hash() - hash source and destination of key
+     *
+     * Frames of a flow are handled by the same worker, so that they are
+     * passed to coders in the order they were received.
+     */
+    static size_t flow_hash(const key &k)
+    {
+        size_t h = 0;
+
+        for (size_t i = 0; i < sizeof(k.raw); i++)
+            h = h*31 + k.raw[i];
+
+        return h;
     }
 
+    static void ctrl_thread(class io *i);
+    void update_pace_rate();
+
     void add_link(const uint8_t *addr, const uint8_t tq)
     {
         std::string k(reinterpret_cast<const char *>(addr), ETH_ALEN);
         VLOG(LOG_NL) << "IO: Add link: " << k << " = " << tq;
-        m_links[k] = tq;
+        m_links.add_tq(addr, tq);
+        update_pace_rate();
     }
 
     void add_msg(path_map &map, const std::string &k1,
@@ -154,6 +297,7 @@ class io : public counter_api
     {
         std::string k2(reinterpret_cast<const char *>(m->addr), ETH_ALEN);
 
+        guard g(m_paths_lock);
         helper_map &h(map[k1]);
         helper_val &v(h[k2]);
         v.first = m->tq_total;
@@ -179,6 +323,7 @@ class io : public counter_api
 
         VLOG(LOG_NL) << "IO: Clear helpers on path: " << k1;
 
+        guard g(m_paths_lock);
         m_helpers[k1].clear();
     }
 
@@ -199,13 +344,16 @@ class io : public counter_api
 
         VLOG(LOG_NL) << "IO: Clear one hops towards: " << k1;
 
+        guard g(m_paths_lock);
         m_one_hops[k1].clear();
     }
 
   public:
     typedef std::shared_ptr<io> pointer;
 
-    io() : m_nl_sock(NULL), m_running(true)
+    io() : m_nl_sock(NULL), m_family(NULL), m_genl_if_index(0),
+           m_running(true), m_reflect(false), m_has_addr(false),
+           m_retry_len(0)
     {}
 
     /**
@@ -217,8 +365,16 @@ class io : public counter_api
     {
         m_running = false;
 
+        if (m_ctrl_thread.joinable())
+            m_ctrl_thread.join();
+
+        m_work.stop();
+        m_pacer.stop();
+
         /* force recv() to return by sending an empty message */
-        genl_send_simple(m_nl_sock, genl_family(), BATADV_HLP_C_UNSPEC, 1, 0);
+        if (m_nl_sock)
+            genl_send_simple(m_nl_sock, genl_family(), BATADV_HLP_C_UNSPEC,
+                             1, 0);
 
         guard g(m_nl_lock);
         if (m_nl_sock) {
@@ -229,6 +385,9 @@ class io : public counter_api
             free(m_cache);
             free(m_family);
         }
+
+        for (auto msg : m_retry)
+            nlmsg_free(msg);
     }
 
     void set_counts(counters::pointer counts)
@@ -237,17 +396,164 @@ class io : public counter_api
         set_group("input/ouput");
     }
 
+    /**
+     * set_loopback() - exchange messages with a function instead of the kernel
+     * @param func Function called with every message written by io.
+     *
+     * Must be called before open(), which then skips netlink setup. Messages
+     * for io are passed to inject() instead of being read from the socket.
+     */
+    void set_loopback(loopback_func func)
+    {
+        m_loopback = func;
+    }
+
+    /**
+     * inject() - handle message as if it was read from batman-adv
+     * @param msg Message to handle; the caller keeps its own reference.
+     */
+    void inject(struct nl_msg *msg)
+    {
+        process_messages_cb(msg, NULL);
+    }
+
     bool open();
     int process_messages_cb(struct nl_msg *msg, void *arg);
     bool send_nl(int cmd, int type, uint8_t *data, size_t len);
     void read_helpers(const key &k);
 
-    void send_msg(struct nl_msg *msg)
+    /**
+     * send_plain() - let batman-adv forward a plain packet without coding
+     * @param k Key of the flow the packet belongs to.
+     * @param data Plain packet.
+     * @param len Length of the packet.
+     *
+     * Sent at once, unless coded packets of the flow are waiting in the
+     * pacer, in which case it is queued behind them.
+     */
+    void send_plain(const key &k, const uint8_t *data, uint16_t len);
+
+    /**
+     * schedule_ack() - acknowledge block in next cumulative ack of its flow
+     * @param k Key of the acknowledged block.
+     * @param copies Number of cumulative acks to include the block in.
+     */
+    void schedule_ack(const key &k, size_t copies)
+    {
+        m_acks.add(k, copies);
+    }
+
+    /**
+     * send_acks() - send one round of scheduled acknowledgements
+     *
+     * Sends an ACKS_PACKET per flow with a bitmap of acknowledged blocks.
+     * Only used with --cumulative_acks.
+     */
+    void send_acks();
+
+    /**
+     * schedule_request() - request more data in next frame of the flow
+     * @param k Key of the stalled generation.
+     * @param rank Current rank of the generation.
+     * @param seq Sequence number of the request.
+     *
+     * The request is repeated in enough frames to reach the source with
+     * probability 1 - REQ_TARGET_LOSS, estimated from the link quality
+     * towards the source.
+     */
+    void schedule_request(const key &k, uint16_t rank, uint16_t seq)
+    {
+        m_requests.add(k, rank, seq, request_copies(get_link(k.src)));
+    }
+
+    /**
+     * cancel_request() - remove pending request for a generation
+     */
+    void cancel_request(const key &k)
+    {
+        m_requests.cancel(k);
+    }
+
+    /**
+     * send_requests() - send one round of scheduled requests
+     *
+     * Sends a REQS_PACKET per flow with an entry per stalled generation.
+     * Only used with --aggregate_requests.
+     */
+    void send_requests();
+
+    /**
+     * request_copies() - number of times to send a request
+     * @param tq Link quality towards the receiver of the request.
+     */
+    static size_t request_copies(uint8_t tq)
+    {
+        double loss = 1 - tq/255.0;
+        double p = loss;
+        size_t copies = 1;
+
+        while (p > REQ_TARGET_LOSS && copies < REQ_MAX_COPIES) {
+            p *= loss;
+            copies++;
+        }
+
+        return copies;
+    }
+
+    /**
+     * send_msg() - write message to batman-adv without blocking
+     * @param msg Message to send; the caller keeps its own reference.
+     *
+     * Messages that cannot be written because the socket buffer is full are
+     * put in a bounded retry queue, which is emptied before new messages are
+     * written. Messages are dropped if the retry queue is full.
+     */
+    void send_msg(struct nl_msg *msg);
+
+    /**
+     * retry_messages() - write messages waiting in the retry queue
+     */
+    void retry_messages()
     {
         guard g(m_nl_lock);
+        flush_retry();
+    }
+
+    /**
+     * congested() - return true if messages are waiting to be written
+     *
+     * Coders should postpone sending credits while io is congested.
+     */
+    bool congested()
+    {
+        return m_retry_len > 0 || m_pacer.queued() > m_pacer.limit()/2;
+    }
+
+    /**
+     * send_paced() - queue coded packet for paced transmission
+     * @param k Key of the block the packet belongs to.
+     * @param msg Packet to send; the caller keeps its own reference.
+     *
+     * Returns false if the pacer is full and the packet is dropped, in
+     * which case the caller should keep the credit and retry later.
+     */
+    bool send_paced(const key &k, struct nl_msg *msg)
+    {
+        if (m_pacer.send(k, msg, nlmsg_hdr(msg)->nlmsg_len))
+            return true;
+
+        inc("pacer dropped");
+        return false;
+    }
 
-        CHECK_GE(nl_send_auto(m_nl_sock, msg), 0)
-            << "IO: Failed to send netling message";
+    /**
+     * cancel_paced() - drop queued packets of an acknowledged block
+     *
+     * Returns the number of packets dropped.
+     */
+    size_t cancel_paced(const key &k)
+    {
+        return m_pacer.cancel(k);
     }
 
     void read_link(const uint8_t *addr)
@@ -274,30 +580,100 @@ class io : public counter_api
                 const_cast<uint8_t *>(addr), ETH_ALEN);
     }
 
+    /**
+     * get_link() - return estimated quality of link to a neighbour
+     *
+     * Returns 1 if the link is unknown.
+     */
     uint8_t get_link(const uint8_t *addr)
     {
-        return m_links[std::string((const char *)addr, ETH_ALEN)] ? : 1;
+        return m_links.quality(addr) ? : 1;
+    }
+
+    /**
+     * link_delivery() - report delivery of coded packets to a neighbour
+     * @param addr Address of neighbour.
+     * @param received Number of packets the neighbour has received.
+     * @param sent Number of packets sent to the neighbour.
+     * @param lower True if received is a lower bound.
+     */
+    void link_delivery(const uint8_t *addr, size_t received, size_t sent,
+                       bool lower = false)
+    {
+        m_links.add_delivery(addr, received, sent, lower);
     }
 
     uint8_t get_zero_helper(const key &k)
     {
         std::string k1((const char *)k.raw, sizeof(k.raw));
         std::string k2("\0\0\0\0\0\0", ETH_ALEN);
+        path_map::iterator p;
+        helper_map::iterator h;
+
+        guard g(m_paths_lock);
 
-        helper_map &m(m_helpers[k1]);
+        if ((p = m_helpers.find(k1)) == m_helpers.end())
+            return 1;
 
-        return m[k2].first ? : 1;
+        if ((h = p->second.find(k2)) == p->second.end())
+            return 1;
+
+        return h->second.first ? : 1;
+    }
+
+    /**
+     * get_helper_share() - return share of the helper budget to send
+     * @param k Key of the helped generation.
+     *
+     * Helpers of a path split its budget in proportion to the quality of
+     * the path through each of them, so that they send one budget together.
+     * Returns 1 if this node is not a known helper of the path.
+     */
+    double get_helper_share(const key &k)
+    {
+        std::string k1((const char *)k.raw, sizeof(k.raw));
+        std::string zero("\0\0\0\0\0\0", ETH_ALEN);
+        std::string self((const char *)m_addr, ETH_ALEN);
+        size_t own = 0, total = 0;
+        path_map::iterator p;
+
+        if (!m_has_addr)
+            return 1;
+
+        guard g(m_paths_lock);
+
+        if ((p = m_helpers.find(k1)) == m_helpers.end())
+            return 1;
+
+        for (auto &h : p->second) {
+            /* the zero address holds the direct link */
+            if (h.first == zero)
+                continue;
+
+            if (h.first == self)
+                own = h.second.first;
+
+            total += h.second.first;
+        }
+
+        if (own == 0 || total == 0)
+            return 1;
+
+        return static_cast<double>(own)/total;
     }
 
     helper_msg get_best_one_hop(const uint8_t *dst)
     {
-        helper_map &h(m_one_hops[std::string((const char *)dst, ETH_ALEN)]);
+        std::string k1((const char *)dst, ETH_ALEN);
         helper_msg one_hop = {1, 1};
+        path_map::iterator p;
+
+        guard g(m_paths_lock);
 
-        if (h.size() == 0)
+        if ((p = m_one_hops.find(k1)) == m_one_hops.end())
             return one_hop;
 
-        for (auto o : h) {
+        for (auto &o : p->second) {
             if (o.second.first > one_hop.tq_total) {
                 memcpy(one_hop.addr, o.first.c_str(), ETH_ALEN);
                 one_hop.tq_total = o.second.first;
@@ -310,7 +686,7 @@ class io : public counter_api
 
     int genl_family()
     {
-        return genl_family_get_id(m_family);
+        return m_family ? genl_family_get_id(m_family) : NL_LOOPBACK_FAMILY;
     }
 
     int ifindex()
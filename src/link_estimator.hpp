@@ -0,0 +1,157 @@
+/* Copyright 2013 Martin Hundebøll <martin@hundeboll.net> */
+
+#ifndef FOX_LINK_ESTIMATOR_HPP_
+#define FOX_LINK_ESTIMATOR_HPP_
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <algorithm>
+
+#include "fox.hpp"
+
+/* weight of new samples in the smoothed link quality */
+#define LINK_WEIGHT .2
+
+/* bounds on how much feedback can correct the quality from batman-adv */
+#define LINK_CORRECTION_MIN .5
+#define LINK_CORRECTION_MAX 1.5
+
+/**
+ * class link_estimator - smoothed quality of links to neighbours
+ *
+ * Link qualities (TQ) reported by batman-adv are smoothed with an
+ * exponentially weighted moving average per neighbour. As TQ is measured with
+ * small broadcast packets at a low rate, it is corrected by the delivery
+ * ratio of coded packets observed from acknowledgements and requests.
+ *
+ * Qualities are in the range of TQ, i.e. 255 is a perfect link.
+ */
+class link_estimator
+{
+    struct link {
+        double tq;
+        double correction;
+    };
+
+    typedef std::unordered_map<std::string, link> link_map;
+
+    std::mutex m_lock;
+    link_map m_links;
+    double m_weight;
+
+    static std::string addr_key(const uint8_t *addr)
+    {
+        return std::string(reinterpret_cast<const char *>(addr), ETH_ALEN);
+    }
+
+    static double corrected(const link &l)
+    {
+        return std::min(l.tq*l.correction, 255.0);
+    }
+
+  public:
+    explicit link_estimator(double weight = LINK_WEIGHT) : m_weight(weight)
+    {}
+
+    /**
+     * add_tq() - add link quality reported by batman-adv
+     * @param addr Address of neighbour.
+     * @param tq Reported link quality.
+     */
+    void add_tq(const uint8_t *addr, uint8_t tq)
+    {
+        std::string k(addr_key(addr));
+        link_map::iterator it;
+
+        guard g(m_lock);
+
+        it = m_links.find(k);
+
+        if (it == m_links.end()) {
+            link l = {static_cast<double>(tq), 1};
+            m_links[k] = l;
+        } else {
+            it->second.tq += m_weight*(tq - it->second.tq);
+        }
+    }
+
+    /**
+     * add_delivery() - correct link quality from observed delivery
+     * @param addr Address of neighbour.
+     * @param received Number of packets the neighbour received.
+     * @param sent Number of packets sent to the neighbour.
+     * @param lower True if the neighbour may have received more than
+     *        reported, e.g. when it acknowledged a generation. Such samples
+     *        only raise the quality.
+     *
+     * Feedback for neighbours without a quality from batman-adv is ignored.
+     */
+    void add_delivery(const uint8_t *addr, size_t received, size_t sent,
+                      bool lower)
+    {
+        std::string k(addr_key(addr));
+        link_map::iterator it;
+        double observed, c;
+
+        if (!sent)
+            return;
+
+        observed = 255.0*std::min(received, sent)/sent;
+
+        guard g(m_lock);
+
+        it = m_links.find(k);
+
+        if (it == m_links.end() || it->second.tq < 1)
+            return;
+
+        link &l(it->second);
+
+        if (lower && observed <= corrected(l))
+            return;
+
+        c = l.correction + m_weight*(observed/l.tq - l.correction);
+        l.correction = std::max(LINK_CORRECTION_MIN,
+                                std::min(c, LINK_CORRECTION_MAX));
+    }
+
+    /**
+     * quality() - return corrected link quality
+     * @param addr Address of neighbour.
+     *
+     * Returns zero if the link is unknown.
+     */
+    uint8_t quality(const uint8_t *addr)
+    {
+        link_map::iterator it;
+
+        guard g(m_lock);
+
+        it = m_links.find(addr_key(addr));
+
+        if (it == m_links.end())
+            return 0;
+
+        return corrected(it->second) + .5;
+    }
+
+    /**
+     * average() - return average corrected quality of known links
+     *
+     * Returns zero if no links are known.
+     */
+    double average()
+    {
+        double sum = 0;
+
+        guard g(m_lock);
+
+        for (auto &l : m_links)
+            sum += corrected(l.second);
+
+        return m_links.empty() ? 0 : sum/m_links.size();
+    }
+};
+
+#endif
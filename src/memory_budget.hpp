@@ -0,0 +1,144 @@
+/* Copyright 2013 Martin Hundebøll <martin@hundeboll.net> */
+
+#ifndef FOX_MEMORY_BUDGET_HPP_
+#define FOX_MEMORY_BUDGET_HPP_
+
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <utility>
+#include <functional>
+
+#include "fox.hpp"
+
+/**
+ * class memory_budget - cap on memory used by live coders
+ *
+ * Shared by all coder maps. Maps reserve memory before creating a coder and
+ * release it when the coder is freed. When a reservation fails, the maps
+ * registered as evictors are asked to free one of their least useful coders
+ * to make room.
+ */
+class memory_budget
+{
+  public:
+    typedef std::function<bool ()> evict_func;
+
+  private:
+    std::mutex m_lock;
+    std::vector<std::pair<const void *, evict_func>> m_evictors;
+    std::atomic<size_t> m_used;
+    size_t m_limit;
+
+  public:
+    /**
+     * memory_budget() - create budget
+     * @param limit Maximum number of bytes to reserve; zero for no limit.
+     */
+    explicit memory_budget(size_t limit) : m_used(0), m_limit(limit)
+    {}
+
+    /**
+     * reserve() - reserve memory if it fits within the budget
+     * @param bytes Number of bytes to reserve.
+     *
+     * Returns true if the memory was reserved; false otherwise.
+     */
+    bool reserve(size_t bytes)
+    {
+        size_t used = m_used.load();
+
+        do {
+            if (m_limit && used + bytes > m_limit)
+                return false;
+        } while (!m_used.compare_exchange_weak(used, used + bytes));
+
+        return true;
+    }
+
+    void release(size_t bytes)
+    {
+        m_used -= bytes;
+    }
+
+    /**
+     * add_evictor() - register function to free memory
+     * @param owner Object owning the function; skipped when it is the one
+     *              asking for memory.
+     * @param func Function that frees a coder and returns true, or returns
+     *             false if nothing could be freed.
+     */
+    void add_evictor(const void *owner, evict_func func)
+    {
+        guard g(m_lock);
+        m_evictors.push_back(std::make_pair(owner, func));
+    }
+
+    /**
+     * evict() - ask other owners to free memory
+     * @param requester Owner asking for memory.
+     *
+     * Returns true if one of the other owners freed a coder.
+     */
+    bool evict(const void *requester)
+    {
+        guard g(m_lock);
+
+        for (auto &e : m_evictors)
+            if (e.first != requester && e.second())
+                return true;
+
+        return false;
+    }
+
+    size_t used() const
+    {
+        return m_used;
+    }
+
+    size_t limit() const
+    {
+        return m_limit;
+    }
+};
+
+/**
+ * class memory_budget_api - helper functions to use class memory_budget.
+ */
+class memory_budget_api
+{
+    memory_budget *m_memory_budget;
+
+  protected:
+    bool memory_reserve(size_t bytes)
+    {
+        return m_memory_budget ? m_memory_budget->reserve(bytes) : true;
+    }
+
+    void memory_release(size_t bytes)
+    {
+        if (m_memory_budget)
+            m_memory_budget->release(bytes);
+    }
+
+    size_t memory_used()
+    {
+        return m_memory_budget ? m_memory_budget->used() : 0;
+    }
+
+    memory_budget *get_memory_budget()
+    {
+        return m_memory_budget;
+    }
+
+  public:
+    void set_memory_budget(memory_budget *b)
+    {
+        m_memory_budget = b;
+    }
+
+    memory_budget_api() : m_memory_budget(NULL)
+    {}
+};
+
+#endif
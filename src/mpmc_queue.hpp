@@ -0,0 +1,143 @@
+/* Copyright 2013 Martin Hundebøll <martin@hundeboll.net> */
+
+#ifndef FOX_MPMC_QUEUE_HPP_
+#define FOX_MPMC_QUEUE_HPP_
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <utility>
+
+/**
+ * class mpmc_queue - bounded lock-free multi-producer multi-consumer queue
+ * @param T Type of items; must be default constructible and movable.
+ *
+ * Items are stored in a ring of cells, each with a sequence number telling
+ * whether the cell is ready to be written or read in the current lap. Both
+ * push() and pop() claim a cell with a single compare-and-swap and never
+ * wait for each other, so a stalled consumer can only make the queue fill
+ * up, not block producers.
+ */
+template<class T>
+class mpmc_queue
+{
+    struct cell {
+        std::atomic<size_t> seq;
+        T data;
+    };
+
+    std::unique_ptr<cell[]> m_cells;
+    size_t m_mask;
+
+    /* keep producer and consumer positions on separate cache lines */
+    std::atomic<size_t> m_tail;
+    char m_pad[64 - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> m_head;
+
+  public:
+    /**
+     * mpmc_queue() - create queue
+     * @param size Number of items the queue can hold; rounded up to a power
+     *        of two.
+     */
+    explicit mpmc_queue(size_t size) : m_tail(0), m_head(0)
+    {
+        size_t n = 1;
+
+        while (n < size)
+            n <<= 1;
+
+        m_cells.reset(new cell[n]);
+        m_mask = n - 1;
+
+        for (size_t i = 0; i < n; i++)
+            m_cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    mpmc_queue(const mpmc_queue &) = delete;
+    mpmc_queue &operator=(const mpmc_queue &) = delete;
+
+    /**
+     * push() - add item to queue
+     * @param item Item to add; only moved from if it was added.
+     *
+     * Returns false if the queue is full.
+     */
+    bool push(T &&item)
+    {
+        size_t pos = m_tail.load(std::memory_order_relaxed);
+        cell *c;
+        intptr_t dif;
+
+        while (true) {
+            c = &m_cells[pos & m_mask];
+            dif = static_cast<intptr_t>(c->seq.load(std::memory_order_acquire))
+                - static_cast<intptr_t>(pos);
+
+            if (dif == 0 &&
+                m_tail.compare_exchange_weak(pos, pos + 1,
+                                             std::memory_order_relaxed))
+                break;
+            else if (dif < 0)
+                return false;
+            else if (dif > 0)
+                pos = m_tail.load(std::memory_order_relaxed);
+        }
+
+        c->data = std::move(item);
+        c->seq.store(pos + 1, std::memory_order_release);
+
+        return true;
+    }
+
+    /**
+     * pop() - take item from queue
+     * @param item Item to move the taken item into.
+     *
+     * Returns false if the queue is empty.
+     */
+    bool pop(T &item)
+    {
+        size_t pos = m_head.load(std::memory_order_relaxed);
+        cell *c;
+        intptr_t dif;
+
+        while (true) {
+            c = &m_cells[pos & m_mask];
+            dif = static_cast<intptr_t>(c->seq.load(std::memory_order_acquire))
+                - static_cast<intptr_t>(pos + 1);
+
+            if (dif == 0 &&
+                m_head.compare_exchange_weak(pos, pos + 1,
+                                             std::memory_order_relaxed))
+                break;
+            else if (dif < 0)
+                return false;
+            else if (dif > 0)
+                pos = m_head.load(std::memory_order_relaxed);
+        }
+
+        item = std::move(c->data);
+        c->seq.store(pos + m_mask + 1, std::memory_order_release);
+
+        return true;
+    }
+
+    /**
+     * size() - return approximate number of items in queue
+     */
+    size_t size() const
+    {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        size_t head = m_head.load(std::memory_order_relaxed);
+
+        return tail > head ? tail - head : 0;
+    }
+
+    size_t capacity() const
+    {
+        return m_mask + 1;
+    }
+};
+
+#endif
@@ -0,0 +1,220 @@
+/* Copyright 2013 Martin Hundebøll <martin@hundeboll.net> */
+
+#ifndef FOX_OVERSHOOT_HPP_
+#define FOX_OVERSHOOT_HPP_
+
+#include <mutex>
+#include <map>
+#include <vector>
+#include <algorithm>
+
+#include "fox.hpp"
+#include "key.hpp"
+#include "coarse_clock.hpp"
+
+DECLARE_double(fixed_overshoot);
+
+/* change of the overshoot factor when a generation needs repair */
+#define OVERSHOOT_STEP .02
+
+/* seconds to keep the factor of flows without generations */
+#define OVERSHOOT_FLOW_AGE 60
+
+/**
+ * class overshoot_controller - adapt budget overshoot per flow
+ *
+ * Budgets computed from link estimates are multiplied by an overshoot
+ * factor to make up for estimation errors. Instead of a fixed factor, each
+ * flow starts at --fixed_overshoot and is adjusted from feedback:
+ *
+ *  - a generation that needs a repair request raises the factor by a step,
+ *  - a generation acknowledged without requests lowers it by a smaller step,
+ *    so that the share of generations needing repair converges to the
+ *    target,
+ *  - a generation acknowledged before its budget was sent lowers it by half
+ *    the share of the budget that was not needed, if that is larger.
+ *
+ * The factor is kept within the given bounds. Flows without generations
+ * for OVERSHOOT_FLOW_AGE seconds are dropped and start over.
+ */
+class overshoot_controller
+{
+  public:
+    /**
+     * struct flow_stats - overshoot of one flow
+     * @flow: source and destination of the flow
+     * @factor: current overshoot factor
+     * @repaired: number of generations that needed repair
+     * @acked: number of generations acknowledged without repair
+     * @used: time the factor was last used or adjusted
+     */
+    struct flow_stats {
+        key flow;
+        double factor;
+        size_t repaired;
+        size_t acked;
+        coarse_clock::tick_type used;
+    };
+
+  private:
+    typedef std::map<key, flow_stats> flow_map;
+
+    std::mutex m_lock;
+    flow_map m_flows;
+    double m_min, m_max, m_down;
+    coarse_clock::tick_type m_age;
+
+    flow_stats &flow(const key &k)
+    {
+        key fk(k.src, k.dst, 0);
+        flow_map::iterator it = m_flows.find(fk);
+
+        if (it != m_flows.end()) {
+            it->second.used = coarse_clock::now();
+            return it->second;
+        }
+
+        flow_stats &s(m_flows[fk]);
+        s.flow = fk;
+        s.factor = std::max(m_min, std::min(FLAGS_fixed_overshoot, m_max));
+        s.repaired = s.acked = 0;
+        s.used = coarse_clock::now();
+
+        return s;
+    }
+
+    void set(flow_stats &s, double factor)
+    {
+        s.factor = std::max(m_min, std::min(factor, m_max));
+    }
+
+  public:
+    /**
+     * overshoot_controller() - create controller
+     * @param min Smallest factor to use.
+     * @param max Largest factor to use.
+     * @param target Share of generations that may need repair; between
+     *        zero and one.
+     */
+    overshoot_controller(double min, double max, double target)
+        : m_min(min), m_max(max),
+          m_down(OVERSHOOT_STEP*target/(1 - target)),
+          m_age(coarse_clock::ticks(OVERSHOOT_FLOW_AGE))
+    {}
+
+    /**
+     * factor() - return current overshoot factor of the flow of a key
+     */
+    double factor(const key &k)
+    {
+        guard g(m_lock);
+
+        return flow(k).factor;
+    }
+
+    /**
+     * repaired() - account generation that needed a repair request
+     */
+    void repaired(const key &k)
+    {
+        guard g(m_lock);
+
+        flow_stats &s(flow(k));
+
+        s.repaired++;
+        set(s, s.factor + OVERSHOOT_STEP);
+    }
+
+    /**
+     * acked() - account generation acknowledged without repair
+     * @param k Key of the generation.
+     * @param unused Share of the budget that was not sent when the
+     *        generation was acknowledged.
+     */
+    void acked(const key &k, double unused)
+    {
+        guard g(m_lock);
+
+        flow_stats &s(flow(k));
+
+        s.acked++;
+        set(s, s.factor - std::max(m_down, s.factor*unused/2));
+    }
+
+    /**
+     * get_stats() - return factors of flows
+     *
+     * Also drops factors of idle flows.
+     */
+    std::vector<flow_stats> get_stats()
+    {
+        std::vector<flow_stats> v;
+        flow_map::iterator it;
+
+        guard g(m_lock);
+
+        for (it = m_flows.begin(); it != m_flows.end();) {
+            if (coarse_clock::since(it->second.used) > m_age) {
+                m_flows.erase(it++);
+                continue;
+            }
+
+            v.push_back(it->second);
+            ++it;
+        }
+
+        return v;
+    }
+};
+
+/**
+ * class overshoot_api - give coders access to an overshoot controller
+ */
+class overshoot_api
+{
+    overshoot_controller *m_overshoot;
+
+  protected:
+    /**
+     * overshoot_factor() - return factor to multiply budgets of a key with
+     *
+     * Returns --fixed_overshoot if no controller is set.
+     */
+    double overshoot_factor(const key &k)
+    {
+        return m_overshoot ? m_overshoot->factor(k) : FLAGS_fixed_overshoot;
+    }
+
+    void overshoot_repaired(const key &k)
+    {
+        if (m_overshoot)
+            m_overshoot->repaired(k);
+    }
+
+    void overshoot_acked(const key &k, double unused)
+    {
+        if (m_overshoot)
+            m_overshoot->acked(k, unused);
+    }
+
+    bool has_overshoot()
+    {
+        return (m_overshoot != NULL);
+    }
+
+    overshoot_controller *get_overshoot()
+    {
+        return m_overshoot;
+    }
+
+  public:
+    void set_overshoot(overshoot_controller *overshoot)
+    {
+        m_overshoot = overshoot;
+    }
+
+    overshoot_api() : m_overshoot(NULL)
+    {}
+};
+
+#endif
@@ -0,0 +1,330 @@
+/* Copyright 2013 Martin Hundebøll <martin@hundeboll.net> */
+
+#ifndef FOX_PACER_HPP_
+#define FOX_PACER_HPP_
+
+#include <netlink/msg.h>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <deque>
+#include <list>
+#include <map>
+
+#include "fox.hpp"
+#include "key.hpp"
+
+/**
+ * class pacer - send coded packets at a limited rate with fair queuing
+ *
+ * Coded packets are queued per flow instead of being written to batman-adv
+ * as fast as coders produce them. A pacer thread takes packets from the
+ * flows in deficit round robin order, so that flows get equal shares of
+ * bytes, and a token bucket limits the total rate of the interface.
+ *
+ * Packets queued for a block can be cancelled, e.g. when the block is
+ * acknowledged while packets are still waiting.
+ */
+class pacer
+{
+  public:
+    typedef std::function<void (struct nl_msg *)> send_func;
+
+  private:
+    typedef std::chrono::steady_clock clock;
+
+    struct entry {
+        size_t block;
+        size_t len;
+        struct nl_msg *msg;
+    };
+
+    struct flow {
+        std::deque<entry> queue;
+        size_t deficit = {0};
+    };
+
+    typedef std::map<key, flow> flow_map;
+
+    std::thread m_thread;
+    std::mutex m_lock;
+    std::condition_variable m_cond;
+    std::atomic<bool> m_running;
+    send_func m_send;
+
+    flow_map m_flows;
+    std::list<key> m_active;
+    size_t m_queued, m_limit, m_quantum;
+
+    /* token bucket in bytes and bytes per second */
+    double m_tokens, m_burst, m_rate;
+    clock::time_point m_refilled;
+
+    /* statistics read by io */
+    std::atomic<size_t> m_sent, m_dropped, m_cancelled;
+
+    void refill()
+    {
+        using std::chrono::duration;
+
+        clock::time_point now = clock::now();
+        duration<double> diff = now - m_refilled;
+
+        m_tokens = std::min(m_burst, m_tokens + diff.count()*m_rate);
+        m_refilled = now;
+    }
+
+    /**
+     * next() - take next packet to send in deficit round robin order
+     * @param e Entry to store the packet in.
+     *
+     * Must be called with m_lock held and with at least one active flow.
+     */
+    void next(entry &e)
+    {
+        while (true) {
+            flow &f(m_flows[m_active.front()]);
+
+            if (f.deficit < f.queue.front().len) {
+                /* flow has used its share; move it to the back */
+                f.deficit += m_quantum;
+                m_active.splice(m_active.end(), m_active, m_active.begin());
+                continue;
+            }
+
+            e = f.queue.front();
+            f.queue.pop_front();
+            f.deficit -= e.len;
+            m_queued--;
+
+            if (f.queue.empty()) {
+                m_flows.erase(m_active.front());
+                m_active.pop_front();
+            }
+
+            return;
+        }
+    }
+
+    void run()
+    {
+        using std::chrono::duration;
+
+        std::unique_lock<std::mutex> l(m_lock);
+        entry e;
+
+        while (m_running) {
+            if (m_active.empty()) {
+                m_cond.wait(l);
+                continue;
+            }
+
+            refill();
+
+            /* wait for enough tokens to send the next packet */
+            if (m_rate > 0 && m_tokens < m_quantum) {
+                duration<double> d((m_quantum - m_tokens)/m_rate);
+                m_cond.wait_for(l, d);
+                continue;
+            }
+
+            next(e);
+            m_tokens -= e.len;
+
+            l.unlock();
+            m_send(e.msg);
+            nlmsg_free(e.msg);
+            m_sent++;
+            l.lock();
+        }
+    }
+
+  public:
+    pacer() : m_running(false), m_queued(0), m_limit(0), m_quantum(0),
+              m_tokens(0), m_burst(0), m_rate(0), m_sent(0), m_dropped(0),
+              m_cancelled(0)
+    {}
+
+    ~pacer()
+    {
+        stop();
+    }
+
+    /**
+     * start() - start pacer thread
+     * @param send Function to write packets to batman-adv.
+     * @param limit Maximum number of queued packets.
+     * @param quantum Bytes added to a flow's deficit in each round; should
+     *        be the size of the largest packet.
+     */
+    void start(send_func send, size_t limit, size_t quantum)
+    {
+        m_send = send;
+        m_limit = limit;
+        m_quantum = quantum;
+        m_burst = quantum;
+        m_refilled = clock::now();
+        m_running = true;
+        m_thread = std::thread(&pacer::run, this);
+    }
+
+    void stop()
+    {
+        if (!m_running)
+            return;
+
+        {
+            guard g(m_lock);
+            m_running = false;
+            m_cond.notify_one();
+        }
+
+        m_thread.join();
+
+        for (auto &f : m_flows)
+            for (auto &e : f.second.queue)
+                nlmsg_free(e.msg);
+
+        m_flows.clear();
+        m_active.clear();
+    }
+
+    /**
+     * set_rate() - change rate of token bucket
+     * @param rate Bytes per second; zero for no limit.
+     * @param burst Number of bytes that can be sent back-to-back.
+     */
+    void set_rate(double rate, size_t burst)
+    {
+        guard g(m_lock);
+
+        refill();
+        m_rate = rate;
+        m_burst = std::max(burst, m_quantum);
+        m_cond.notify_one();
+    }
+
+    double rate() const
+    {
+        return m_rate;
+    }
+
+    /**
+     * send() - queue packet of a flow
+     * @param k Key of the block the packet belongs to.
+     * @param msg Packet to send; a reference is taken, so the caller must
+     *        still free its own reference.
+     * @param len Size of the packet on the air.
+     *
+     * Returns false if the queue is full and the packet is dropped.
+     */
+    bool send(const key &k, struct nl_msg *msg, size_t len)
+    {
+        key fk(k.src, k.dst, 0);
+        entry e = {k.block, len, msg};
+
+        guard g(m_lock);
+
+        if (m_queued >= m_limit) {
+            m_dropped++;
+            return false;
+        }
+
+        flow &f(m_flows[fk]);
+
+        if (f.queue.empty())
+            m_active.push_back(fk);
+
+        nlmsg_get(msg);
+        f.queue.push_back(e);
+        m_queued++;
+        m_cond.notify_one();
+
+        return true;
+    }
+
+    /**
+     * cancel() - drop queued packets of a block
+     * @param k Key of the block.
+     *
+     * Returns the number of packets dropped.
+     */
+    size_t cancel(const key &k)
+    {
+        key fk(k.src, k.dst, 0);
+        flow_map::iterator it;
+        std::deque<entry>::iterator e;
+        size_t n = 0;
+
+        guard g(m_lock);
+
+        if ((it = m_flows.find(fk)) == m_flows.end())
+            return 0;
+
+        std::deque<entry> &q(it->second.queue);
+
+        for (e = q.begin(); e != q.end();) {
+            if (e->block != k.block) {
+                ++e;
+                continue;
+            }
+
+            nlmsg_free(e->msg);
+            e = q.erase(e);
+            m_queued--;
+            m_cancelled++;
+            n++;
+        }
+
+        if (q.empty()) {
+            m_active.remove(fk);
+            m_flows.erase(it);
+        }
+
+        return n;
+    }
+
+    /**
+     * pending() - return true if packets of a flow are queued
+     * @param k Key of a block of the flow.
+     */
+    bool pending(const key &k)
+    {
+        key fk(k.src, k.dst, 0);
+
+        guard g(m_lock);
+
+        return m_flows.find(fk) != m_flows.end();
+    }
+
+    size_t limit() const
+    {
+        return m_limit;
+    }
+
+    size_t queued()
+    {
+        guard g(m_lock);
+        return m_queued;
+    }
+
+    size_t sent() const
+    {
+        return m_sent;
+    }
+
+    size_t dropped() const
+    {
+        return m_dropped;
+    }
+
+    size_t cancelled() const
+    {
+        return m_cancelled;
+    }
+};
+
+#endif
@@ -3,14 +3,16 @@
 #include "recoder.hpp"
 
 DECLARE_double(recoder_timeout);
-DECLARE_double(fixed_overshoot);
+DECLARE_bool(deferred_decoding);
 
 template<>
-void recoder::send_rec_packet()
+bool recoder::send_rec_packet()
 {
     struct nl_msg *msg;
+    bool sent;
     struct nlattr *attr;
     uint8_t *data;
+    size_t size = this->payload_size();
 
     msg = nlmsg_alloc();
     genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, m_io->genl_family(),
@@ -21,15 +23,24 @@ void recoder::send_rec_packet()
     nla_put(msg, BATADV_HLP_A_DST, ETH_ALEN, _key.dst);
     nla_put_u16(msg, BATADV_HLP_A_BLOCK, _key.block);
     nla_put_u8(msg, BATADV_HLP_A_TYPE, REC_PACKET);
-    attr = nla_reserve(msg, BATADV_HLP_A_FRAME, this->payload_size());
+    attr = nla_reserve(msg, BATADV_HLP_A_FRAME, size + flush_rank_size());
     data = reinterpret_cast<uint8_t *>(nla_data(attr));
 
+    /* recoding needs all received payloads to be decoded */
+    this->flush();
     this->recode(data);
-    m_io->send_msg(msg);
+    if (flush_rank_size())
+        put_flush_rank(data + size, m_flush_rank);
+    sent = m_io->send_paced(_key, msg);
     nlmsg_free(msg);
 
+    if (!sent)
+        return false;
+
     m_rec_pkt_count++;
     inc("forward packets written");
+
+    return true;
 }
 
 template<>
@@ -48,11 +59,12 @@ void recoder::send_systematic_packet(const uint8_t *data, const uint16_t len)
     nla_put_u8(msg, BATADV_HLP_A_TYPE, REC_PACKET);
     nla_put(msg, BATADV_HLP_A_FRAME, len, const_cast<uint8_t *>(data));
 
-    m_io->send_msg(msg);
-    nlmsg_free(msg);
+    if (m_io->send_paced(_key, msg)) {
+        m_rec_pkt_count++;
+        inc("systematic packets written");
+    }
 
-    m_rec_pkt_count++;
-    inc("systematic packets written");
+    nlmsg_free(msg);
 }
 
 template<>
@@ -60,14 +72,17 @@ void recoder::send_rec_credits()
 {
     update_budget();
 
-    if (m_budget <= 0) {
+    /* keep credits for later if io can't keep up */
+    if (m_budget <= 0 || m_io->congested()) {
         dispatch_event(EVENT_CREDIT_SENT);
         return;
     }
 
     for (; m_budget > 0 && m_rec_pkt_count <= m_max_budget; m_budget--) {
         guard g(m_lock);
-        send_rec_packet();
+
+        if (!send_rec_packet())
+            break;
     }
 
     if (m_rec_pkt_count >= m_max_budget) {
@@ -80,9 +95,12 @@ void recoder::send_rec_credits()
 template<>
 void recoder::send_rec_budget()
 {
+    /* process() sends the rest if the pacer is full */
     while (m_rec_pkt_count < m_max_budget && next_state() == STATE_SEND_BUDGET) {
         guard g(m_lock);
-        send_rec_packet();
+
+        if (!send_rec_packet())
+            break;
     }
 
     dispatch_event(EVENT_BUDGET_SENT);
@@ -110,16 +128,19 @@ void recoder::init()
     set_group("recoder");
     set_state(STATE_WAIT);
     init_timeout(FLAGS_recoder_timeout);
+    this->set_deferred(FLAGS_deferred_decoding);
 
     /* reset counters */
     m_budget = 0;
     m_rec_pkt_count = 0;
+    m_flush_rank = 0;
 
     m_io->read_one_hops(_key.dst);
     helper_msg best_helper = m_io->get_best_one_hop(_key.dst);
     if (best_helper.tq_total == 0) {
         VLOG(LOG_GEN) << "Recoder " << m_coder << ": No best one hop";
-        m_max_budget = this->symbols()*FLAGS_fixed_overshoot;
+        e1 = e2 = e3 = ONE;
+        m_max_budget = max_budget();
         return;
     }
 
@@ -129,13 +150,10 @@ void recoder::init()
     e2 = ONE - best_helper.tq_second_hop * 4.5;  // Scale to revert hop penalty
     e3 = ONE - m_io->get_link(_key.dst);
 
-    if (e1 == ONE || e2 == ONE || e3 == ONE) {
-        VLOG(LOG_GEN) << "Recoder " << m_coder << ": Missing link estimate";
-        m_max_budget = this->symbols()*FLAGS_fixed_overshoot;
-        return;
-    }
+    VLOG_IF(LOG_GEN, e1 == ONE || e2 == ONE || e3 == ONE)
+        << "Recoder " << m_coder << ": Missing link estimate";
 
-    m_max_budget = recoder_budget(this->symbols(), e1, e2, e3);
+    m_max_budget = max_budget();
     VLOG(LOG_GEN) << "Recoder " << m_coder << ": Initialized" << _key;
 }
 
@@ -143,13 +161,14 @@ template<>
 void recoder::add_enc_packet(const uint8_t *data, const uint16_t len)
 {
     size_t tmp_rank;
+    size_t size = this->payload_size();
 
     guard g(m_lock);
 
     /* don't add packets when we have enough, and try to stop encoder
      * from sending more packets
      */
-    if (this->is_complete()) {
+    if (is_generation_complete()) {
         send_ack_packet();
         return;
     }
@@ -157,14 +176,14 @@ void recoder::add_enc_packet(const uint8_t *data, const uint16_t len)
     if (curr_state() == STATE_DONE)
         return;
 
-    CHECK_EQ(len, this->payload_size()) << "Recoder " << m_coder
-                                        << ": Encoded data is too short:"
-                                        << len << " < " << this->payload_size();
+    if (!coded_length_valid(len, size))
+        return;
 
     /* keep track of changes in rank */
     tmp_rank = this->rank();
 
     this->decode(const_cast<uint8_t *>(data));
+    set_flush_rank(frame_flush_rank(data, len, size));
 
     /* check if rank improved */
     if (this->rank() == tmp_rank)
@@ -181,7 +200,7 @@ void recoder::add_enc_packet(const uint8_t *data, const uint16_t len)
     }
 
     /* signal state machine if generation is complete */
-    if (this->is_complete()) {
+    if (is_generation_complete()) {
         send_ack_packet();
         dispatch_event(EVENT_COMPLETE);
     } else {
@@ -194,6 +213,7 @@ void recoder::add_enc_packet(const uint8_t *data, const uint16_t len)
 template<>
 void recoder::add_ack_packet()
 {
+    m_io->cancel_paced(_key);
     dispatch_event(EVENT_ACKED);
     VLOG(LOG_CTRL) << "Recoder " << m_coder << ": Sent "
                    << m_rec_pkt_count << " recoded packets";
@@ -213,5 +233,25 @@ bool recoder::process()
         return false;
     }
 
+    /* send packets the pacer had no room for */
+    if (curr_state() == STATE_WAIT_ACK &&
+        static_cast<ssize_t>(m_rec_pkt_count) < m_max_budget &&
+        !m_io->congested()) {
+        guard g(m_lock);
+
+        while (static_cast<ssize_t>(m_rec_pkt_count) < m_max_budget)
+            if (!send_rec_packet())
+                break;
+    }
+
     return false;
 }
+
+template<>
+size_t recoder::storage_size(size_t symbols, size_t symbol_size)
+{
+    /* symbols and coefficients, and the same again while staged */
+    size_t size = symbols * (align_up(symbol_size) + align_up(symbols));
+
+    return FLAGS_deferred_decoding ? 2 * size : size;
+}
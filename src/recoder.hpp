@@ -7,6 +7,8 @@
 
 #include "coder.hpp"
 #include "systematic_decoder.hpp"
+#include "deferred_decoder.hpp"
+#include "aligned_storage.hpp"
 
 /**
  * class recoder - handle encoded packets at intermediate relays
@@ -24,28 +26,34 @@ class full_rlnc_recoder_deep
              // Symbol ID API
              plain_symbol_id_reader<
              // Codec API
+             deferred_decoder<
              aligned_coefficients_decoder<
              linear_block_decoder<
              // Coefficient Storage API
-             coefficient_storage<
+             aligned_coefficient_storage<
              coefficient_info<
              // Storage API
-             deep_symbol_storage<
+             aligned_symbol_storage<
+             mutable_shallow_symbol_storage<
              storage_bytes_used<
              storage_block_info<
              // Finite Field API
-             finite_field_math<typename fifi::default_field<Field>::type,
+             finite_field_math<typename fox_math<Field>::type,
              finite_field_info<Field,
              // Factory API
              final_coder_factory_pool<
              // Final type
              full_rlnc_recoder_deep<Field>
-                 > > > > > > > > > > > > > > > >, public coder
+                 > > > > > > > > > > > > > > > > > >, public coder
 {
     std::atomic<size_t> m_rec_pkt_count;
     uint8_t e1, e2, e3;
     ssize_t m_budget, m_max_budget;
 
+    /* rank of a flushed generation as carried by coded packets; zero while
+     * the generation is open */
+    size_t m_flush_rank;
+
     /**
      * enum _state - states that this helper can reside in
      * @STATE_INVALID:    inherited state that should never be entered
@@ -84,8 +92,10 @@ class full_rlnc_recoder_deep
 
     /**
      * _write_fwd_packet() - write one recoded packet to batman-adv.
+     *
+     * Returns false if the pacer is full; the packet is then not counted.
      */
-    void send_rec_packet();
+    bool send_rec_packet();
 
     /**
      * _write_fwd_packets() - write recoded packets until generation is
@@ -104,6 +114,51 @@ class full_rlnc_recoder_deep
 
     void send_rec_redundant();
 
+    /**
+     * generation_rank() - Return rank needed to decode the generation
+     */
+    size_t generation_rank()
+    {
+        return m_flush_rank ? m_flush_rank : this->symbols();
+    }
+
+    /**
+     * is_generation_complete() - Return if the generation can be decoded
+     *
+     * Flushed generations are complete before the decoder is.
+     */
+    bool is_generation_complete()
+    {
+        return this->is_complete() ||
+               (m_flush_rank && this->rank() >= m_flush_rank);
+    }
+
+    /**
+     * max_budget() - Return packets to send for the generation rank
+     */
+    size_t max_budget()
+    {
+        if (e1 == ONE || e2 == ONE || e3 == ONE)
+            return generation_rank()*overshoot_factor(_key);
+
+        return recoder_budget(generation_rank(), e1, e2, e3);
+    }
+
+    /**
+     * set_flush_rank() - Scale budget to the rank of a flushed generation
+     * @param rank Rank carried by a coded packet; zero if not flushed.
+     */
+    void set_flush_rank(size_t rank)
+    {
+        if (!rank || rank == m_flush_rank)
+            return;
+
+        m_flush_rank = rank;
+        m_max_budget = max_budget();
+        VLOG(LOG_GEN) << "Recoder " << m_coder << ": Flushed (rank " << rank
+                      << ", B: " << m_max_budget << ")";
+    }
+
     ssize_t update_budget()
     {
         if (e1 == ONE || e2 == ONE || e3 == ONE)
@@ -113,45 +168,59 @@ class full_rlnc_recoder_deep
         return m_budget;
     }
 
+    /* allowed transitions between states */
+    static constexpr transition s_transitions[] = {
+        {STATE_WAIT, EVENT_RX, STATE_SEND_CREDIT},
+        {STATE_WAIT, EVENT_COMPLETE, STATE_SEND_BUDGET},
+        {STATE_WAIT, EVENT_TIMEOUT, STATE_DONE},
+        {STATE_WAIT, EVENT_ACKED, STATE_DONE},
+        {STATE_SEND_CREDIT, EVENT_CREDIT_SENT, STATE_WAIT},
+        {STATE_SEND_CREDIT, EVENT_ACKED, STATE_DONE},
+        {STATE_SEND_CREDIT, EVENT_MAXED, STATE_WAIT_ACK},
+        {STATE_SEND_CREDIT, EVENT_RX, STATE_SEND_CREDIT},
+        {STATE_SEND_CREDIT, EVENT_COMPLETE, STATE_SEND_BUDGET},
+        {STATE_SEND_BUDGET, EVENT_ACKED, STATE_DONE},
+        {STATE_SEND_BUDGET, EVENT_BUDGET_SENT, STATE_WAIT_ACK},
+        {STATE_WAIT_ACK, EVENT_ACKED, STATE_DONE},
+        {STATE_WAIT_ACK, EVENT_TIMEOUT, STATE_DONE},
+        {STATE_WAIT_ACK, EVENT_RX, STATE_WAIT_ACK},
+        {STATE_WAIT_ACK, EVENT_COMPLETE, STATE_WAIT_ACK},
+        {STATE_DONE, EVENT_ACKED, STATE_DONE},
+        {STATE_DONE, EVENT_RX, STATE_DONE},
+    };
+
+    static constexpr size_t s_transition_num =
+        sizeof(s_transitions)/sizeof(s_transitions[0]);
+
+    static_assert(valid(s_transitions, s_transition_num, STATE_NUM,
+                        EVENT_NUM), "invalid recoder transitions");
+
+    /* function to call when entering each state */
+    static constexpr handler_func s_handlers[STATE_NUM] = {
+        &states::invalid_state,
+        &states::wait_state,
+        &states::wait_state,
+        &states::call<full_rlnc_recoder_deep,
+                      &full_rlnc_recoder_deep::send_rec_credits>,
+        &states::call<full_rlnc_recoder_deep,
+                      &full_rlnc_recoder_deep::send_rec_budget>,
+        &states::call<full_rlnc_recoder_deep,
+                      &full_rlnc_recoder_deep::send_rec_redundant>,
+    };
+
+    static constexpr state_table<STATE_NUM, EVENT_NUM> s_table{
+        s_transitions, s_transition_num, s_handlers
+    };
+
   public:
     /**
      * full_rlnc_recoder_deep() - construct recoder object
      *
-     * Allocates packet buffers and initializes state machine
+     * Allocates packet buffers and sets up the state machine.
      */
     full_rlnc_recoder_deep()
     {
-        states::handler_func credit, budget, ack;
-
-        /* prepare state tables */
-        states::init(m_coder, STATE_NUM, EVENT_NUM);
-
-        /* add states to state table */
-        credit = std::bind(&full_rlnc_recoder_deep::send_rec_credits, this);
-        budget = std::bind(&full_rlnc_recoder_deep::send_rec_budget, this);
-        ack = std::bind(&full_rlnc_recoder_deep::send_rec_redundant, this);
-        add_state(STATE_SEND_CREDIT, credit);
-        add_state(STATE_SEND_BUDGET, budget);
-        add_state(STATE_WAIT_ACK, ack);
-
-        /* add allowed transitions to state table */
-        add_trans(STATE_WAIT, EVENT_RX, STATE_SEND_CREDIT);
-        add_trans(STATE_WAIT, EVENT_COMPLETE, STATE_SEND_BUDGET);
-        add_trans(STATE_WAIT, EVENT_TIMEOUT, STATE_DONE);
-        add_trans(STATE_WAIT, EVENT_ACKED, STATE_DONE);
-        add_trans(STATE_SEND_CREDIT, EVENT_CREDIT_SENT, STATE_WAIT);
-        add_trans(STATE_SEND_CREDIT, EVENT_ACKED, STATE_DONE);
-        add_trans(STATE_SEND_CREDIT, EVENT_MAXED, STATE_WAIT_ACK);
-        add_trans(STATE_SEND_CREDIT, EVENT_RX, STATE_SEND_CREDIT);
-        add_trans(STATE_SEND_CREDIT, EVENT_COMPLETE, STATE_SEND_BUDGET);
-        add_trans(STATE_SEND_BUDGET, EVENT_ACKED, STATE_DONE);
-        add_trans(STATE_SEND_BUDGET, EVENT_BUDGET_SENT, STATE_WAIT_ACK);
-        add_trans(STATE_WAIT_ACK, EVENT_ACKED, STATE_DONE);
-        add_trans(STATE_WAIT_ACK, EVENT_TIMEOUT, STATE_DONE);
-        add_trans(STATE_WAIT_ACK, EVENT_RX, STATE_WAIT_ACK);
-        add_trans(STATE_WAIT_ACK, EVENT_COMPLETE, STATE_WAIT_ACK);
-        add_trans(STATE_DONE, EVENT_ACKED, STATE_DONE);
-        add_trans(STATE_DONE, EVENT_RX, STATE_DONE);
+        states::init(m_coder, s_table);
     }
 
     /**
@@ -193,6 +262,45 @@ class full_rlnc_recoder_deep
      */
     bool process();
 
+    /**
+     * release_storage() - free coding buffers of a freed recoder
+     *
+     * Called by coder_map once no other thread uses the recoder, so that
+     * pooled objects don't keep their buffers.
+     */
+    void release_storage()
+    {
+        guard g(m_lock);
+
+        this->release_staging();
+        this->release_coefficients();
+        this->release_symbols();
+    }
+
+    /**
+     * eviction_score() - Return how useful it is to keep the recoder
+     *
+     * Used by coder_map to select a coder to free when the memory budget is
+     * exhausted. Coders with the lowest score are freed first, and coders
+     * scoring SIZE_MAX are never freed.
+     */
+    size_t eviction_score()
+    {
+        switch (curr_state()) {
+            case STATE_DONE:
+                return 0;
+            case STATE_WAIT:
+                return this->rank() + (is_stale() ? 0 : this->symbols());
+            default:
+                return SIZE_MAX;
+        }
+    }
+
+    /**
+     * storage_size() - Return bytes of coding buffers used by one recoder
+     */
+    static size_t storage_size(size_t symbols, size_t symbol_size);
+
     /**
      * is_valid() - return if recoder is open for more packets
      */
@@ -202,6 +310,17 @@ class full_rlnc_recoder_deep
     }
 };
 
+template<class Field>
+constexpr states::transition full_rlnc_recoder_deep<Field>::s_transitions[];
+
+template<class Field>
+constexpr states::handler_func full_rlnc_recoder_deep<Field>::s_handlers[];
+
+template<class Field>
+constexpr states::state_table<full_rlnc_recoder_deep<Field>::STATE_NUM,
+                              full_rlnc_recoder_deep<Field>::EVENT_NUM>
+    full_rlnc_recoder_deep<Field>::s_table;
+
 typedef full_rlnc_recoder_deep<rlnc_field> recoder;
 
 #endif
@@ -0,0 +1,152 @@
+/* Copyright 2013 Martin Hundebøll <martin@hundeboll.net> */
+
+#ifndef FOX_REQUEST_SCHEDULER_HPP_
+#define FOX_REQUEST_SCHEDULER_HPP_
+
+#include <arpa/inet.h>
+#include <mutex>
+#include <map>
+#include <vector>
+
+#include "fox.hpp"
+#include "key.hpp"
+
+/* maximum number of requests carried by one frame */
+#define REQ_FRAME_ENTRIES 64
+
+/**
+ * struct req_entry - request for more data in one generation
+ * @block: block id of the generation
+ * @rank: rank of the generation at the requesting decoder
+ * @seq: sequence number of the request, used to drop repetitions
+ *
+ * All fields are in network byte order when carried in a frame.
+ */
+struct req_entry {
+    uint16_t block;
+    uint16_t rank;
+    uint16_t seq;
+} __attribute__((packed));
+
+/**
+ * struct req_frame - requests for one flow to send in one frame
+ * @flow: source and destination of the flow
+ * @reqs: requests in network byte order
+ */
+struct req_frame {
+    key flow;
+    std::vector<req_entry> reqs;
+};
+
+/**
+ * class request_scheduler - collect repair requests per flow
+ *
+ * Decoders schedule requests for their stalled generations instead of sending
+ * them directly. The scheduler is emptied periodically, and the requests of
+ * all stalled generations of a flow are sent together as (block, rank, seq)
+ * entries. A request stays pending for the number of rounds it was scheduled
+ * with, unless it is replaced by a newer request or cancelled because the
+ * generation was decoded.
+ */
+class request_scheduler
+{
+    struct pending {
+        uint16_t rank, seq;
+        size_t copies;
+    };
+
+    typedef std::map<size_t, pending> block_map;
+    typedef std::map<key, block_map> flow_map;
+
+    std::mutex m_lock;
+    flow_map m_flows;
+
+  public:
+    /**
+     * add() - schedule request for a generation
+     * @param k Key of the stalled generation.
+     * @param rank Current rank of the generation.
+     * @param seq Sequence number of the request.
+     * @param copies Number of rounds to include the request in.
+     */
+    void add(const key &k, uint16_t rank, uint16_t seq, size_t copies)
+    {
+        key flow(k.src, k.dst, 0);
+
+        guard g(m_lock);
+
+        pending &p(m_flows[flow][k.block]);
+        p.rank = rank;
+        p.seq = seq;
+        p.copies = copies;
+    }
+
+    /**
+     * cancel() - remove pending request for a generation
+     * @param k Key of the generation.
+     */
+    void cancel(const key &k)
+    {
+        key flow(k.src, k.dst, 0);
+        flow_map::iterator f;
+
+        guard g(m_lock);
+
+        if ((f = m_flows.find(flow)) == m_flows.end())
+            return;
+
+        f->second.erase(k.block);
+
+        if (f->second.empty())
+            m_flows.erase(f);
+    }
+
+    /**
+     * pop() - take one round of requests
+     *
+     * Returns a frame for each flow with pending requests, split in more
+     * frames if a flow has more than REQ_FRAME_ENTRIES stalled generations.
+     */
+    std::vector<req_frame> pop()
+    {
+        std::vector<req_frame> frames;
+        flow_map::iterator f;
+        block_map::iterator b;
+        req_frame *frame;
+        req_entry e;
+
+        guard g(m_lock);
+
+        for (f = m_flows.begin(); f != m_flows.end();) {
+            block_map &blocks(f->second);
+            frame = NULL;
+
+            for (b = blocks.begin(); b != blocks.end();) {
+                if (!frame || frame->reqs.size() == REQ_FRAME_ENTRIES) {
+                    frames.push_back(req_frame());
+                    frame = &frames.back();
+                    frame->flow = f->first;
+                }
+
+                e.block = htons(b->first);
+                e.rank = htons(b->second.rank);
+                e.seq = htons(b->second.seq);
+                frame->reqs.push_back(e);
+
+                if (--b->second.copies == 0)
+                    blocks.erase(b++);
+                else
+                    ++b;
+            }
+
+            if (blocks.empty())
+                m_flows.erase(f++);
+            else
+                ++f;
+        }
+
+        return frames;
+    }
+};
+
+#endif
@@ -0,0 +1,213 @@
+/* Copyright 2013 Martin Hundebøll <martin@hundeboll.net> */
+
+#include <chrono>
+#include <vector>
+#include <cstdlib>
+
+#include "self_benchmark.hpp"
+#include "field_math.hpp"
+#include "coder_stacks.hpp"
+
+DECLARE_double(self_benchmark_time);
+DECLARE_bool(deferred_decoding);
+
+using namespace kodo;
+
+/**
+ * class bench_encoder - the encoder stack of class encoder with selectable
+ * field arithmetic and without the fox coder parts.
+ */
+template<class Math>
+class bench_encoder : public encoder_stack<Math, bench_encoder<Math> >
+{};
+
+/**
+ * class bench_decoder - the decoder stack of class decoder with selectable
+ * field arithmetic and without the fox coder parts.
+ */
+template<class Math>
+class bench_decoder : public decoder_stack<Math, bench_decoder<Math> >
+{};
+
+/**
+ * class bench_unaligned_decoder - decoder stack like bench_decoder, but
+ * with kodo's default storage, where symbols are packed back to back
+ * without alignment.
+ */
+template<class Math>
+class bench_unaligned_decoder
+    : public payload_decoder<
+             systematic_decoder<
+             systematic_decoder_info<
+             symbol_id_decoder<
+             plain_symbol_id_reader<
+             deferred_decoder<
+             aligned_coefficients_decoder<
+             linear_block_decoder<
+             coefficient_storage<
+             coefficient_info<
+             deep_symbol_storage<
+             storage_bytes_used<
+             storage_block_info<
+             finite_field_math<Math,
+             finite_field_info<typename Math::field_type,
+             final_coder_factory<
+             bench_unaligned_decoder<Math>
+                 > > > > > > > > > > > > > > > >
+{};
+
+struct bench_result
+{
+    double encode_rate;
+    double decode_rate;
+};
+
+/**
+ * run_kernel() - encode and decode generations for the given duration
+ * @param aligned Whether to pad encoder symbols to aligned boundaries. The
+ *                decoder type decides the alignment of decoder symbols.
+ */
+template<class Math, class Decoder>
+bench_result run_kernel(size_t symbols, size_t symbol_size, double duration,
+                        bool aligned)
+{
+    typedef std::chrono::high_resolution_clock timer;
+    typedef std::chrono::duration<double> seconds;
+
+    typename bench_encoder<Math>::factory enc_factory(symbols, symbol_size);
+    typename Decoder::factory dec_factory(symbols, symbol_size);
+    typename bench_encoder<Math>::pointer enc;
+    typename Decoder::pointer dec;
+    size_t stride = aligned ? align_up(symbol_size) : symbol_size;
+    aligned_ptr data(aligned_allocate(symbols * stride + 1));
+    uint8_t *symbol_data = data.get() + (aligned ? 0 : 1);
+    std::vector<uint8_t> payloads;
+    seconds enc_time(0), dec_time(0);
+    size_t generations = 0, count, payload_size;
+    timer::time_point start;
+    bench_result res;
+
+    for (size_t i = 0; i < symbols * stride + 1; i++)
+        data.get()[i] = rand();
+
+    do {
+        enc = enc_factory.build();
+        dec = dec_factory.build();
+        dec->set_deferred(FLAGS_deferred_decoding);
+        enc->set_systematic_off();
+
+        for (size_t i = 0; i < symbols; i++) {
+            sak::mutable_storage s(symbol_data + i * stride, symbol_size);
+            enc->set_symbol(i, s);
+        }
+
+        /* encode a few more packets than needed to decode */
+        payload_size = enc->payload_size();
+        count = symbols + symbols/10 + 1;
+        payloads.resize(count * payload_size);
+
+        start = timer::now();
+        for (size_t i = 0; i < count; i++)
+            enc->encode(&payloads[i * payload_size]);
+        enc_time += timer::now() - start;
+
+        start = timer::now();
+        for (size_t i = 0; i < count && !dec->is_complete(); i++)
+            dec->decode(&payloads[i * payload_size]);
+        dec_time += timer::now() - start;
+
+        generations++;
+    } while (enc_time.count() + dec_time.count() < duration);
+
+    res.encode_rate = generations * symbols * symbol_size /
+        enc_time.count() / 1e6;
+    res.decode_rate = generations * symbols * symbol_size /
+        dec_time.count() / 1e6;
+
+    return res;
+}
+
+/**
+ * kb_rate() - convert rate in MB/s to KB/s for the integer counters
+ */
+static size_t kb_rate(double rate)
+{
+    return rate*1000 + .5;
+}
+
+template<class Math>
+void bench_kernel(size_t symbols, size_t symbol_size, counters::pointer counts,
+                  std::string &best, double &best_rate)
+{
+    std::string name(math_name<Math>::get());
+    bench_result res;
+
+    res = run_kernel<Math, bench_decoder<Math>>(
+            symbols, symbol_size, FLAGS_self_benchmark_time, true);
+
+    LOG(INFO) << "Self benchmark: " << name << ": encode "
+              << res.encode_rate << " MB/s, decode "
+              << res.decode_rate << " MB/s";
+
+    counts->set("self benchmark " + name + " encode KB/s",
+                kb_rate(res.encode_rate));
+    counts->set("self benchmark " + name + " decode KB/s",
+                kb_rate(res.decode_rate));
+
+    /* decoding is the bottleneck, so use it to pick the best kernel */
+    if (res.decode_rate > best_rate) {
+        best_rate = res.decode_rate;
+        best = name;
+    }
+}
+
+/**
+ * bench_alignment() - compare aligned and unaligned symbol storage
+ */
+template<class Math>
+void bench_alignment(size_t symbols, size_t symbol_size,
+                     counters::pointer counts)
+{
+    bench_result aligned, unaligned;
+
+    aligned = run_kernel<Math, bench_decoder<Math>>(
+            symbols, symbol_size, FLAGS_self_benchmark_time, true);
+    unaligned = run_kernel<Math, bench_unaligned_decoder<Math>>(
+            symbols, symbol_size, FLAGS_self_benchmark_time, false);
+
+    LOG(INFO) << "Self benchmark: aligned: encode " << aligned.encode_rate
+              << " MB/s, decode " << aligned.decode_rate << " MB/s";
+    LOG(INFO) << "Self benchmark: unaligned: encode " << unaligned.encode_rate
+              << " MB/s, decode " << unaligned.decode_rate << " MB/s";
+
+    counts->set("self benchmark aligned encode KB/s",
+                kb_rate(aligned.encode_rate));
+    counts->set("self benchmark aligned decode KB/s",
+                kb_rate(aligned.decode_rate));
+    counts->set("self benchmark unaligned encode KB/s",
+                kb_rate(unaligned.encode_rate));
+    counts->set("self benchmark unaligned decode KB/s",
+                kb_rate(unaligned.decode_rate));
+}
+
+std::string self_benchmark(size_t symbols, size_t symbol_size,
+                           counters::pointer counts)
+{
+    std::string best;
+    double best_rate = 0;
+
+    bench_alignment<fox_math<fifi::binary8>::type>(symbols, symbol_size,
+                                                   counts);
+
+    bench_kernel<fifi::full_table<fifi::binary8>>(symbols, symbol_size,
+                                                  counts, best, best_rate);
+    bench_kernel<fifi::log_table<fifi::binary8>>(symbols, symbol_size,
+                                                 counts, best, best_rate);
+    bench_kernel<fifi::extended_log_table<fifi::binary8>>(symbols,
+                                                          symbol_size, counts,
+                                                          best, best_rate);
+    bench_kernel<fifi::simple_online<fifi::binary8>>(symbols, symbol_size,
+                                                     counts, best, best_rate);
+
+    return best;
+}
@@ -0,0 +1,27 @@
+/* Copyright 2013 Martin Hundebøll <martin@hundeboll.net> */
+
+#ifndef FOX_SELF_BENCHMARK_HPP_
+#define FOX_SELF_BENCHMARK_HPP_
+
+#include <string>
+
+#include "fox.hpp"
+#include "counters.hpp"
+
+/**
+ * self_benchmark() - measure coding throughput of field kernels on this CPU
+ * @param symbols Generation size to use.
+ * @param symbol_size Symbol size to use.
+ * @param counts Counters to report results to.
+ *
+ * Encodes and decodes generations with the encoder and decoder stacks of
+ * the coders for every available field arithmetic implementation, and
+ * reports encode/decode rates in KB/s for each of them. Also compares
+ * aligned and unaligned symbol storage with the kernel in use.
+ *
+ * Returns the name of the fastest kernel.
+ */
+std::string self_benchmark(size_t symbols, size_t symbol_size,
+                           counters::pointer counts);
+
+#endif
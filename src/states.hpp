@@ -5,72 +5,239 @@
 
 #include <thread>
 #include <atomic>
-#include <mutex>
 #include <cstdio>
-#include <functional>
-#include <vector>
+
+#include "futex.hpp"
 
 /**
  * class states - state machine to use in coders
+ *
+ * Each coder type declares its states and transitions in constexpr tables
+ * that are checked at compile time and shared by all coders of the type.
+ * The current and next state are kept in a single atomic word, so events are
+ * dispatched with a compare-and-swap, and the state thread sleeps on the word
+ * with a futex while no transition is pending.
  */
 class states
 {
-    std::condition_variable m_cond_var;
-    std::mutex m_cond_lock, m_event_lock;
-    typedef std::unique_lock<std::mutex> unique_lock;
-    std::atomic<bool> m_running;
+  public:
+    typedef uint8_t state_type;
+    typedef uint8_t event_type;
+    typedef void (*handler_func)(states *);
+    enum { __STATE_INVALID = 0, __STATE_WAIT, __STATE_DONE, __STATE_NUM };
+    enum { __EVENT_NUM };
+
+    /**
+     * struct transition - allowed transition between states
+     * @from: state to come from
+     * @event: event to change state
+     * @to: state to enter when receiving the event in the from state
+     */
+    struct transition {
+        state_type from;
+        event_type event;
+        state_type to;
+    };
+
+    /* list of numbers used to expand tables at compile time */
+    template<size_t... I>
+    struct index_list {};
+
+    template<size_t N, size_t... I>
+    struct make_index_list : make_index_list<N - 1, N - 1, I...> {};
+
+    template<size_t... I>
+    struct make_index_list<0, I...> {
+        typedef index_list<I...> type;
+    };
+
+    /**
+     * lookup() - return state to enter from a list of transitions
+     *
+     * Returns __STATE_INVALID if the transition is not in the list.
+     */
+    static constexpr state_type lookup(const transition *t, size_t n,
+                                       size_t from, size_t event)
+    {
+        return n == 0 ? static_cast<state_type>(__STATE_INVALID) :
+               t->from == from && t->event == event ? t->to :
+               lookup(t + 1, n - 1, from, event);
+    }
+
+    /**
+     * count() - return number of times a transition is in a list
+     */
+    static constexpr size_t count(const transition *t, size_t n,
+                                  size_t from, size_t event)
+    {
+        return n == 0 ? 0 :
+               (t->from == from && t->event == event) +
+               count(t + 1, n - 1, from, event);
+    }
+
+    /**
+     * valid() - check that a list of transitions fits the tables
+     * @param t List of transitions.
+     * @param n Number of transitions in list.
+     * @param s Number of states.
+     * @param e Number of events.
+     *
+     * Returns false if a transition uses unknown states or events, or if
+     * a state has more than one transition for the same event.
+     */
+    static constexpr bool valid(const transition *t, size_t n, size_t s,
+                                size_t e)
+    {
+        return n == 0 ||
+               (t->from < s && t->to < s && t->event < e &&
+                t->from != __STATE_INVALID && t->to != __STATE_INVALID &&
+                count(t + 1, n - 1, t->from, t->event) == 0 &&
+                valid(t + 1, n - 1, s, e));
+    }
+
+    /**
+     * struct state_table - handlers and transitions of a coder type
+     * @param S Number of states.
+     * @param E Number of events.
+     * @next: state to enter for each state and event, indexed by
+     *        state*E + event
+     * @handlers: function called when entering each state
+     */
+    template<size_t S, size_t E>
+    struct state_table {
+        state_type next[S*E];
+        handler_func handlers[S];
+
+        template<size_t... I, size_t... H>
+        constexpr state_table(const transition *t, size_t n,
+                              const handler_func *h, index_list<I...>,
+                              index_list<H...>)
+            : next{lookup(t, n, I/E, I%E)...}, handlers{h[H]...}
+        {}
+
+        /**
+         * state_table() - expand list of transitions into a table
+         * @param t List of transitions; all others are invalid.
+         * @param n Number of transitions in the list.
+         * @param h Handler of each state.
+         */
+        constexpr state_table(const transition *t, size_t n,
+                              const handler_func *h)
+            : state_table(t, n, h, typename make_index_list<S*E>::type(),
+                          typename make_index_list<S>::type())
+        {}
+    };
+
+  protected:
+    /**
+     * call() - call member function of coder as state handler
+     */
+    template<class C, void (C::*F)()>
+    static void call(states *s)
+    {
+        (static_cast<C *>(s)->*F)();
+    }
+
+    static void wait_state(states *s)
+    {
+        s->wait();
+    }
+
+    static void invalid_state(states *s)
+    {
+        s->invalid();
+    }
+
+  private:
+    /* layout of m_word */
+    enum : uint32_t {
+        CURR_SHIFT = 0,
+        NEXT_SHIFT = 8,
+        STATE_MASK = 0xff,
+        STOP_BIT = 1 << 16,
+    };
+
+    std::atomic<uint32_t> m_word;
+    std::atomic<const handler_func *> m_handlers;
+    const state_type *m_next;
+    size_t m_events;
     std::thread m_state_thread;
     size_t m_coder_num;
 
+    static state_type curr(uint32_t w)
+    {
+        return (w >> CURR_SHIFT) & STATE_MASK;
+    }
+
+    static state_type next(uint32_t w)
+    {
+        return (w >> NEXT_SHIFT) & STATE_MASK;
+    }
+
+    static uint32_t with_next(uint32_t w, state_type s)
+    {
+        return (w & ~(STATE_MASK << NEXT_SHIFT)) | (s << NEXT_SHIFT);
+    }
+
+    static const handler_func *default_handlers()
+    {
+        static const handler_func h[__STATE_NUM] = {
+            &states::invalid_state,
+            &states::wait_state,
+            &states::wait_state,
+        };
+
+        return h;
+    }
+
     /**
      * thread_func() - main loop for state thread
      */
     void thread_func()
     {
-        while (m_running) {
-            m_state_table[m_curr_state]();
-            m_curr_state = m_next_state.load();
+        uint32_t w;
+
+        while (!((w = m_word.load()) & STOP_BIT)) {
+            m_handlers.load()[curr(w)](this);
+
+            /* enter next state; events may change it meanwhile */
+            w = m_word.load();
+            while (!m_word.compare_exchange_weak(w, (w & ~STATE_MASK) |
+                                                    next(w)))
+                ;
         }
     }
 
-    /**
-     * _stop_waiting() - signal _wait() to stop waiting
-     */
-    void stop_waiting()
+    void invalid()
     {
-        guard g(m_cond_lock);
-        m_cond_var.notify_one();
+        LOG(FATAL) << "Coder " << m_coder_num << ": Entered invalid state";
     }
 
-    void invalid()
+    /**
+     * change() - set next state and wake state thread
+     */
+    void change(uint32_t w, state_type s)
     {
-        LOG(FATAL) << "Coder " << m_coder_num << ": Entered invalid state";
+        while (!m_word.compare_exchange_weak(w, with_next(w, s)))
+            ;
+
+        futex_wake(&m_word, 1);
     }
 
   protected:
-    typedef std::function<void ()> handler_func;
-    typedef uint8_t state_type;
-    typedef uint8_t event_type;
-    enum { __STATE_INVALID = 0, __STATE_WAIT, __STATE_DONE, __STATE_NUM };
-    enum { __EVENT_NUM };
-
     /**
      * states() - construct new state machine object
      *
-     * Does an initial allocation for state table and transition table and starts
-     * the local thread for changing and running states.
+     * Starts the local thread for changing and running states with only
+     * the default states. Coders must call init() with their own table.
      */
     states() :
-        m_running(true),
-        m_curr_state(__STATE_WAIT),
-        m_next_state(__STATE_WAIT),
-        m_state_table(__STATE_NUM)
+        m_word(__STATE_WAIT << CURR_SHIFT | __STATE_WAIT << NEXT_SHIFT),
+        m_handlers(default_handlers()),
+        m_next(NULL),
+        m_events(0),
+        m_coder_num(0)
     {
-        /* add default states */
-        add_state(__STATE_WAIT, std::bind(&states::wait, this));
-        add_state(__STATE_DONE, std::bind(&states::wait, this));
-        add_state(__STATE_INVALID, std::bind(&states::invalid, this));
-
         /* start state thread */
         m_state_thread = std::thread(&states::thread_func, this);
     }
@@ -80,11 +247,12 @@ class states
      */
     ~states()
     {
+        uint32_t w = m_word.fetch_or(STOP_BIT);
+
         VLOG(LOG_OBJ) << "Coder " << m_coder_num << ": Destructed (state "
-                      << static_cast<int>(m_curr_state) << ", next "
-                      << static_cast<int>(m_next_state) << ")";
-        m_running = false;
-        stop_waiting();
+                      << static_cast<int>(curr(w)) << ", next "
+                      << static_cast<int>(next(w)) << ")";
+        futex_wake(&m_word);
         m_state_thread.join();
     }
 
@@ -93,92 +261,70 @@ class states
      */
     void wait()
     {
-        unique_lock l(m_cond_lock);
-
-        while (m_curr_state == m_next_state && m_running)
-            m_cond_var.wait(l);
-    }
-
-    /* init() - reallocate state and transition tables
-     * s_num: number of states to prepare for
-     * e_num: number of events for prepare for
-     *
-     * Resizes the state and transition tables to the passed sizes and
-     * initializes all transitions as invalid. Use _add_state() to add
-     * states and use _add_trans() to add non-invalid transitions.
-     */
-    void init(size_t coder_num, state_type s_num, event_type e_num)
-    {
-        guard g(m_event_lock);
+        uint32_t w;
 
-        m_coder_num = coder_num;
-        m_state_table.resize(s_num);
-        m_trans_table.resize(s_num, std::vector<state_type>(e_num,
-                                                            __STATE_INVALID));
-    }
+        while (true) {
+            w = m_word.load();
 
-    /**
-     * add_state() - add a new state to the state table
-     * s: number for the added state
-     * handler: function to call when entering the state
-     */
-    void add_state(state_type s, handler_func handler)
-    {
-        guard g(m_event_lock);
+            if (curr(w) != next(w) || (w & STOP_BIT))
+                return;
 
-        m_state_table[s] = handler;
+            futex_wait(&m_word, w);
+        }
     }
 
     /**
-     * add_trans() - mark a transition as valid
-     * from: state to come from
-     * event: event to change state
-     * to: state to enter when receiving the passed event
-     *
-     * Overrides the entry in the transition table at the passed state and event
-     * with the state to enter.
+     * init() - use state table of coder type
+     * @param coder_num Number of coder for logging.
+     * @param table Table shared by all coders of the type.
      */
-    void add_trans(state_type from, event_type event, state_type to)
+    template<size_t S, size_t E>
+    void init(size_t coder_num, const state_table<S, E> &table)
     {
-        guard g(m_event_lock);
+        static_assert(S > __STATE_DONE && S <= STATE_MASK,
+                      "state table must include the default states");
 
-        m_trans_table[from][event] = to;
+        m_coder_num = coder_num;
+        m_next = table.next;
+        m_events = E;
+        m_handlers = table.handlers;
     }
 
     /**
      * dispatch_event() - signal state machine to change state
      * event: ID of event to dispatch
      *
-     * Reads the next state from the transition table and checks if it is
-     * valid and sets the next state accordingly, before signaling the state
-     * thread to stop waiting.
+     * Reads the next state from the transition table and sets it as next
+     * state, unless a transition is already pending, before waking the
+     * state thread. Invalid events make the coder enter __STATE_DONE.
      */
     void dispatch_event(event_type event)
     {
-        guard g(m_event_lock);
+        uint32_t w = m_word.load();
+        state_type to;
 
-        if (m_curr_state.load() != m_next_state.load())
-            return;
+        do {
+            /* ignore event if state is about to change */
+            if (curr(w) != next(w))
+                return;
 
-        /* read next state */
-        m_next_state = m_trans_table[m_curr_state][event];
+            to = m_next[curr(w)*m_events + event];
 
-        /* check if next state if valid */
-        if (m_next_state == __STATE_INVALID) {
-            LOG(ERROR) << "Coder " << m_coder_num
-                        << ": Invalid event: current state "
-                        << static_cast<int>(m_curr_state)
-                        << ", event: " << static_cast<int>(event);
-            m_next_state = __STATE_DONE;
-        }
+            if (to == __STATE_INVALID)
+                to = __STATE_DONE;
+        } while (!m_word.compare_exchange_weak(w, with_next(w, to)));
+
+        LOG_IF(ERROR, m_next[curr(w)*m_events + event] == __STATE_INVALID)
+            << "Coder " << m_coder_num << ": Invalid event: current state "
+            << static_cast<int>(curr(w)) << ", event: "
+            << static_cast<int>(event);
 
         VLOG(LOG_STATE) << "Coder " << m_coder_num
                         << ": Event: " << static_cast<int>(event)
-                        << ", from state: " << static_cast<int>(m_curr_state)
-                        << ", to state: " << static_cast<int>(m_next_state);
+                        << ", from state: " << static_cast<int>(curr(w))
+                        << ", to state: " << static_cast<int>(to);
 
-        /* change to next state */
-        stop_waiting();
+        futex_wake(&m_word, 1);
     }
 
     /**
@@ -187,17 +333,13 @@ class states
      */
     void set_state(state_type s)
     {
-        guard g(m_event_lock);
-
-        m_next_state = s;
-        stop_waiting();
+        change(m_word.load(), s);
     }
 
   public:
     state_type curr_state()
     {
-        guard g(m_event_lock);
-        return m_curr_state;
+        return curr(m_word.load());
     }
 
     /**
@@ -205,14 +347,8 @@ class states
      */
     state_type next_state()
     {
-        guard g(m_event_lock);
-        return m_next_state;
+        return next(m_word.load());
     }
-
-  private:
-    std::atomic<state_type> m_curr_state, m_next_state;
-    std::vector<handler_func> m_state_table;
-    std::vector<std::vector<state_type>> m_trans_table;
 };
 
 #endif
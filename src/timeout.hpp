@@ -3,65 +3,57 @@
 #ifndef FOX_TIMEOUT_HPP_
 #define FOX_TIMEOUT_HPP_
 
-#include <chrono>
-#include <algorithm>
-#include <boost/circular_buffer.hpp>
+#include "coarse_clock.hpp"
 
 /**
  * class timeout - API used by coders to handle time.
+ *
+ * Timestamps and timeouts are kept as coarse_clock ticks, so updating a
+ * timestamp is a load of the cached clock and a store.
  */
 class timeout {
-    typedef std::chrono::high_resolution_clock timer;
-    typedef timer::time_point timestamp;
+    typedef coarse_clock::tick_type tick_type;
 
-    timestamp m_timestamp, m_last;
-    double m_timeout, m_pkt_timeout;
+    tick_type m_timestamp, m_last;
+    tick_type m_timeout, m_pkt_timeout;
 
   protected:
     void update_timestamp()
     {
-        m_timestamp = timer::now();
+        m_timestamp = coarse_clock::now();
     }
 
     void update_packet_timestamp()
     {
-        m_last = timer::now();
+        m_last = coarse_clock::now();
     }
 
   public:
-    timeout()
+    timeout() : m_timestamp(0), m_last(0), m_timeout(0), m_pkt_timeout(0)
     {}
 
     void init_timeout(const double t)
     {
-        m_last = timer::now();
-        m_timestamp = timer::now();
-        m_timeout = t;
+        m_timestamp = m_last = coarse_clock::now();
+        m_timeout = coarse_clock::ticks(t);
     }
 
     void set_pkt_timeout(double f)
     {
-        m_pkt_timeout = f;
+        m_pkt_timeout = coarse_clock::ticks(f);
     }
 
     /**
-     * is_timed_out() - Check if timer is timed out.
+     * check_timeout() - Check if more than t ticks have passed since ts.
      */
-    bool check_timeout(const timestamp &ts, double t) const
+    bool check_timeout(tick_type ts, tick_type t) const
     {
-        using std::chrono::duration;
-        using std::chrono::duration_cast;
-
-        duration<double> diff;
-        timestamp now = timer::now();
-        diff = duration_cast<duration<double>>(now - ts);
-
-        return (diff.count() > t);
+        return coarse_clock::since(ts) > t;
     }
 
     bool is_timed_out(double t) const
     {
-        return check_timeout(m_timestamp, t);
+        return check_timeout(m_timestamp, coarse_clock::ticks(t));
     }
 
     bool is_timed_out() const
@@ -69,6 +61,14 @@ class timeout {
         return check_timeout(m_timestamp, m_timeout);
     }
 
+    /**
+     * is_stale() - Check if half the timeout has passed without activity.
+     */
+    bool is_stale() const
+    {
+        return check_timeout(m_timestamp, m_timeout/2);
+    }
+
     bool packet_timed_out()
     {
         return check_timeout(m_last, m_pkt_timeout);
@@ -0,0 +1,166 @@
+/* Copyright 2013 Martin Hundebøll <martin@hundeboll.net> */
+
+#ifndef FOX_WORK_QUEUE_HPP_
+#define FOX_WORK_QUEUE_HPP_
+
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "fox.hpp"
+#include "mpmc_queue.hpp"
+
+/**
+ * class work_queue - worker threads fed by bounded lock-free queues
+ * @param T Type of work items.
+ *
+ * Each worker has its own queue, and items are assigned to workers by a hash
+ * chosen by the producer. Items with equal hashes are handled in order by
+ * the same worker, while items with different hashes can be handled in
+ * parallel.
+ *
+ * Producers never block: push() fails if the queue of the selected worker is
+ * full. Workers sleep on a condition variable when their queue is empty.
+ */
+template<class T>
+class work_queue
+{
+  public:
+    typedef std::function<void (T &)> handler_func;
+
+  private:
+    struct lane {
+        mpmc_queue<T> queue;
+        std::mutex lock;
+        std::condition_variable cond;
+        std::atomic<bool> idle;
+        std::thread thread;
+
+        explicit lane(size_t depth) : queue(depth), idle(false)
+        {}
+    };
+
+    std::vector<std::unique_ptr<lane>> m_lanes;
+    std::atomic<bool> m_running;
+    handler_func m_handler;
+
+    void run(lane *l)
+    {
+        std::chrono::milliseconds max_sleep(10);
+        T item;
+
+        while (m_running) {
+            if (l->queue.pop(item)) {
+                m_handler(item);
+
+                /* release resources held by the item right away */
+                item = T();
+                continue;
+            }
+
+            std::unique_lock<std::mutex> g(l->lock);
+
+            /* check again after announcing that we go to sleep, so that a
+             * push between the failed pop and now is not missed */
+            l->idle = true;
+            if (l->queue.size() == 0 && m_running)
+                l->cond.wait_for(g, max_sleep);
+            l->idle = false;
+        }
+    }
+
+  public:
+    work_queue() : m_running(false)
+    {}
+
+    ~work_queue()
+    {
+        stop();
+    }
+
+    /**
+     * start() - start worker threads
+     * @param workers Number of workers.
+     * @param depth Number of items each worker can have waiting.
+     * @param handler Function called by workers for each item.
+     */
+    void start(size_t workers, size_t depth, handler_func handler)
+    {
+        m_handler = handler;
+        m_running = true;
+
+        for (size_t i = 0; i < workers; i++) {
+            m_lanes.emplace_back(new lane(depth));
+            m_lanes.back()->thread = std::thread(&work_queue::run, this,
+                                                 m_lanes.back().get());
+        }
+    }
+
+    /**
+     * stop() - stop workers; items still waiting are discarded
+     */
+    void stop()
+    {
+        if (!m_running)
+            return;
+
+        m_running = false;
+
+        for (auto &l : m_lanes) {
+            {
+                guard g(l->lock);
+                l->cond.notify_one();
+            }
+            l->thread.join();
+        }
+
+        m_lanes.clear();
+    }
+
+    /**
+     * push() - add item to the queue of a worker
+     * @param hash Value used to select the worker.
+     * @param item Item to add; only moved from if it was added.
+     *
+     * Returns false if the queue of the selected worker is full.
+     */
+    bool push(size_t hash, T &&item)
+    {
+        lane *l = m_lanes[hash % m_lanes.size()].get();
+
+        if (!l->queue.push(std::move(item)))
+            return false;
+
+        if (l->idle) {
+            guard g(l->lock);
+            l->cond.notify_one();
+        }
+
+        return true;
+    }
+
+    /**
+     * depth() - return number of items waiting in all queues
+     */
+    size_t depth() const
+    {
+        size_t d = 0;
+
+        for (auto &l : m_lanes)
+            d += l->queue.size();
+
+        return d;
+    }
+
+    size_t workers() const
+    {
+        return m_lanes.size();
+    }
+};
+
+#endif
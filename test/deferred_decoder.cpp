@@ -0,0 +1,254 @@
+/*
+ * Check partial delivery from the deferred decoder while symbols are staged.
+ *
+ * The decoder below the deferred layer is replaced by a small Gauss-Jordan
+ * decoder over GF(2^8), so that the test only needs fifi.
+ *
+ * Build and run with:
+ *   make check
+ */
+
+#include <iostream>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+
+#include "deferred_decoder.hpp"
+
+static int failed;
+
+#define EXPECT(cond) \
+    do { \
+        if (!(cond)) { \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": Expected " \
+                      << #cond << std::endl; \
+            failed++; \
+        } \
+    } while (0)
+
+/* multiply in GF(2^8) with the polynomial x^8 + x^4 + x^3 + x^2 + 1 */
+static uint8_t gf_mul(uint8_t a, uint8_t b)
+{
+    uint8_t p = 0;
+
+    for (; b; b >>= 1) {
+        if (b & 1)
+            p ^= a;
+
+        a = (a << 1) ^ (a & 0x80 ? 0x1d : 0);
+    }
+
+    return p;
+}
+
+/**
+ * class reference_decoder - decoder eliminating payloads on arrival
+ *
+ * Stands in for the kodo layers below deferred_decoder. Rows are kept in
+ * reduced echelon form, so a symbol is decoded when its row is a unit
+ * vector.
+ */
+class reference_decoder
+{
+    uint32_t m_symbols, m_symbol_size, m_rank;
+    std::vector<uint8_t> m_data, m_coefficients;
+    std::vector<bool> m_pivots;
+
+    uint8_t *row(uint32_t i)
+    {
+        return &m_coefficients[i*m_symbols];
+    }
+
+    void subtract_row(uint8_t *coefficients, uint8_t *data, uint32_t i,
+                      uint8_t c)
+    {
+        multiply_subtract(coefficients, row(i), c, m_symbols);
+        multiply_subtract(data, symbol(i), c, m_symbol_size);
+    }
+
+  public:
+    typedef fifi::binary8 field_type;
+    typedef uint8_t value_type;
+
+    struct factory {
+        uint32_t symbols, symbol_size;
+
+        factory(uint32_t s, uint32_t size) : symbols(s), symbol_size(size)
+        {}
+    };
+
+    void initialize(const factory &f)
+    {
+        m_symbols = f.symbols;
+        m_symbol_size = f.symbol_size;
+        m_rank = 0;
+        m_data.assign(m_symbols*m_symbol_size, 0);
+        m_coefficients.assign(m_symbols*m_symbols, 0);
+        m_pivots.assign(m_symbols, false);
+    }
+
+    uint32_t symbols() const { return m_symbols; }
+    uint32_t symbol_size() const { return m_symbol_size; }
+    uint32_t coefficients_size() const { return m_symbols; }
+    uint32_t coefficients_length() const { return m_symbols; }
+    uint32_t rank() const { return m_rank; }
+
+    uint8_t *symbol(uint32_t i)
+    {
+        return &m_data[i*m_symbol_size];
+    }
+
+    void multiply(value_type *v, value_type c, uint32_t length)
+    {
+        for (uint32_t i = 0; i < length; i++)
+            v[i] = gf_mul(v[i], c);
+    }
+
+    void multiply_subtract(value_type *v, const value_type *w, value_type c,
+                           uint32_t length)
+    {
+        for (uint32_t i = 0; i < length; i++)
+            v[i] ^= gf_mul(w[i], c);
+    }
+
+    value_type invert(value_type c)
+    {
+        for (uint32_t i = 1; i < 256; i++)
+            if (gf_mul(c, i) == 1)
+                return i;
+
+        return 0;
+    }
+
+    void decode(uint8_t *symbol_data, uint8_t *coefficients)
+    {
+        std::vector<uint8_t> c(coefficients, coefficients + m_symbols);
+        std::vector<uint8_t> d(symbol_data, symbol_data + m_symbol_size);
+        uint32_t p;
+
+        for (uint32_t i = 0; i < m_symbols; i++)
+            if (m_pivots[i] && c[i])
+                subtract_row(&c[0], &d[0], i, c[i]);
+
+        for (p = 0; p < m_symbols && !c[p]; p++)
+            ;
+
+        if (p == m_symbols)
+            return;
+
+        multiply(&d[0], invert(c[p]), m_symbol_size);
+        multiply(&c[0], invert(c[p]), m_symbols);
+        memcpy(row(p), &c[0], m_symbols);
+        memcpy(symbol(p), &d[0], m_symbol_size);
+        m_pivots[p] = true;
+        m_rank++;
+
+        /* keep other rows reduced */
+        for (uint32_t i = 0; i < m_symbols; i++)
+            if (i != p && m_pivots[i] && row(i)[p])
+                subtract_row(row(i), symbol(i), p, row(i)[p]);
+    }
+
+    void decode_symbol(uint8_t *symbol_data, uint32_t index)
+    {
+        std::vector<uint8_t> c(m_symbols, 0);
+
+        c[index] = 1;
+        decode(symbol_data, &c[0]);
+    }
+
+    bool is_decoded(uint32_t i)
+    {
+        for (uint32_t j = 0; j < m_symbols; j++)
+            if (row(i)[j] != (i == j))
+                return false;
+
+        return m_pivots[i];
+    }
+
+    /* like kodo: the first rank() symbols are decoded */
+    bool is_partial_complete()
+    {
+        for (uint32_t i = 0; i < m_rank; i++)
+            if (!is_decoded(i))
+                return false;
+
+        return true;
+    }
+};
+
+typedef kodo::deferred_decoder<reference_decoder> test_decoder;
+
+int main()
+{
+    const uint32_t g = 4, size = 32;
+    std::vector<std::vector<uint8_t> > src(g, std::vector<uint8_t>(size));
+    std::vector<uint8_t> coded(size, 0), coefficients(g);
+    test_decoder d;
+
+    srand(1);
+
+    for (auto &s : src)
+        for (auto &b : s)
+            b = rand();
+
+    d.initialize(test_decoder::factory(g, size));
+
+    /* two systematic symbols are decoded on arrival */
+    d.decode_symbol(&src[0][0], 0);
+    d.decode_symbol(&src[1][0], 1);
+
+    /* a coded symbol over the full generation is staged */
+    for (uint32_t i = 0; i < g; i++) {
+        coefficients[i] = rand() % 255 + 1;
+
+        for (uint32_t j = 0; j < size; j++)
+            coded[j] ^= gf_mul(src[i][j], coefficients[i]);
+    }
+
+    d.decode(&coded[0], &coefficients[0]);
+
+    EXPECT(d.staged() == 1);
+    EXPECT(d.rank() == 3);
+    EXPECT(d.decoded_rank() == 2);
+    EXPECT(d.is_partial_complete());
+
+    /* partial delivery must stop before the staged symbol */
+    EXPECT(!d.is_decoded(2));
+
+    for (uint32_t i = 0; i < d.decoded_rank(); i++)
+        EXPECT(memcmp(d.symbol(i), &src[i][0], size) == 0);
+
+    /* the staged symbol can't be decoded before the last one arrives */
+    d.flush();
+    EXPECT(d.staged() == 0);
+    EXPECT(d.decoded_rank() == 3);
+    EXPECT(!d.is_partial_complete());
+
+    d.decode_symbol(&src[3][0], 3);
+    EXPECT(d.is_complete());
+
+    for (uint32_t i = 0; i < g; i++)
+        EXPECT(memcmp(d.symbol(i), &src[i][0], size) == 0);
+
+    /* without deferring, symbols are decoded on arrival */
+    d.initialize(test_decoder::factory(g, size));
+    d.set_deferred(false);
+    d.decode_symbol(&src[0][0], 0);
+    d.decode(&coded[0], &coefficients[0]);
+    d.decode(&coded[0], &coefficients[0]);
+
+    EXPECT(d.staged() == 0);
+    EXPECT(d.rank() == 2);
+    EXPECT(d.decoded_rank() == 2);
+
+    if (failed) {
+        std::cerr << "deferred_decoder: " << failed << " checks failed"
+                  << std::endl;
+        return 1;
+    }
+
+    std::cout << "deferred_decoder: ok" << std::endl;
+
+    return 0;
+}
@@ -1,138 +1,36 @@
 /*
  * Compile with:
- *   g++ -std=c++11 budgets.cpp -o budgets
+ *   g++ -std=c++11 -I ../src budgets.cpp -o budgets
  *
  * And run it with four arguments:
  *   ./budgets <g> <e1> <e2> <e3>
+ *
+ * Or check the scaled budgets used by fox against the formulas:
+ *   ./budgets --check <g>
  */
 
 #include <iostream>
-#include <limits>
+#include <string>
 #include <stdlib.h>
 #include <math.h>
 
-#define ONE 255
-
-double peyman_r(double g, float e1, float e2, float e3)
-{
-    double l;
-    if ((1-e2) < (1-e1)*(e3))
-        l=((1)/((1-e1)*(e3))) ;
-    else 
-        l=((-g*(-1+e2+e3-(e1*e3)))/((2-e3-e2)*(1-e1)*e3 -(1-e3)*(-1+e2+e3-e1*e3)));
-
-    return l;
-}
-
-float peyman_source(double g, float e1, float e2, float e3)
-{
-    float l;
-    if ((1-e2) < (1-e1)*(e3))
-        l=((1)/((1-e1)*(e3)));
-    else
-        l=((-g*(-1+e2+e3-(e1*e3)))/((2-e3-e2)*(1-e1)*e3 -(1-e3)*(-1+e2+e3-e1*e3)));
-
-    double d_r=l-l*e3;
-    float nom = ((g - (l-l*e3)));
-    float denom = (2-(e2+e3));
-    float budget=l +(nom/denom);
-
-    return budget;
-}
-
-float peyman_helper(double g, float e1, float e2, float e3)
-{
-    float r;
-
-    if ((1-e2) < (1-e1)*(e3))
-        r = ((1)/((1-e1)*(e3)));
-    else 
-        r = ((-g*(-1+e2+e3-(e1*e3)))/((2-e3-e2)*(1-e1)*e3 -(1-e3)*(-1+e2+e3-e1*e3)));
-
-
-
-    float d_r=r*(1-e3);
-    return ((g - r*(1-e3)))/(2-(e2+e3));
-}
-
-float peyman_helper_th(double g, float e1, float e2, float e3)
-{
-    float r;
-
-    if ((1-e2) < (1-e1)*(e3))
-        r = ((1)/((1-e1)*(e3)));
-    else 
-        r = ((-g*(-1+e2+e3-(e1*e3)))/((2-e3-e2)*(1-e1)*e3 -(1-e3)*(-1+e2+e3-e1*e3)));
-
-    return r*(1-e1);
-}
-
-bool r_test(uint8_t e1, uint8_t e2, uint8_t e3)
-{
-    return ONE - e2 < e3 - e1*e3/ONE;
-}
-
-size_t r_val(size_t g, uint8_t e1, uint8_t e2, uint8_t e3)
-{
-    size_t nom, denom;
-
-    if (r_test(e1, e2, e3)) {
-        denom = e3 - e1*e3/ONE;
-        return ONE/denom + (ONE % denom != 0);
-    } else {
-        nom = ONE*g - g*e2 - g*e3 + g*e1*e3/ONE;
-        denom = ONE + e1*e3*e2/ONE/ONE - e2 - e1*e3/ONE;
-        return nom/denom + (nom % denom != 0);
-    }
-}
-
-size_t source_budget(size_t g, uint8_t e1, uint8_t e2, uint8_t e3)
-{
-    size_t nom, denom, r = r_val(g, e1, e2, e3);
-
-    nom = g*ONE + r*ONE - r*e2;
-    denom = 2*ONE - e3 - e2;
-
-    return 1.06*nom/denom + (nom % denom != 0);
-}
-
-size_t helper_max_budget(size_t g, uint8_t e1, uint8_t e2, uint8_t e3)
-{
-    size_t nom, denom, r = r_val(g, e1, e2, e3);
-
-    nom = e3*r - r*ONE + g*ONE;
-    denom = 2*ONE - e3 - e2;
-
-    return nom/denom + (nom % denom != 0);
-}
-
-size_t helper_threshold(size_t g, uint8_t e1, uint8_t e2, uint8_t e3)
-{
-    size_t r = r_val(g, e1, e2, e3);
+#include "budgets.hpp"
 
-    return r - r*e1/ONE;
-}
-
-double helper_credit(size_t g, uint8_t e1, uint8_t e2, uint8_t e3)
-{
-        return (float)ONE/(ONE - e1);
-}
-
-size_t relay_credit(size_t g, uint8_t e1, uint8_t e2, uint8_t e3)
-{
-    return ONE/(ONE - e3*e1/ONE) + (ONE % (ONE - e3*e1/ONE) != 0);
-}
+#define ONE BUDGET_ONE
 
 void print_usage(const char *arg0)
 {
     std::cout << "Usage:" << std::endl;;
     std::cout << "  " << arg0 << " <g> <e1> <e2> <e3>" << std::endl;
+    std::cout << "  " << arg0 << " --check <g>" << std::endl;
     std::cout << std::endl;
     std::cout << "   g: Generation size" << std::endl;
     std::cout << "  e1: Error probability percentage from source to helper" << std::endl;
     std::cout << "  e2: Error probability percentage from helper to relay" << std::endl;
     std::cout << "  e3: Error probability percentage from source to relay" << std::endl;
     std::cout << std::endl;
+    std::cout << "  --check: Compare scaled budgets with real valued formulas for all errors" << std::endl;
+    std::cout << std::endl;
     std::cout << "Example:" << std::endl;
     std::cout << "  " << arg0 << " 32 10 20 30" << std::endl;
 }
@@ -147,10 +45,66 @@ size_t read_arg_error(const char *arg)
     return -1;
 }
 
+/*
+ * Compare the scaled source budgets used by fox with the real valued
+ * formulas for all errors where these are defined, and fail if any deviates
+ * more than BUDGET_TOLERANCE.
+ */
+int check(size_t g)
+{
+    size_t e1, e2, e3, checked = 0, failed = 0;
+    double bs, dev, max_dev = 0;
+
+    for (e1 = 0; e1 < ONE; e1++) {
+        for (e2 = 0; e2 < ONE; e2++) {
+            for (e3 = 0; e3 < ONE; e3++) {
+                budget_reference ref(g, e1/(double)ONE, e2/(double)ONE,
+                                     e3/(double)ONE);
+
+                if (!isfinite(ref.source) || ref.source <= 0)
+                    continue;
+
+                bs = budget_real(g, e1, e2, e3).source(1);
+                dev = fabs(bs - ref.source)/ref.source;
+                checked++;
+
+                if (dev > max_dev)
+                    max_dev = dev;
+
+                if (dev <= BUDGET_TOLERANCE)
+                    continue;
+
+                if (failed++ < 10)
+                    std::cerr << "Deviation at e1=" << e1 << ", e2=" << e2
+                              << ", e3=" << e3 << ": Bs " << bs << " != "
+                              << ref.source << std::endl;
+            }
+        }
+    }
+
+    std::cout << "Checked " << checked << " budgets for g=" << g << ": "
+              << failed << " above " << BUDGET_TOLERANCE*100 << "%"
+              << std::endl;
+    std::cout << "Largest deviation of Bs from real valued formula: "
+              << max_dev*100 << "%" << std::endl;
+
+    return failed ? 1 : 0;
+}
+
 int main(int argc, char **argv)
 {
     float g, e1, e2, e3;
 
+    if (argc == 3 && std::string(argv[1]) == "--check") {
+        g = strtol(argv[2], NULL, 0);
+        if (g == 0) {
+            std::cerr << "Invalid generation size (expected g > 0, but " << argv[2] << " was given)" << std::endl;
+            return -1;
+        }
+
+        return check(g);
+    }
+
     if (argc != 5) {
         std::cerr << "Invalid number arguments (expected 4, but " << argc << " was given)" << std::endl;
         print_usage(argv[0]);
@@ -177,24 +131,35 @@ int main(int argc, char **argv)
     std::cout << "e2: " << argv[3] << "/100 (" << e2 << "/255)" << std::endl;
     std::cout << "e3: " << argv[4] << "/100 (" << e3 << "/255)" << std::endl;
 
+    budget_terms t = budget_formulas(g, e1, e2, e3);
+
     std::cout << "Scaled values:" << std::endl;
-    std::cout << "  r" << (r_test(e1, e2, e3) ? "a: " : "b: ") << r_val(g, e1, e2, e3) << std::endl;
-    std::cout << "  Bs: " << source_budget(g, e1, e2, e3) << std::endl;
-    std::cout << "  Bh: " << helper_max_budget(g, e1, e2, e3) << std::endl;
-    std::cout << "  Th: " << helper_threshold(g, e1, e2, e3) << std::endl;
-    std::cout << "  Ch: " << helper_credit(g, e1, e2, e3) << std::endl;
-    std::cout << "  Cr: " << relay_credit(g, e1, e2, e3) << std::endl;
+    std::cout << "  r" << (budget_r_test(e1, e2, e3) ? "a: " : "b: ") << t.r << std::endl;
+    std::cout << "  Bs: " << t.source(1.06) << std::endl;
+    std::cout << "  Bh: " << t.helper(1) << std::endl;
+    std::cout << "  Th: " << t.threshold << std::endl;
+    std::cout << "  Ch: " << (float)ONE/(ONE - e1) << std::endl;
+    std::cout << "  Cr: " << ceil(budget_credit(e1, e3)) << std::endl;
+    std::cout << std::endl;
+
+    t = budget_real(g, e1, e2, e3);
+
+    std::cout << "Fox values:" << std::endl;
+    std::cout << "   r: " << t.r << std::endl;
+    std::cout << "  Bs: " << t.source(1.06) << std::endl;
+    std::cout << "  Bh: " << t.helper(1) << std::endl;
+    std::cout << "  Th: " << t.threshold << std::endl;
     std::cout << std::endl;
 
-    e1 = strtol(argv[2], NULL, 0)/100.0;
-    e2 = strtol(argv[3], NULL, 0)/100.0;
-    e3 = strtol(argv[4], NULL, 0)/100.0;
+    budget_reference ref(g, strtol(argv[2], NULL, 0)/100.0,
+                         strtol(argv[3], NULL, 0)/100.0,
+                         strtol(argv[4], NULL, 0)/100.0);
 
     std::cout << "Peymans values:" << std::endl;
-    std::cout << "   r: " << peyman_r(g, e1, e2, e3) << std::endl;
-    std::cout << "  Bs: " << peyman_source(g, e1, e2, e3) << std::endl;
-    std::cout << "  Bh: " << peyman_helper(g, e1, e2, e3) << std::endl;
-    std::cout << "  Th: " << peyman_helper_th(g, e1, e2, e3) << std::endl;
+    std::cout << "   r: " << ref.r << std::endl;
+    std::cout << "  Bs: " << ref.source << std::endl;
+    std::cout << "  Bh: " << ref.helper << std::endl;
+    std::cout << "  Th: " << ref.threshold << std::endl;
 
     return 0;
 }